@@ -0,0 +1,536 @@
+/*
+ * End-to-end benchmark: private dbus-daemon, mock Bot API, stub scripts.
+ * Drives bus methods at given concurrency, every request is timed from
+ * call to jobFinished signal.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <systemd/sd-bus.h>
+
+#define BENCH_OPS       4
+#define BENCH_BUF       65536
+#define BENCH_READY_S   10
+#define BENCH_JOB_S     60
+#define BENCH_SAMPLE_MS 50
+#define BENCH_ORDERS    8           // Orders per clear and export
+
+typedef struct benchSampleS {
+    uint64_t call;                  // us, call to reply
+    uint64_t done;                  // us, call to jobFinished
+} benchSample;
+
+typedef struct benchOpS {
+    const char *name;
+    pthread_mutex_t lock;
+    benchSample *samples;
+    int count;
+    int size;
+    atomic_int failed;
+} benchOp;
+
+typedef struct benchWorkerS {
+    pthread_t thread;
+    int index;
+    uint64_t waitId;
+    bool finished;
+} benchWorker;
+
+// Local variables
+static const char *busName = "com.agrocorp.control";
+static const char *busPath = "/com/agrocorp/control";
+static const char *executor;
+static const char *scripts;
+static int concurrency = 8;
+static int requests = 200;
+static char tmpDir[] = "/tmp/executor-bench-XXXXXX";
+static atomic_int nextRequest;
+static atomic_int apiRequests;
+static atomic_bool stop;
+static pid_t daemonPid, busPid;
+static int peakThreads;
+static long peakRss;
+
+static benchOp ops[BENCH_OPS] = {
+    { .name = "run",    .lock = PTHREAD_MUTEX_INITIALIZER },
+    { .name = "tail",   .lock = PTHREAD_MUTEX_INITIALIZER },
+    { .name = "export", .lock = PTHREAD_MUTEX_INITIALIZER },
+    { .name = "clear",  .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+static bool enabled[BENCH_OPS] = { true, true, true, true };
+
+static uint64_t bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void bench_record(benchOp *op, uint64_t call, uint64_t done) {
+    pthread_mutex_lock(&op->lock);
+    if(op->count == op->size) {
+        op->size = op->size ? op->size * 2 : 64;
+        op->samples = realloc(op->samples, op->size * sizeof(benchSample));
+    }
+    op->samples[op->count++] = (benchSample){ call, done };
+    pthread_mutex_unlock(&op->lock);
+}
+
+/**
+ * @brief Mock Bot API connection: every request gets ok with new message id
+ */
+static void *bench_api_conn(void *data) {
+    int fd = (intptr_t)data, id;
+    char *buf = malloc(BENCH_BUF), *hdr, *p, resp[256], body[96];
+    size_t len = 0, need;
+    ssize_t r;
+    long clen;
+
+    while(!stop) {
+        hdr = memmem(buf, len, "\r\n\r\n", 4);
+        if(!hdr) {
+            if(len == BENCH_BUF) break;
+            if((r = read(fd, buf + len, BENCH_BUF - len)) <= 0) break;
+            len += r;
+            if(!memmem(buf, len, "\r\n\r\n", 4) && memmem(buf, len, "100-continue", 12)) continue;
+            if((hdr = memmem(buf, len, "\r\n\r\n", 4)) && memmem(buf, hdr - buf, "100-continue", 12)) {
+                if(write(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25) < 0) break;
+            }
+            continue;
+        }
+        hdr += 4;
+        p = memmem(buf, hdr - buf, "Content-Length:", 15);
+        clen = p ? strtol(p + 15, NULL, 10) : 0;
+        need = hdr - buf + clen;
+        // Body is not kept, only its end is waited for
+        while(len < need) {
+            size_t keep = hdr - buf;
+            if(len == BENCH_BUF) {
+                need -= len - keep;
+                len = keep;
+            }
+            if((r = read(fd, buf + len, BENCH_BUF - len)) <= 0) goto out;
+            len += r;
+        }
+        id = atomic_fetch_add(&apiRequests, 1) + 1;
+        snprintf(body, sizeof(body), "{\"ok\":true,\"result\":{\"message_id\":%d}}", id);
+        r = snprintf(resp, sizeof(resp), "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                                         "Content-Length: %zu\r\n\r\n%s", strlen(body), body);
+        if(write(fd, resp, r) != r) break;
+        memmove(buf, buf + need, len - need);
+        len -= need;
+    }
+out:
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+static void *bench_api(void *data) {
+    int lfd = (intptr_t)data, fd;
+    pthread_t t;
+
+    while((fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        pthread_create(&t, NULL, bench_api_conn, (void *)(intptr_t)fd);
+        pthread_detach(t);
+    }
+    return NULL;
+}
+
+static int bench_api_start() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(sa);
+    pthread_t t;
+
+    if(fd < 0 || bind(fd, (struct sockaddr *)&sa, len) < 0 || listen(fd, 64) < 0
+        || getsockname(fd, (struct sockaddr *)&sa, &len) < 0) {
+        return -errno;
+    }
+    pthread_create(&t, NULL, bench_api, (void *)(intptr_t)fd);
+    pthread_detach(t);
+    return ntohs(sa.sin_port);
+}
+
+static int bench_spawn(pid_t *pid, char *const argv[], int outFd) {
+    int r;
+    posix_spawn_file_actions_t fa;
+
+    posix_spawn_file_actions_init(&fa);
+    if(outFd >= 0) posix_spawn_file_actions_adddup2(&fa, outFd, STDOUT_FILENO);
+    r = posix_spawn(pid, argv[0], &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    return -r;
+}
+
+/**
+ * @brief Starts private bus, allowing anyone to own and call anything
+ */
+static int bench_bus_start() {
+    int r, pfd[2];
+    char conf[PATH_MAX], addr[PATH_MAX + 32], arg[PATH_MAX + 16];
+    FILE *f;
+
+    snprintf(conf, sizeof(conf), "%s/bus.conf", tmpDir);
+    f = fopen(conf, "w");
+    if(!f) return -errno;
+    fprintf(f, "<!DOCTYPE busconfig PUBLIC \"-//freedesktop//DTD D-BUS Bus Configuration 1.0//EN\"\n"
+               " \"http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd\">\n"
+               "<busconfig>\n"
+               "  <listen>unix:path=%s/bus</listen>\n"
+               "  <auth>EXTERNAL</auth>\n"
+               "  <policy context=\"default\">\n"
+               "    <allow user=\"*\"/>\n"
+               "    <allow own=\"*\"/>\n"
+               "    <allow send_destination=\"*\"/>\n"
+               "    <allow receive_sender=\"*\"/>\n"
+               "  </policy>\n"
+               "</busconfig>\n", tmpDir);
+    fclose(f);
+
+    if(pipe2(pfd, O_CLOEXEC) < 0) return -errno;
+    snprintf(arg, sizeof(arg), "--config-file=%s", conf);
+    r = bench_spawn(&busPid, (char *[]){ "/usr/bin/env", "dbus-daemon", arg, "--nofork", "--print-address", NULL }, pfd[1]);
+    close(pfd[1]);
+    if(r < 0) {
+        close(pfd[0]);
+        return r;
+    }
+    f = fdopen(pfd[0], "r");
+    if(!fgets(addr, sizeof(addr), f)) {
+        fclose(f);
+        return -EPIPE;
+    }
+    fclose(f);
+    addr[strcspn(addr, "\n")] = 0;
+    // Both executor and this process connect to it as system bus
+    setenv("DBUS_SYSTEM_BUS_ADDRESS", addr, 1);
+    return 0;
+}
+
+static int bench_executor_start(int port) {
+    char out[PATH_MAX], log[PATH_MAX], spool[PATH_MAX], conf[PATH_MAX], url[64];
+    FILE *f;
+    int i;
+
+    snprintf(out, sizeof(out), "%s/out", tmpDir);
+    mkdir(out, 0755);
+    snprintf(log, sizeof(log), "%s/php.log", tmpDir);
+    f = fopen(log, "w");
+    for(i = 0; f && i < 1000; i++) {
+        fprintf(f, "[bench] PHP Notice: line %d in /bench/stub.php\n", i);
+    }
+    if(f) fclose(f);
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/bot", port);
+    snprintf(spool, sizeof(spool), "%s/reports.spool", tmpDir);
+    // Repeated requests must run, not be answered from result cache
+    snprintf(conf, sizeof(conf), "%s/executor.json", tmpDir);
+    f = fopen(conf, "w");
+    if(f) {
+        fprintf(f, "{ \"job_cache_ttl\": 0 }\n");
+        fclose(f);
+    }
+
+    return bench_spawn(&daemonPid, (char *[]){ (char *)executor, "-c", "-q", "--scripts", (char *)scripts
+                     , "--out", out, "--php-log", log, "--api-url", url, "--spool", spool
+                     , "--config", conf, NULL }, -1);
+}
+
+static int bench_wait_ready(sd_bus *bus) {
+    int r, has = 0;
+    uint64_t end = bench_now() + BENCH_READY_S * 1000000ULL;
+    sd_bus_message *reply;
+
+    while(bench_now() < end) {
+        reply = NULL;
+        r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus"
+                              , "NameHasOwner", NULL, &reply, "s", busName);
+        if(r >= 0) sd_bus_message_read(reply, "b", &has);
+        sd_bus_message_unref(reply);
+        if(has) return 0;
+        if(waitpid(daemonPid, NULL, WNOHANG) == daemonPid) return -ECHILD;
+        usleep(20000);
+    }
+    return -ETIMEDOUT;
+}
+
+static int bench_finished_cb(sd_bus_message *m, void *userdata, sd_bus_error *retError) {
+    int code;
+    uint64_t id, duration, bytes;
+    benchWorker *w = userdata;
+
+    if(sd_bus_message_read(m, "titt", &id, &code, &duration, &bytes) >= 0 && id == w->waitId) {
+        w->finished = true;
+    }
+    return 0;
+}
+
+/**
+ * @brief Calls op, returns job id or 0
+ */
+static uint64_t bench_call(sd_bus *bus, int op, int n, uint32_t chat) {
+    int i, r;
+    uint64_t id = 0;
+    sd_bus_message *m = NULL, *reply = NULL;
+    sd_bus_error err = SD_BUS_ERROR_NULL;
+
+    switch(op) {
+        case 0:
+            r = sd_bus_call_method(bus, busName, busPath, busName, "run", &err, &reply, "su", n % 2 ? "cars" : "geos", chat);
+            break;
+        case 1:
+            r = sd_bus_call_method(bus, busName, busPath, busName, "tail", &err, &reply, "iu", 10 + n % 50, chat);
+            break;
+        default:
+            r = sd_bus_message_new_method_call(bus, &m, busName, busPath, busName, op == 2 ? "export" : "clear");
+            if(r >= 0) r = sd_bus_message_append(m, "u", chat);
+            if(r >= 0) r = sd_bus_message_open_container(m, SD_BUS_TYPE_ARRAY, "u");
+            for(i = 0; i < BENCH_ORDERS && r >= 0; i++) {
+                r = sd_bus_message_append(m, "u", (uint32_t)(n * BENCH_ORDERS + i + 1));
+            }
+            if(r >= 0) r = sd_bus_message_close_container(m);
+            if(r >= 0) r = sd_bus_call(bus, m, 0, &err, &reply);
+            sd_bus_message_unref(m);
+            break;
+    }
+    if(r >= 0) sd_bus_message_read(reply, "t", &id);
+    else fprintf(stderr, "%s: %s\n", ops[op].name, err.message ? err.message : strerror(-r));
+    sd_bus_error_free(&err);
+    sd_bus_message_unref(reply);
+    return id;
+}
+
+static bool bench_job_done(sd_bus *bus, uint64_t id) {
+    bool done = false;
+    const char *title, *state;
+    uint32_t chat;
+    sd_bus_message *reply = NULL;
+
+    // Reply is "susitt", only title, chat and state are needed
+    if(sd_bus_call_method(bus, busName, busPath, busName, "getJob", NULL, &reply, "t", id) >= 0
+        && sd_bus_message_read(reply, "sus", &title, &chat, &state) >= 0) {
+        done = strcmp(state, "queued") && strcmp(state, "running");
+    }
+    sd_bus_message_unref(reply);
+    return done;
+}
+
+static void *bench_worker(void *data) {
+    int n, op;
+    uint64_t t0, t1, end;
+    char match[256];
+    benchWorker *w = data;
+    sd_bus *bus = NULL;
+
+    if(sd_bus_open_system(&bus) < 0) return NULL;
+    snprintf(match, sizeof(match), "type='signal',sender='%s',interface='%s',member='jobFinished'", busName, busName);
+    sd_bus_add_match(bus, NULL, match, bench_finished_cb, w);
+
+    while(!stop && (n = atomic_fetch_add(&nextRequest, 1)) < requests) {
+        for(op = n % BENCH_OPS; !enabled[op]; op = (op + 1) % BENCH_OPS);
+        w->finished = false;
+        t0 = bench_now();
+        w->waitId = bench_call(bus, op, n, 1000 + w->index);
+        t1 = bench_now();
+        if(!w->waitId) {
+            atomic_fetch_add(&ops[op].failed, 1);
+            continue;
+        }
+        // Joined or cached job may have finished before signal was matched
+        if(bench_job_done(bus, w->waitId)) w->finished = true;
+        end = t1 + BENCH_JOB_S * 1000000ULL;
+        while(!w->finished && bench_now() < end) {
+            if(sd_bus_process(bus, NULL) > 0) continue;
+            sd_bus_wait(bus, 100000);
+        }
+        if(!w->finished) atomic_fetch_add(&ops[op].failed, 1);
+        else bench_record(&ops[op], t1 - t0, bench_now() - t0);
+    }
+    sd_bus_flush_close_unref(bus);
+    return NULL;
+}
+
+/**
+ * @brief Samples executor threads and RSS until stopped
+ */
+static void *bench_sampler(void *data) {
+    char path[64], line[128];
+    int threads;
+    long rss;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", daemonPid);
+    while(!stop) {
+        if((f = fopen(path, "r"))) {
+            while(fgets(line, sizeof(line), f)) {
+                if(sscanf(line, "Threads: %d", &threads) == 1 && threads > peakThreads) peakThreads = threads;
+                if(sscanf(line, "VmHWM: %ld", &rss) == 1 && rss > peakRss) peakRss = rss;
+            }
+            fclose(f);
+        }
+        usleep(BENCH_SAMPLE_MS * 1000);
+    }
+    return NULL;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t bench_pct(uint64_t *v, int n, double q) {
+    int i = q * n;
+    return n ? v[i < n ? i : n - 1] : 0;
+}
+
+static void bench_report(uint64_t wallUs) {
+    int i, k, total = 0, failed = 0;
+    uint64_t *call, *done;
+    benchOp *op;
+
+    printf("%-8s %7s %6s %10s %10s %10s %10s\n", "op", "ok", "fail", "call p50", "call p99", "done p50", "done p99");
+    for(i = 0; i < BENCH_OPS; i++) {
+        op = &ops[i];
+        if(!enabled[i]) continue;
+        call = malloc((op->count + 1) * sizeof(uint64_t));
+        done = malloc((op->count + 1) * sizeof(uint64_t));
+        for(k = 0; k < op->count; k++) {
+            call[k] = op->samples[k].call;
+            done[k] = op->samples[k].done;
+        }
+        qsort(call, op->count, sizeof(uint64_t), bench_cmp);
+        qsort(done, op->count, sizeof(uint64_t), bench_cmp);
+        printf("%-8s %7d %6d %8.2fms %8.2fms %8.2fms %8.2fms\n", op->name, op->count, atomic_load(&op->failed)
+            , bench_pct(call, op->count, 0.5) / 1e3, bench_pct(call, op->count, 0.99) / 1e3
+            , bench_pct(done, op->count, 0.5) / 1e3, bench_pct(done, op->count, 0.99) / 1e3);
+        total += op->count;
+        failed += atomic_load(&op->failed);
+        free(call);
+        free(done);
+    }
+    printf("requests %d ok, %d failed in %.2fs: %.1f req/s, concurrency %d\n"
+        , total, failed, wallUs / 1e6, total / (wallUs / 1e6), concurrency);
+    printf("executor peak threads %d, peak RSS %.1f MiB, Bot API requests %d\n"
+        , peakThreads, peakRss / 1024.0, atomic_load(&apiRequests));
+}
+
+static int bench_rm(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+static void bench_stop(pid_t pid) {
+    if(pid <= 0) return;
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+static void bench_usage(const char *name) {
+    printf("Usage: %s --executor PATH --scripts DIR [--name BUS_NAME] [--path OBJECT_PATH]\n"
+           "\t[--concurrency N] [--requests N] [--ops run,tail,export,clear]\n", name);
+}
+
+static int bench_options(int argc, char **argv) {
+    int i, k;
+    char *tok, *save;
+    static const struct option opts[] = {
+        {"executor",    required_argument,  0,  'e'},
+        {"scripts",     required_argument,  0,  's'},
+        {"name",        required_argument,  0,  'n'},
+        {"path",        required_argument,  0,  'p'},
+        {"concurrency", required_argument,  0,  'c'},
+        {"requests",    required_argument,  0,  'r'},
+        {"ops",         required_argument,  0,  'o'},
+        {"help",        no_argument,        0,  'h'},
+        {0}
+    };
+
+    while((i = getopt_long(argc, argv, "e:s:n:p:c:r:o:h", opts, NULL)) != -1) {
+        switch(i) {
+            case 'e': executor = optarg; break;
+            case 's': scripts = optarg; break;
+            case 'n': busName = optarg; break;
+            case 'p': busPath = optarg; break;
+            case 'c': concurrency = atoi(optarg); break;
+            case 'r': requests = atoi(optarg); break;
+            case 'o':
+                memset(enabled, 0, sizeof(enabled));
+                for(tok = strtok_r(optarg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+                    for(k = 0; k < BENCH_OPS && strcmp(ops[k].name, tok); k++);
+                    if(k == BENCH_OPS) return -EINVAL;
+                    enabled[k] = true;
+                }
+                break;
+            default: return -EINVAL;
+        }
+    }
+    for(k = 0; k < BENCH_OPS && !enabled[k]; k++);
+    if(!executor || !scripts || concurrency < 1 || requests < 1 || k == BENCH_OPS) return -EINVAL;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int r, i, port;
+    uint64_t t0;
+    pthread_t sampler;
+    benchWorker *workers;
+    sd_bus *bus = NULL;
+
+    if(bench_options(argc, argv) < 0) {
+        bench_usage(argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if(!mkdtemp(tmpDir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    r = bench_bus_start();
+    if(r < 0) fprintf(stderr, "dbus-daemon start error: %s\n", strerror(-r));
+    if(r >= 0 && (port = r = bench_api_start()) < 0) fprintf(stderr, "Mock API error: %s\n", strerror(-r));
+    if(r >= 0 && (r = bench_executor_start(port)) < 0) fprintf(stderr, "%s start error: %s\n", executor, strerror(-r));
+    if(r >= 0 && (r = sd_bus_open_system(&bus)) < 0) fprintf(stderr, "Bus connect error: %s\n", strerror(-r));
+    if(r >= 0 && (r = bench_wait_ready(bus)) < 0) fprintf(stderr, "Executor not ready: %s\n", strerror(-r));
+
+    if(r >= 0) {
+        pthread_create(&sampler, NULL, bench_sampler, NULL);
+        workers = calloc(concurrency, sizeof(benchWorker));
+        t0 = bench_now();
+        for(i = 0; i < concurrency; i++) {
+            workers[i].index = i;
+            pthread_create(&workers[i].thread, NULL, bench_worker, &workers[i]);
+        }
+        for(i = 0; i < concurrency; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        bench_report(bench_now() - t0);
+        stop = true;
+        pthread_join(sampler, NULL);
+        free(workers);
+    }
+
+    sd_bus_flush_close_unref(bus);
+    stop = true;
+    bench_stop(daemonPid);
+    bench_stop(busPid);
+    nftw(tmpDir, bench_rm, 16, FTW_DEPTH | FTW_PHYS);
+    return r < 0 ? 1 : 0;
+}
@@ -0,0 +1,7 @@
+#!/bin/sh
+# Benchmark stub: m_clean_orders.php -o ORDER...
+shift
+for o in "$@"; do
+    echo "order $o cleared"
+done
+sleep 0.05
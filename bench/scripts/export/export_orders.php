@@ -0,0 +1,12 @@
+#!/bin/sh
+# Benchmark stub: export_orders.php PREFIX -o ORDER...
+# writes PREFIX.json and PREFIX.pretty.json
+prefix=$1
+shift 2
+json=""
+for o in "$@"; do
+    json="$json${json:+,}{\"order\":$o}"
+done
+sleep 0.05
+echo "[$json]" > "$prefix.json"
+echo "[$json]" > "$prefix.pretty.json"
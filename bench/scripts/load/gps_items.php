@@ -0,0 +1,6 @@
+#!/bin/sh
+# Benchmark stub: short load with streamed progress
+for i in 1 2 3 4 5; do
+    echo "item batch $i"
+    sleep 0.02
+done
@@ -12,16 +12,65 @@
 #define SQL_BASE    "@db_base@"
 #define SQL_USER    "@db_user@"
 #define SQL_PASS    "@db_pass@"
+#define DB_POOL     @db_pool@
+#define DB_PING_S   @db_ping@
+#define DB_LOOKUP   @db_lookup@
 #define API_KEY     "@tg_key@"
 #define ADMIN_CHAT  @tg_chat@
 
+// Telegram delivery
+#define TG_CHAT_RATE    @tg_chat_rate@
+#define TG_GLOBAL_RATE  @tg_global_rate@
+#define TG_COALESCE_MS  @tg_coalesce@
+#define TG_PROGRESS_MS  @tg_progress@
+#define TG_SPOOL        "@tg_spool@"
+
+// Job pool
+#define POOL_WORKERS    @pool_workers@
+#define POOL_QUEUE      @pool_queue@
+#define POOL_BLOCK      @pool_block@
+#define POOL_TIMEOUT_MS @pool_timeout@
+
+// Job limits
+#define JOB_CPU_WEIGHT      @job_cpu_weight@
+#define JOB_MEMORY_MB       @job_memory_max@
+#define JOB_TIMEOUT_S       @job_timeout@
+#define JOB_KILL_GRACE_S    @job_kill_grace@
+#define JOB_CACHE_TTL_S     @job_cache_ttl@
+
+// Export
+#define EXPORT_SHARDS       @export_shards@
+
+// PHP backend
+#define PHP_FCGI            @php_fcgi@
+#define PHP_FCGI_SOCKET     "@php_fcgi_socket@"
+#define PHP_WATCH_CHAT      @php_watch_chat@
+#define PHP_WATCH_INTERVAL_S @php_watch_interval@
+
+// Shared command queue
+#define QUEUE_BATCH         @queue_batch@
+#define QUEUE_LEASE_S       @queue_lease@
+#define QUEUE_POLL_MS       @queue_poll@
+#define QUEUE_CHAT          @queue_chat@
+
+// Metrics
+#define METRICS_LISTEN      "@metrics_listen@"
+
 // Bus
 #define DBUS_THIS_NAME          "@bus_srv_name@"
 #define DBUS_THIS_PATH          "@bus_srv_path@"
 
+// Logging
+#define LOG_LEVEL_COMPILE   @log_level_max@
+#define LOG_ROTATE_MB       @log_rotate_size@
+#define LOG_ROTATE_HOURS    @log_rotate_age@
+#define LOG_ROTATE_KEEP     @log_keep@
+
 // File locations
 #define LOG_FILENAME        "@log_file@"
 #define SCRIPTS_PATH        "@path@"
 #define GIT_PATH            "@git_path@"
 #define OUT_PATH            "@out_path@"
-#define PHP_LOG             "@php_log@"
\ No newline at end of file
+#define PHP_LOG             "@php_log@"
+#define COMMANDS_FILE       "@commands_file@"
+#define CONF_FILE           "@config_file@"
\ No newline at end of file
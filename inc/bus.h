@@ -1,4 +1,7 @@
 #pragma once
+#include <stdint.h>
 
 int bus_init();
-void bus_process();
\ No newline at end of file
+void bus_deinit();
+void bus_job_finished(uint64_t id, int code, uint64_t durationUs, uint64_t bytes);
+void bus_pulled(uint64_t id, const char *from, const char *to, char **paths);
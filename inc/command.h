@@ -0,0 +1,32 @@
+#pragma once
+#include <stdbool.h>
+
+extern const char *gCommandsPath;
+
+typedef struct commandClassS commandClass;
+typedef struct commandTableS commandTable;
+typedef bool (*commandClassFunc)(void *userdata);  // false = not started
+
+// Command defined in commands file
+typedef struct commandDefS {
+    char *name;
+    char *script;           // Absolute path
+    char **args;            // argv template, NULL terminated
+    char *output;           // Output file name in out directory, NULL = none
+    char *document;         // File in out directory sent on success
+    bool capture;           // Output is reported even when short
+    bool live;              // Progress message while running
+    bool php;               // May run in FastCGI pool
+    bool cache;             // Result may answer repeated requests
+    unsigned timeoutS;      // 0 = JOB_TIMEOUT_S
+    commandClass *cls;      // NULL = unlimited
+} commandDef;
+
+int command_init();
+int command_load(const char *path);
+commandTable *command_table_get();
+void command_table_put(commandTable *t);
+const commandDef *command_find(const commandTable *t, const char *name);
+bool command_class_enter(commandClass *c, commandClassFunc run, void *userdata);
+void command_class_leave(commandClass *c);
+void command_deinit();
@@ -0,0 +1,35 @@
+#pragma once
+#include <stdatomic.h>
+
+extern const char *gConfPath;
+
+// Runtime settings, compiled values are defaults. Published snapshot is
+// never changed, reload swaps in a new one (see conf_get).
+typedef struct confS {
+    atomic_int refs;
+    int logLevel;
+    int poolWorkers;
+    int poolQueue;
+    int tgChatRate;
+    int tgGlobalRate;
+    int tgCoalesceMs;
+    int tgProgressMs;
+    char apiUrl[256];
+    char apiKey[128];
+    char metricsListen[108];
+    char fcgiSocket[108];
+    char dbServ[128];
+    int dbPort;
+    char dbBase[64];
+    char dbUser[64];
+    char dbPass[128];
+    unsigned dbGen;             // Changes with any db_* value
+    int jobTimeoutS;
+    int jobCacheTtlS;
+} confStruct;
+
+int conf_init();
+int conf_reload();
+const confStruct *conf_get();
+void conf_put(const confStruct *c);
+void conf_deinit();
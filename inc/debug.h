@@ -1,5 +1,9 @@
 #pragma once
 #include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "config.h"
 
 /********************************
  *           LOGGING            *
@@ -16,20 +20,54 @@
 #define LOG_TYPE_NORMAL     0
 #define LOG_TYPE_EXTENDED   1
 
+#define LOG_SINK_FILE       0
+#define LOG_SINK_JOURNAL    1
+
+// Log modules, source file selects own by defining LOG_MODULE before includes
+#define LOG_MOD_ALL         -1
+#define LOG_MOD_MAIN        0
+#define LOG_MOD_BUS         1
+#define LOG_MOD_SYS         2
+#define LOG_MOD_REPORT      3
+#define LOG_MOD_STORAGE     4
+#define LOG_MOD_MAX         LOG_MOD_STORAGE
+
+#ifndef LOG_MODULE
+#define LOG_MODULE          LOG_MOD_MAIN
+#endif
+
+// Levels above LOG_LEVEL_COMPILE are removed by compiler, the rest are
+// checked against module runtime level before arguments are evaluated
+#define LOG_ENABLED(LVL)    ((LVL) <= LOG_LEVEL_COMPILE && (LVL) <= atomic_load_explicit (&gLogLevels[LOG_MODULE], memory_order_relaxed))
+
+extern _Atomic int gLogLevels[LOG_MOD_MAX + 1];
+extern int gLogLevel;
+extern int gLogType;
+extern int gLogConsole;
+extern int gLogSink;
+extern const char *logLevelHeader[];
+
+int  log_init ();
+int  log_set_level (int module, int level);
+int  log_module (const char *name);
+void log_flush ();
+void log_set_job (uint64_t job);
+void log_set_chat (uint32_t chat);
+void log_deinit ();
 void selfLogFunction (const char *file, int line, const char *func, int lvl, const char* fmt, ...);
 
 // Log always
-#define log(FMT, ...)    selfLogFunction ((const char *)(__FILE__), __LINE__, (const char *)(__PRETTY_FUNCTION__), LOG_LEVEL_ALWAYS,  FMT __VA_OPT__ (,) __VA_ARGS__)
+#define log(FMT, ...)    do { if (LOG_ENABLED (LOG_LEVEL_ALWAYS)) selfLogFunction ((const char *)(__FILE__), __LINE__, (const char *)(__PRETTY_FUNCTION__), LOG_LEVEL_ALWAYS,  FMT __VA_OPT__ (,) __VA_ARGS__); } while (0)
 // Log ERROR level
-#define logErr(FMT, ...) selfLogFunction ((const char *)(__FILE__), __LINE__, (const char *)(__PRETTY_FUNCTION__), LOG_LEVEL_ERROR,   FMT __VA_OPT__ (,) __VA_ARGS__)
+#define logErr(FMT, ...) do { if (LOG_ENABLED (LOG_LEVEL_ERROR)) selfLogFunction ((const char *)(__FILE__), __LINE__, (const char *)(__PRETTY_FUNCTION__), LOG_LEVEL_ERROR,   FMT __VA_OPT__ (,) __VA_ARGS__); } while (0)
 // Log WARNING level
-#define logWrn(FMT, ...) selfLogFunction ((const char *)(__FILE__), __LINE__, (const char *)(__PRETTY_FUNCTION__), LOG_LEVEL_WARNING, FMT __VA_OPT__ (,) __VA_ARGS__)
+#define logWrn(FMT, ...) do { if (LOG_ENABLED (LOG_LEVEL_WARNING)) selfLogFunction ((const char *)(__FILE__), __LINE__, (const char *)(__PRETTY_FUNCTION__), LOG_LEVEL_WARNING, FMT __VA_OPT__ (,) __VA_ARGS__); } while (0)
 // Log INFO level
-#define logInf(FMT, ...) selfLogFunction ((const char *)(__FILE__), __LINE__, (const char *)(__PRETTY_FUNCTION__), LOG_LEVEL_INFO,    FMT __VA_OPT__ (,) __VA_ARGS__)
+#define logInf(FMT, ...) do { if (LOG_ENABLED (LOG_LEVEL_INFO)) selfLogFunction ((const char *)(__FILE__), __LINE__, (const char *)(__PRETTY_FUNCTION__), LOG_LEVEL_INFO,    FMT __VA_OPT__ (,) __VA_ARGS__); } while (0)
 // Log DEBUG level
-#define logDbg(FMT, ...) selfLogFunction ((const char *)(__FILE__), __LINE__, (const char *)(__PRETTY_FUNCTION__), LOG_LEVEL_DEBUG,   FMT __VA_OPT__ (,) __VA_ARGS__)
+#define logDbg(FMT, ...) do { if (LOG_ENABLED (LOG_LEVEL_DEBUG)) selfLogFunction ((const char *)(__FILE__), __LINE__, (const char *)(__PRETTY_FUNCTION__), LOG_LEVEL_DEBUG,   FMT __VA_OPT__ (,) __VA_ARGS__); } while (0)
 // Log TRACE level
-#define logTrc(FMT, ...) selfLogFunction ((const char *)(__FILE__), __LINE__, (const char *)(__PRETTY_FUNCTION__), LOG_LEVEL_TRACE,   FMT __VA_OPT__ (,) __VA_ARGS__)
+#define logTrc(FMT, ...) do { if (LOG_ENABLED (LOG_LEVEL_TRACE)) selfLogFunction ((const char *)(__FILE__), __LINE__, (const char *)(__PRETTY_FUNCTION__), LOG_LEVEL_TRACE,   FMT __VA_OPT__ (,) __VA_ARGS__); } while (0)
 
 #define errorExit(CODE, FMT, ...) do { selfLogFunction ((const char *)(__FILE__), __LINE__, (const char *)(__PRETTY_FUNCTION__), LOG_LEVEL_ERROR,   FMT __VA_OPT__ (,) __VA_ARGS__); exit (-CODE); } while (0);
 
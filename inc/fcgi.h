@@ -0,0 +1,4 @@
+#pragma once
+#include "proc.h"
+
+int fcgi_run(char *const argv[], const procOptions *opt, procResult *res);
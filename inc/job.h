@@ -0,0 +1,37 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct jobS job;
+
+typedef enum {
+    JobQueued,
+    JobRunning,
+    JobDone,
+    JobFailed,
+    JobCancelled
+} jobState;
+
+typedef struct jobInfoS {
+    uint64_t id;
+    char title[64];
+    uint32_t chat;
+    jobState state;
+    int code;               // Exit code, valid when finished
+    uint64_t durationUs;    // Submit to finish, or so far
+    uint64_t bytes;         // Output bytes
+} jobInfo;
+
+int job_init();
+job *job_new(const char *title, uint32_t chat);
+uint64_t job_id(const job *j);
+bool job_start(job *j);
+void job_pid(job *j, pid_t pid, bool running);
+bool job_cancelled(job *j);
+void job_done(job *j, int code, uint64_t bytes);
+int job_get(uint64_t id, jobInfo *info);
+int job_list(jobInfo **list);
+int job_cancel(uint64_t id);
+const char *job_state_name(jobState state);
+void job_deinit();
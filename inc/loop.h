@@ -0,0 +1,14 @@
+#pragma once
+#include <stdbool.h>
+#include <systemd/sd-event.h>
+
+typedef void (*loopFunc)(void *userdata);
+
+int loop_block_signals();
+int loop_init();
+int loop_run();
+void loop_exit(int code);
+bool loop_on_thread();
+int loop_call(loopFunc func, loopFunc drop, void *userdata);
+sd_event *loop_event();
+void loop_deinit();
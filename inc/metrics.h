@@ -0,0 +1,21 @@
+#pragma once
+#include <stdint.h>
+
+typedef struct metricS metric;
+
+typedef enum {
+    MetricCounter,
+    MetricGauge,
+    MetricHistogram         // Microseconds, exported as seconds
+} metricType;
+
+int metrics_init();
+int metrics_relisten(const char *addr);
+metric *metrics_get(metricType type, const char *name, const char *help, const char *labels, ...);
+void metrics_add(metric *m, int64_t v);
+void metrics_set(metric *m, int64_t v);
+void metrics_observe(metric *m, uint64_t us);
+uint64_t metrics_total(const char *name);
+uint64_t metrics_quantile(const char *name, double q);
+uint64_t metrics_now();
+void metrics_deinit();
@@ -0,0 +1,11 @@
+#pragma once
+
+#define POOL_WORKERS_MAX    256
+
+typedef void *(*poolJobFunc)(void *pData);
+
+int pool_init(int workers, int queueSize);
+int pool_resize(int workers, int queueSize);
+int pool_submit(poolJobFunc func, void *pData);
+int pool_depth();
+void pool_deinit();
@@ -0,0 +1,59 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct procOutputS procOutput;
+typedef void (*procProgressFunc)(procOutput *out, void *userdata);
+
+// Streamed job output, filled by event loop thread while job runs
+struct procOutputS {
+    char *ring;             // Last ringSz bytes of output
+    size_t ringSz;
+    int spillFd;            // Copy of whole output, -1 when none
+    size_t bytes;           // Total output bytes
+    procProgressFunc progress;  // Called on new output, throttled
+    void *userdata;
+    uint64_t progressUs;    // Minimal interval between progress calls
+    uint64_t lastProgress;
+};
+
+typedef struct procOptionsS {
+    const char *cwd;        // Working directory, NULL keeps daemon's
+    const char *outFile;    // stdout and stderr go to file (truncated)
+    procOutput *output;     // or are streamed through pipe into output
+    void (*spawned)(pid_t pid, bool running, void *userdata);  // Around process lifetime
+    bool (*cancelled)(void *userdata);  // Polled by backends without process to kill
+    void *userdata;
+    unsigned timeoutS;      // Wall-clock limit, 0 = JOB_TIMEOUT_S
+} procOptions;
+
+typedef struct procResultS {
+    pid_t pid;
+    int error;              // Spawn or wait errno, 0 when process ran
+    int code;               // Exit code, valid when signal == 0
+    int signal;             // Terminating signal
+    bool core;
+    bool timedOut;          // Killed after JOB_TIMEOUT_S
+    bool cancelled;         // Killed by proc_kill
+    bool cgroup;            // Ran in own cgroup, usage below is cgroup wide
+    size_t bytes;           // Output bytes read from pipe
+    uint64_t spawnUs;       // Spawn call latency
+    uint64_t runUs;         // Spawn to exit
+    uint64_t cpuUserUs;
+    uint64_t cpuSysUs;
+    uint64_t memPeak;       // Bytes, memory.peak or max RSS
+} procResult;
+
+int proc_init();
+int proc_run(char *const argv[], const procOptions *opt, procResult *res);
+const char *proc_status(const procResult *res, char *buf, size_t sz);
+const char *proc_usage(const procResult *res, char *buf, size_t sz);
+unsigned proc_timeout(const procOptions *opt);
+int proc_kill(pid_t pid);
+int proc_output_init(procOutput *out, size_t ringSz, const char *spill);
+size_t proc_output_tail(const procOutput *out, char *buf, size_t sz);
+void proc_output_write(procOutput *out, const char *buf, size_t n);
+void proc_output_free(procOutput *out);
+void proc_deinit();
@@ -0,0 +1,4 @@
+#pragma once
+
+int queue_init();
+void queue_deinit();
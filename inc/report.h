@@ -1,4 +1,17 @@
+#pragma once
+
 #include <stdint.h>
 
+extern const char *gApiUrl;
+extern const char *gSpoolPath;
+
+typedef struct ReportLiveS ReportLive;
+
+int report_init();
+void report_deinit();
 int send_report(uint32_t chat, char *msg, uint32_t responseTo);
-int send_document(uint32_t chat, char *path, char *caption, uint32_t responseTo);
\ No newline at end of file
+int send_document(uint32_t chat, char *path, char *caption, uint32_t responseTo);
+int send_temp_document(uint32_t chat, char *path, char *caption, uint32_t responseTo);
+ReportLive *report_live_open(uint32_t chat, const char *text, uint32_t responseTo);
+void report_live_update(ReportLive *live, const char *text);
+void report_live_close(ReportLive *live, const char *text);
@@ -0,0 +1,18 @@
+#pragma once
+#include <stdint.h>
+
+typedef struct spoolEntryS {
+    uint32_t chat;
+    uint32_t responseTo;
+    int mode;
+    const char *msg;
+    const char *doc;        // Empty when not a document
+} spoolEntry;
+
+typedef void (*spoolReplayFunc)(int64_t id, const spoolEntry *e, void *userdata);
+
+int spool_open(const char *path);
+int64_t spool_append(const spoolEntry *e);
+void spool_ack(int64_t id);
+int spool_replay(spoolReplayFunc func, void *userdata);
+void spool_close();
@@ -1,6 +1,13 @@
 #pragma once
 #include "main.h"
 
+typedef void (*storageCommandFunc)(int r, const adminCommand *cmd, void *userdata);
+
 int storage_init(int argc, char **argv);
 int storage_get_command(int id, adminCommand *pCmd);
-void storage_close();
\ No newline at end of file
+int storage_get_command_async(int id, storageCommandFunc func, void *userdata);
+int storage_queue_prepare();
+int storage_claim(const char *node, int leaseS, adminCommand *cmds, int max);
+int storage_renew(const char *node, int id, int leaseS);
+int storage_finish(const char *node, int id, int code);
+void storage_close();
@@ -1,8 +1,13 @@
 #pragma once
 #include <stdint.h>
 
-int sys_run_command(char *cmd, uint32_t chat);
-int sys_tail(int count, uint32_t chat);
-int sys_pull(uint32_t chat);
-int sys_export(uint32_t chat, uint32_t *orders, int cnt);
-int sys_clear(uint32_t chat, uint32_t *orders, int cnt);
\ No newline at end of file
+extern const char *gScriptsPath;
+extern const char *gOutPath;
+extern const char *gPhpLog;
+
+uint64_t sys_run_command(char *cmd, uint32_t chat);
+uint64_t sys_tail(int count, uint32_t chat);
+uint64_t sys_pull(uint32_t chat);
+uint64_t sys_export(uint32_t chat, uint32_t *orders, int cnt);
+uint64_t sys_clear(uint32_t chat, uint32_t *orders, int cnt);
+void sys_deinit();
\ No newline at end of file
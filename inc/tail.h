@@ -0,0 +1,5 @@
+#pragma once
+#include <sys/types.h>
+
+ssize_t tail_read(const char *path, int count, int fd, char *buf, size_t sz);
+void tail_deinit();
@@ -0,0 +1,4 @@
+#pragma once
+
+int watch_init();
+void watch_deinit();
@@ -1,10 +1,16 @@
+#define LOG_MODULE  LOG_MOD_BUS
 #include <systemd/sd-bus.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "bus.h"
+#include "loop.h"
 #include "sys.h"
+#include "job.h"
+#include "metrics.h"
+#include "storage.h"
 #include "debug.h"
 #include "main.h"
 #include "config.h"
@@ -13,6 +19,30 @@
 // #define TABLE_FLAG  0
 // Local variables
 static sd_bus       *bus;
+static sd_event_source *busPost;
+
+// Method call being dispatched, for latency histogram
+static struct {
+    uint64_t start;
+    metric *seconds;        // Of vTable method
+} busCall;
+
+// Metric backed properties, quantiles are in us
+static const struct {
+    const char *property;
+    const char *metric;
+    double quantile;        // 0 for value sum
+} busMetrics[] = {
+    { "jobsRunning",        "executor_jobs_running",                0 },
+    { "jobsTotal",          "executor_jobs_total",                  0 },
+    { "queueDepth",         "executor_pool_queue_depth",            0 },
+    { "logBytes",           "executor_log_bytes_total",             0 },
+    { "telegramRequests",   "executor_telegram_requests_total",     0 },
+    { "spawnP50",           "executor_spawn_seconds",               0.5 },
+    { "spawnP99",           "executor_spawn_seconds",               0.99 },
+    { "dispatchP99",        "executor_bus_dispatch_seconds",        0.99 },
+    { "telegramP99",        "executor_telegram_request_seconds",    0.99 },
+};
 
 // Definitions
 static int bus_run_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError);
@@ -20,6 +50,13 @@ static int bus_tail_cb (sd_bus_message *m, void *userdata, sd_bus_error *retErro
 static int bus_pull_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError);
 static int bus_clear_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError);
 static int bus_export_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError);
+static int bus_log_level_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError);
+static int bus_get_job_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError);
+static int bus_list_jobs_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError);
+static int bus_cancel_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError);
+static int bus_get_command_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError);
+static int bus_metric_get_cb (sd_bus *b, const char *path, const char *interface, const char *property
+                            , sd_bus_message *reply, void *userdata, sd_bus_error *retError);
 
 
 /**
@@ -30,40 +67,107 @@ static const sd_bus_vtable vTable[] = {
     SD_BUS_METHOD_WITH_NAMES("run"
         , "su", SD_BUS_PARAM (command)
                 SD_BUS_PARAM (chat)
-        , "i",  SD_BUS_PARAM (pid)
+        , "t",  SD_BUS_PARAM (job)
         , bus_run_cb
         , TABLE_FLAG
     ),
     SD_BUS_METHOD_WITH_NAMES("tail"
         , "iu", SD_BUS_PARAM (count)
                 SD_BUS_PARAM (chat)
-        , "i",  SD_BUS_PARAM (err)
+        , "t",  SD_BUS_PARAM (job)
         , bus_tail_cb
         , TABLE_FLAG
     ),
     SD_BUS_METHOD_WITH_NAMES("clear"
         , "uau", SD_BUS_PARAM (chat)
                  SD_BUS_PARAM (orders)
-        , "i",   SD_BUS_PARAM (pid)
+        , "t",   SD_BUS_PARAM (job)
         , bus_clear_cb
         , TABLE_FLAG
     ),
     SD_BUS_METHOD_WITH_NAMES("export"
         , "uau", SD_BUS_PARAM (chat)
                  SD_BUS_PARAM (orders)
-        , "i",   SD_BUS_PARAM (pid)
+        , "t",   SD_BUS_PARAM (job)
         , bus_export_cb
         , TABLE_FLAG
     ),
     SD_BUS_METHOD_WITH_NAMES("pull"
         , "u", SD_BUS_PARAM (chat)
-        , "i", SD_BUS_PARAM (pid)
+        , "t", SD_BUS_PARAM (job)
         , bus_pull_cb
         , TABLE_FLAG
     ),
+    SD_BUS_METHOD_WITH_NAMES("logLevel"
+        , "si", SD_BUS_PARAM (module)
+                SD_BUS_PARAM (level)
+        , "i",  SD_BUS_PARAM (prev)
+        , bus_log_level_cb
+        , TABLE_FLAG
+    ),
+    SD_BUS_METHOD_WITH_NAMES("getJob"
+        , "t",      SD_BUS_PARAM (job)
+        , "susitt", SD_BUS_PARAM (title)
+                    SD_BUS_PARAM (chat)
+                    SD_BUS_PARAM (state)
+                    SD_BUS_PARAM (code)
+                    SD_BUS_PARAM (duration)
+                    SD_BUS_PARAM (bytes)
+        , bus_get_job_cb
+        , TABLE_FLAG
+    ),
+    SD_BUS_METHOD_WITH_NAMES("listJobs"
+        , "",           ""
+        , "a(tsusitt)", SD_BUS_PARAM (jobs)
+        , bus_list_jobs_cb
+        , TABLE_FLAG
+    ),
+    SD_BUS_METHOD_WITH_NAMES("cancel"
+        , "t", SD_BUS_PARAM (job)
+        , "i", SD_BUS_PARAM (err)
+        , bus_cancel_cb
+        , TABLE_FLAG
+    ),
+    SD_BUS_METHOD_WITH_NAMES("getCommand"
+        , "i",      SD_BUS_PARAM (id)
+        , "isiiii", SD_BUS_PARAM (cmd)
+                    SD_BUS_PARAM (obj)
+                    SD_BUS_PARAM (flags)
+                    SD_BUS_PARAM (usr)
+                    SD_BUS_PARAM (dt)
+                    SD_BUS_PARAM (dtExec)
+        , bus_get_command_cb
+        , TABLE_FLAG
+    ),
+    SD_BUS_SIGNAL_WITH_NAMES("jobFinished"
+        , "titt", SD_BUS_PARAM (job)
+                  SD_BUS_PARAM (code)
+                  SD_BUS_PARAM (duration)
+                  SD_BUS_PARAM (bytes)
+        , 0
+    ),
+    SD_BUS_SIGNAL_WITH_NAMES("pulled"
+        , "tssas", SD_BUS_PARAM (job)
+                   SD_BUS_PARAM (from)
+                   SD_BUS_PARAM (to)
+                   SD_BUS_PARAM (paths)
+        , 0
+    ),
+    SD_BUS_PROPERTY("jobsRunning",      "t", bus_metric_get_cb, 0, 0),
+    SD_BUS_PROPERTY("jobsTotal",        "t", bus_metric_get_cb, 0, 0),
+    SD_BUS_PROPERTY("queueDepth",       "t", bus_metric_get_cb, 0, 0),
+    SD_BUS_PROPERTY("logBytes",         "t", bus_metric_get_cb, 0, 0),
+    SD_BUS_PROPERTY("telegramRequests", "t", bus_metric_get_cb, 0, 0),
+    SD_BUS_PROPERTY("spawnP50",         "t", bus_metric_get_cb, 0, 0),
+    SD_BUS_PROPERTY("spawnP99",         "t", bus_metric_get_cb, 0, 0),
+    SD_BUS_PROPERTY("dispatchP99",      "t", bus_metric_get_cb, 0, 0),
+    SD_BUS_PROPERTY("telegramP99",      "t", bus_metric_get_cb, 0, 0),
     SD_BUS_VTABLE_END
 };
 
+// Dispatch histogram by vTable item
+static metric *busSeconds[sizeof(vTable) / sizeof(vTable[0])];
+
 // static const char *bus_get_error (const sd_bus_error *e, int error) {
 //     if (e) {
 //         if (sd_bus_error_has_name (e, SD_BUS_ERROR_ACCESS_DENIED))
@@ -76,6 +180,42 @@ static const sd_bus_vtable vTable[] = {
 //     return strerror (abs (error));
 // }
 
+static void bus_call_done() {
+    if(!busCall.start) return;
+    metrics_observe(busCall.seconds, metrics_now() - busCall.start);
+    busCall.start = 0;
+}
+
+/**
+ * @brief Starts dispatch timer of own method call. Filter runs right
+ *        before vTable handler, timer stops in post source after it.
+ */
+static int bus_filter_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError) {
+    const char *member;
+    const sd_bus_vtable *v;
+
+    bus_call_done();
+    if(!sd_bus_message_is_method_call(m, DBUS_THIS_NAME, NULL)) return 0;
+    member = sd_bus_message_get_member(m);
+    for(v = vTable; member && v->type != _SD_BUS_VTABLE_END; v++) {
+        if(v->type == _SD_BUS_VTABLE_METHOD && !strcmp(v->x.method.member, member)) {
+            // Event loop thread only, found on first call of method
+            if(!busSeconds[v - vTable])
+                busSeconds[v - vTable] = metrics_get(MetricHistogram, "executor_bus_dispatch_seconds"
+                    , "Bus method handling", "method=\"%s\"", v->x.method.member);
+            busCall.seconds = busSeconds[v - vTable];
+            busCall.start = metrics_now();
+            break;
+        }
+    }
+    return 0;
+}
+
+static int bus_post_cb (sd_event_source *s, void *userdata) {
+    bus_call_done();
+    return 0;
+}
+
 int bus_init() {
     int r;
     const char* uniqueName;
@@ -98,12 +238,27 @@ int bus_init() {
         return r;
     }
 
+    r = sd_bus_add_filter (bus, NULL, bus_filter_cb, NULL);
+    if(r >= 0)
+        r = sd_event_add_post (loop_event (), &busPost, bus_post_cb, NULL);
+    if(r < 0) {
+        logWrn("Dispatch timing unavailable (%d): %s", r, strerror (-r));
+    }
+
     r = sd_bus_request_name (bus, DBUS_THIS_NAME, 0);
     if(r < 0) {
         logErr("Failed to acquire service name (%d): %s", r, strerror(-r));
         return r;
     }
 
+    // Bus fd is served by the event loop: queued messages are dispatched
+    // back to back until the read queue is empty, nothing sleeps between
+    r = sd_bus_attach_event (bus, loop_event (), SD_EVENT_PRIORITY_NORMAL);
+    if(r < 0) {
+        logErr("Failed to attach bus to event loop (%d): %s", r, strerror(-r));
+        return r;
+    }
+
     r = sd_bus_get_unique_name (bus, &uniqueName);
     if(r < 0)
         logTrc("Unique name error (%d): %s", r, strerror (-r));
@@ -116,51 +271,51 @@ int bus_init() {
 }
 
 void bus_deinit() {
+    busPost = sd_event_source_disable_unref (busPost);
     if (bus) {
-        sd_bus_unref (bus);
-    }
-}
-
-void bus_process() {
-    int r;
-
-    r = sd_bus_process (bus, NULL);
-    if(r < 0) {
-        logErr ("Failed to process bus (%d): %s", r, strerror (-r));
+        sd_bus_detach_event (bus);
+        bus = sd_bus_flush_close_unref (bus);
     }
 }
 
 static int bus_run_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError) {
     int r;
     uint32_t chat;
+    uint64_t id = 0;
     char *cmd;
     r = sd_bus_message_read (m, "su", &cmd, &chat);
-    r = sys_run_command(cmd, chat);
-    return sd_bus_reply_method_return(m, "i", r);
+    if(r < 0) {
+        logErr("Read params error(%d): %s", r, strerror(abs(r)));
+    } else {
+        id = sys_run_command(cmd, chat);
+    }
+    return sd_bus_reply_method_return(m, "t", id);
 }
 
 static int bus_tail_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError) {
     int r, n;
     uint32_t chat;
+    uint64_t id = 0;
     r = sd_bus_message_read (m, "iu", &n, &chat);
-    if(!r) {
+    if(r < 0) {
         logErr("Read params error(%d): %s", r, strerror(abs(r)));
     } else {
-        r = sys_tail(n, chat);
+        id = sys_tail(n, chat);
     }
-    return sd_bus_reply_method_return(m, "i", r);
+    return sd_bus_reply_method_return(m, "t", id);
 }
 
 static int bus_pull_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError) {
     int r;
     uint32_t chat;
+    uint64_t id = 0;
     r = sd_bus_message_read (m, "u", &chat);
-    if(!r) {
+    if(r < 0) {
         logErr("Read params error(%d): %s", r, strerror(abs(r)));
     } else {
-        r = sys_pull(chat);
+        id = sys_pull(chat);
     }
-    return sd_bus_reply_method_return(m, "i", r);
+    return sd_bus_reply_method_return(m, "t", id);
 }
 
 int bus_read_array_u(sd_bus_message *m, uint32_t **ret) {
@@ -187,6 +342,7 @@ int bus_read_array_u(sd_bus_message *m, uint32_t **ret) {
 static int bus_export_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError) {
     int r, cnt;
     uint32_t chat, *orders = NULL;
+    uint64_t id = 0;
     r = sd_bus_message_read (m, "u", &chat);
     if(r < 0) {
         logErr("Read param error(%d): %s", r, strerror(abs(r)));
@@ -197,16 +353,17 @@ static int bus_export_cb (sd_bus_message *m, void *userdata, sd_bus_error *retEr
         } else if(cnt < 1 || !orders) {
             logErr("Invalid array");
         } else {
-            r = sys_export(chat, orders, cnt);
+            id = sys_export(chat, orders, cnt);
         }
         free(orders);
     }
-    return sd_bus_reply_method_return(m, "i", r);
+    return sd_bus_reply_method_return(m, "t", id);
 }
 
 static int bus_clear_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError) {
     int r, cnt;
     uint32_t chat, *orders = NULL;
+    uint64_t id = 0;
     r = sd_bus_message_read (m, "u", &chat);
     if(r < 0) {
         logErr("Read param error(%d): %s", r, strerror(abs(r)));
@@ -217,9 +374,144 @@ static int bus_clear_cb (sd_bus_message *m, void *userdata, sd_bus_error *retErr
         } else if(cnt < 1 || !orders) {
             logErr("Invalid array");
         } else {
-            r = sys_clear(chat, orders, cnt);
+            id = sys_clear(chat, orders, cnt);
         }
         free(orders);
     }
+    return sd_bus_reply_method_return(m, "t", id);
+}
+
+static int bus_log_level_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError) {
+    int r, mod, lvl;
+    const char *name;
+    r = sd_bus_message_read (m, "si", &name, &lvl);
+    if(r < 0) {
+        logErr("Read params error(%d): %s", r, strerror(abs(r)));
+    } else {
+        mod = log_module(name);
+        if(mod < LOG_MOD_ALL) {
+            logWrn("Unknown log module [%s]", name);
+            r = mod;
+        } else {
+            r = log_set_level(mod, lvl);
+            if(r < 0) logWrn("Log level %d of [%s] rejected(%d)", lvl, name, r);
+            else log("Log level of [%s] set to %d (was %d)", name, lvl, r);
+        }
+    }
+    return sd_bus_reply_method_return(m, "i", r);
+}
+
+static int bus_get_job_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError) {
+    int r;
+    uint64_t id;
+    jobInfo info;
+
+    r = sd_bus_message_read (m, "t", &id);
+    if(r < 0) return r;
+    if(job_get(id, &info) < 0) {
+        return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS, "Unknown job %lu", id);
+    }
+    return sd_bus_reply_method_return(m, "susitt", info.title, info.chat, job_state_name(info.state)
+        , info.code, info.durationUs, info.bytes);
+}
+
+static int bus_list_jobs_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError) {
+    int r, i, cnt;
+    jobInfo *list;
+    sd_bus_message *reply = NULL;
+
+    cnt = job_list(&list);
+    r = sd_bus_message_new_method_return(m, &reply);
+    if(r >= 0) r = sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "(tsusitt)");
+    for(i = 0; i < cnt && r >= 0; i++) {
+        r = sd_bus_message_append(reply, "(tsusitt)", list[i].id, list[i].title, list[i].chat
+            , job_state_name(list[i].state), list[i].code, list[i].durationUs, list[i].bytes);
+    }
+    if(r >= 0) r = sd_bus_message_close_container(reply);
+    if(r >= 0) r = sd_bus_send(NULL, reply, NULL);
+    if(r < 0) logErr("Job list reply error(%d): %s", r, strerror(-r));
+    sd_bus_message_unref(reply);
+    free(list);
+    return r;
+}
+
+static int bus_cancel_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError) {
+    int r;
+    uint64_t id;
+
+    r = sd_bus_message_read (m, "t", &id);
+    if(r < 0) return r;
+    r = job_cancel(id);
     return sd_bus_reply_method_return(m, "i", r);
-}
\ No newline at end of file
+}
+
+static void bus_get_command_done (int r, const adminCommand *cmd, void *userdata) {
+    sd_bus_message *m = userdata;
+
+    if(r < 0) {
+        r = sd_bus_reply_method_errno(m, -r, NULL);
+    } else {
+        r = sd_bus_reply_method_return(m, "isiiii", cmd->cmd, cmd->obj, cmd->flags, cmd->usr, cmd->dt, cmd->dt_exec);
+    }
+    if(r < 0) logWrn("Command reply error(%d): %s", r, strerror(-r));
+    sd_bus_message_unref(m);
+}
+
+/**
+ * @brief Replied once lookup on non-blocking connection is done, bus is
+ *        served meanwhile
+ */
+static int bus_get_command_cb (sd_bus_message *m, void *userdata, sd_bus_error *retError) {
+    int r, id;
+
+    r = sd_bus_message_read (m, "i", &id);
+    if(r < 0) return r;
+    r = storage_get_command_async(id, bus_get_command_done, sd_bus_message_ref(m));
+    if(r < 0) {
+        sd_bus_message_unref(m);
+        return sd_bus_reply_method_errno(m, -r, NULL);
+    }
+    return 1;
+}
+
+/**
+ * @brief Emits jobFinished, called on event loop thread
+ */
+void bus_job_finished(uint64_t id, int code, uint64_t durationUs, uint64_t bytes) {
+    int r;
+
+    if(!bus) return;
+    r = sd_bus_emit_signal(bus, DBUS_THIS_PATH, DBUS_THIS_NAME, "jobFinished", "titt", id, code, durationUs, bytes);
+    if(r < 0) logWrn("Job %lu signal error(%d): %s", id, r, strerror(-r));
+}
+
+/**
+ * @brief Emits pulled with paths changed between commits, called on
+ *        event loop thread
+ */
+void bus_pulled(uint64_t id, const char *from, const char *to, char **paths) {
+    int r;
+    sd_bus_message *m = NULL;
+
+    if(!bus) return;
+    r = sd_bus_message_new_signal(bus, &m, DBUS_THIS_PATH, DBUS_THIS_NAME, "pulled");
+    if(r >= 0) r = sd_bus_message_append(m, "tss", id, from, to);
+    if(r >= 0) r = sd_bus_message_append_strv(m, paths);
+    if(r >= 0) r = sd_bus_send(bus, m, NULL);
+    if(r < 0) logWrn("Pull %lu signal error(%d): %s", id, r, strerror(-r));
+    sd_bus_message_unref(m);
+}
+
+static int bus_metric_get_cb (sd_bus *b, const char *path, const char *interface, const char *property
+                            , sd_bus_message *reply, void *userdata, sd_bus_error *retError) {
+    size_t i;
+    uint64_t v = 0;
+
+    for(i = 0; i < sizeof(busMetrics) / sizeof(busMetrics[0]); i++) {
+        if(strcmp(busMetrics[i].property, property)) continue;
+        v = busMetrics[i].quantile ? metrics_quantile(busMetrics[i].metric, busMetrics[i].quantile)
+                                   : metrics_total(busMetrics[i].metric);
+        break;
+    }
+    return sd_bus_message_append(reply, "t", v);
+}
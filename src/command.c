@@ -0,0 +1,387 @@
+#define LOG_MODULE  LOG_MOD_SYS
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jansson.h>
+
+#include "config.h"
+#include "command.h"
+#include "sys.h"
+#include "debug.h"
+
+#define COMMAND_ARGS_MAX    64
+#define COMMAND_SEEDS       256     // Tried per table size before it doubles
+
+// Job waiting for slot of its class, FIFO
+typedef struct commandParkS {
+    struct commandParkS *next;
+    commandClassFunc run;
+    void *userdata;
+} commandPark;
+
+// Jobs of one class running at once
+struct commandClassS {
+    struct commandClassS *next;
+    char *name;
+    int limit;                  // 0 = unlimited
+    int running;
+    commandPark *head;
+    commandPark *tail;
+};
+
+// Immutable once published, freed when last reader puts it
+struct commandTableS {
+    atomic_int refs;
+    uint32_t seed;
+    uint32_t mask;              // Slot count - 1
+    commandDef **slots;         // Perfect hash: every name has own slot
+    commandDef *defs;
+    int count;
+};
+
+// Used when commands file is missing
+static const char *defaultCommands =
+    "{\"commands\": {"
+        "\"geos\": {\"script\": \"load/gps_resources.php\", \"output\": \"gps_resources.log\", \"live\": true},"
+        "\"cars\": {\"script\": \"load/gps_items.php\", \"output\": \"gps_items.log\", \"live\": true}"
+    "}}";
+
+const char *gCommandsPath = COMMANDS_FILE;
+
+// Local variables
+static pthread_mutex_t tableLock = PTHREAD_MUTEX_INITIALIZER;
+static commandTable *table = NULL;
+static pthread_mutex_t classLock = PTHREAD_MUTEX_INITIALIZER;
+static commandClass *classes = NULL;   // Kept across reloads, jobs hold them
+
+static uint32_t command_hash(const char *s, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for(; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+/**
+ * @brief Searches seed that puts every name in own slot, growing table
+ *        when none of COMMAND_SEEDS fits
+ */
+static int command_perfect(commandTable *t) {
+    uint32_t size = 8, seed, slot;
+    int i;
+
+    while(size < (uint32_t)t->count * 2) size <<= 1;
+    for(;; size <<= 1) {
+        t->slots = realloc(t->slots, size * sizeof(commandDef*));
+        if(!t->slots) return -ENOMEM;
+        for(seed = 0; seed < COMMAND_SEEDS; seed++) {
+            memset(t->slots, 0, size * sizeof(commandDef*));
+            for(i = 0; i < t->count; i++) {
+                slot = command_hash(t->defs[i].name, seed) & (size - 1);
+                if(t->slots[slot]) break;
+                t->slots[slot] = &t->defs[i];
+            }
+            if(i == t->count) {
+                t->seed = seed;
+                t->mask = size - 1;
+                return 0;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Takes slot for first parked job when class has one free.
+ *        Called with classLock held.
+ */
+static commandPark *command_class_next(commandClass *c) {
+    commandPark *p = c->head;
+
+    if(!p || (c->limit && c->running >= c->limit)) return NULL;
+    c->head = p->next;
+    if(!c->head) c->tail = NULL;
+    c->running++;
+    return p;
+}
+
+/**
+ * @brief Starts parked jobs that fit, on calling thread. Slot of job
+ *        that fails to start goes to next one.
+ */
+static void command_class_start(commandClass *c) {
+    commandPark *p;
+    bool started = true;
+
+    while(true) {
+        pthread_mutex_lock(&classLock);
+        if(!started) c->running--;
+        p = command_class_next(c);
+        pthread_mutex_unlock(&classLock);
+        if(!p) break;
+        started = p->run(p->userdata);
+        free(p);
+    }
+}
+
+/**
+ * @brief Class by name, limit is updated when it exists
+ */
+static commandClass *command_class(const char *name, int limit, bool set) {
+    commandClass *c;
+    bool raised = false;
+
+    pthread_mutex_lock(&classLock);
+    for(c = classes; c && strcmp(c->name, name); c = c->next);
+    if(!c) {
+        c = calloc(1, sizeof(commandClass));
+        c->name = strdup(name);
+        c->next = classes;
+        classes = c;
+    }
+    if(set && c->limit != limit) {
+        raised = !limit || (c->limit && limit > c->limit);
+        c->limit = limit;
+    }
+    pthread_mutex_unlock(&classLock);
+    if(raised) command_class_start(c);
+    return c;
+}
+
+static char *command_path(const char *dir, const char *file) {
+    char *p;
+    if(file[0] == '/') return strdup(file);
+    if(asprintf(&p, "%s/%s", dir, file) < 0) return NULL;
+    return p;
+}
+
+static void command_free(commandTable *t) {
+    int i;
+    char **a;
+
+    for(i = 0; i < t->count; i++) {
+        free(t->defs[i].name);
+        free(t->defs[i].script);
+        for(a = t->defs[i].args; a && *a; a++) free(*a);
+        free(t->defs[i].args);
+        free(t->defs[i].output);
+        free(t->defs[i].document);
+    }
+    free(t->defs);
+    free(t->slots);
+    free(t);
+}
+
+/**
+ * @brief Fills definition from JSON object:
+ *        {"script": "load/x.php", "args": ["{script}", "{chat}"],
+ *         "output": "x.log", "document": "x.json", "capture": false,
+ *         "live": true, "php": true, "class": "gps", "timeout": 600,
+ *         "cache": true}
+ */
+static int command_parse(commandDef *d, const char *name, json_t *o) {
+    json_t *v, *a;
+    size_t i, n;
+    const char *s;
+
+    d->name = strdup(name);
+    s = json_string_value(json_object_get(o, "script"));
+    if(!s) {
+        logErr("Command %s has no script", name);
+        return -EINVAL;
+    }
+    d->script = command_path(gScriptsPath, s);
+
+    a = json_object_get(o, "args");
+    n = json_is_array(a) ? json_array_size(a) : 0;
+    if(n > COMMAND_ARGS_MAX) {
+        logErr("Command %s has over %d args", name, COMMAND_ARGS_MAX);
+        return -E2BIG;
+    }
+    d->args = calloc(n ? n + 1 : 2, sizeof(char*));
+    for(i = 0; i < n; i++) {
+        s = json_string_value(json_array_get(a, i));
+        if(!s) {
+            logErr("Command %s arg %zu is not a string", name, i);
+            return -EINVAL;
+        }
+        d->args[i] = strdup(s);
+    }
+    if(!n) d->args[0] = strdup("{script}");
+
+    if((s = json_string_value(json_object_get(o, "output")))) d->output = strdup(s);
+    if((s = json_string_value(json_object_get(o, "document")))) d->document = strdup(s);
+    d->capture = json_is_true(json_object_get(o, "capture"));
+    d->live = json_is_true(json_object_get(o, "live"));
+    d->cache = json_is_true(json_object_get(o, "cache"));
+    v = json_object_get(o, "php");
+    n = strlen(d->script);
+    d->php = v ? json_is_true(v) : n > 4 && !strcmp(d->script + n - 4, ".php");
+    v = json_object_get(o, "timeout");
+    d->timeoutS = json_is_integer(v) && json_integer_value(v) > 0 ? json_integer_value(v) : 0;
+    if((s = json_string_value(json_object_get(o, "class")))) d->cls = command_class(s, 0, false);
+    return 0;
+}
+
+/**
+ * @brief Reads commands file and publishes new table. Current table
+ *        stays when file is broken.
+ * @return command count or negative errno
+ */
+int command_load(const char *path) {
+    int r = 0;
+    size_t i = 0;
+    const char *key;
+    json_t *root, *cmds, *v;
+    json_error_t err;
+    commandTable *t, *old;
+
+    root = path ? json_load_file(path, 0, &err) : NULL;
+    if(!root && path) {
+        if(strstr(err.text, "unable to open") == NULL) {
+            logErr("Commands %s error at line %d: %s", path, err.line, err.text);
+            return -EINVAL;
+        }
+        logWrn("Commands %s: %s, built-in commands used", path, err.text);
+    }
+    if(!root) root = json_loads(defaultCommands, 0, &err);
+    cmds = json_object_get(root, "commands");
+    if(!json_is_object(cmds)) {
+        logErr("Commands %s has no \"commands\" object", path);
+        json_decref(root);
+        return -EINVAL;
+    }
+
+    json_object_foreach(json_object_get(root, "classes"), key, v) {
+        command_class(key, json_is_integer(v) ? json_integer_value(v) : 0, true);
+    }
+
+    t = calloc(1, sizeof(commandTable));
+    atomic_init(&t->refs, 1);
+    t->defs = calloc(json_object_size(cmds) + 1, sizeof(commandDef));
+    json_object_foreach(cmds, key, v) {
+        if(!json_is_object(v)) {
+            logErr("Command %s is not an object", key);
+            r = -EINVAL;
+            break;
+        }
+        t->count++;
+        r = command_parse(&t->defs[i++], key, v);
+        if(r < 0) break;
+    }
+    json_decref(root);
+    if(r == 0) r = command_perfect(t);
+    if(r < 0) {
+        command_free(t);
+        return r;
+    }
+
+    pthread_mutex_lock(&tableLock);
+    old = table;
+    table = t;
+    pthread_mutex_unlock(&tableLock);
+    if(old) command_table_put(old);
+    logInf("%d commands loaded, %u slots, seed %u", t->count, t->mask + 1, t->seed);
+    return t->count;
+}
+
+int command_init() {
+    int r = command_load(gCommandsPath);
+    return r < 0 ? r : 0;
+}
+
+/**
+ * @brief Current table, valid until put even when reloaded meanwhile
+ */
+commandTable *command_table_get() {
+    commandTable *t;
+
+    pthread_mutex_lock(&tableLock);
+    t = table;
+    if(t) atomic_fetch_add(&t->refs, 1);
+    pthread_mutex_unlock(&tableLock);
+    return t;
+}
+
+void command_table_put(commandTable *t) {
+    if(t && atomic_fetch_sub(&t->refs, 1) == 1) command_free(t);
+}
+
+/**
+ * @brief One hash and one compare
+ */
+const commandDef *command_find(const commandTable *t, const char *name) {
+    const commandDef *d;
+
+    if(!t || !name) return NULL;
+    d = t->slots[command_hash(name, t->seed) & t->mask];
+    return d && !strcmp(d->name, name) ? d : NULL;
+}
+
+/**
+ * @brief Takes slot of class, or parks job until one is left: run is
+ *        then called with slot taken, on thread that left it. Job never
+ *        occupies pool worker while waiting.
+ * @return true when slot was taken now
+ */
+bool command_class_enter(commandClass *c, commandClassFunc run, void *userdata) {
+    commandPark *p;
+
+    if(!c) return true;
+    pthread_mutex_lock(&classLock);
+    if(!c->head && (!c->limit || c->running < c->limit)) {
+        c->running++;
+        pthread_mutex_unlock(&classLock);
+        return true;
+    }
+    p = calloc(1, sizeof(commandPark));
+    p->run = run;
+    p->userdata = userdata;
+    if(c->tail) c->tail->next = p;
+    else c->head = p;
+    c->tail = p;
+    logDbg("Class %s full (%d), job parked", c->name, c->limit);
+    pthread_mutex_unlock(&classLock);
+    return false;
+}
+
+/**
+ * @brief Frees slot, next parked job takes it
+ */
+void command_class_leave(commandClass *c) {
+    if(!c) return;
+    pthread_mutex_lock(&classLock);
+    c->running--;
+    pthread_mutex_unlock(&classLock);
+    command_class_start(c);
+}
+
+void command_deinit() {
+    int parked = 0;
+    commandClass *c;
+    commandPark *p;
+
+    pthread_mutex_lock(&tableLock);
+    command_table_put(table);
+    table = NULL;
+    pthread_mutex_unlock(&tableLock);
+
+    pthread_mutex_lock(&classLock);
+    while((c = classes)) {
+        classes = c->next;
+        while((p = c->head)) {
+            c->head = p->next;
+            free(p);
+            parked++;
+        }
+        free(c->name);
+        free(c);
+    }
+    pthread_mutex_unlock(&classLock);
+    if(parked) logWrn("Commands stopped with %d parked jobs", parked);
+}
@@ -0,0 +1,243 @@
+#define LOG_MODULE  LOG_MOD_SYS
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jansson.h>
+
+#include "config.h"
+#include "conf.h"
+#include "command.h"
+#include "metrics.h"
+#include "pool.h"
+#include "report.h"
+#include "debug.h"
+
+enum {
+    ConfInt,
+    ConfStr
+};
+
+// Setting in config file, named like meson option it overrides
+typedef struct confKeyS {
+    const char *name;
+    int type;
+    size_t off;
+    size_t size;                // String buffer
+    int min;
+    int max;
+} confKey;
+
+#define CONF_INT(n, f, lo, hi)  { n, ConfInt, offsetof(confStruct, f), 0, lo, hi }
+#define CONF_STR(n, f)          { n, ConfStr, offsetof(confStruct, f), sizeof(((confStruct*)0)->f), 0, 0 }
+
+static const confKey confKeys[] = {
+    CONF_INT("log_level",       logLevel,       LOG_LEVEL_ALWAYS, LOG_LEVEL_MAX),
+    CONF_INT("pool_workers",    poolWorkers,    1, POOL_WORKERS_MAX),
+    CONF_INT("pool_queue",      poolQueue,      1, 1 << 20),
+    CONF_INT("tg_chat_rate",    tgChatRate,     1, 1000),
+    CONF_INT("tg_global_rate",  tgGlobalRate,   1, 1000),
+    CONF_INT("tg_coalesce",     tgCoalesceMs,   0, 60000),
+    CONF_INT("tg_progress",     tgProgressMs,   0, 600000),
+    CONF_STR("api_url",         apiUrl),
+    CONF_STR("tg_key",          apiKey),
+    CONF_STR("metrics_listen",  metricsListen),
+    CONF_STR("php_fcgi_socket", fcgiSocket),
+    CONF_STR("db_host",         dbServ),
+    CONF_INT("db_port",         dbPort,         0, 65535),
+    CONF_STR("db_base",         dbBase),
+    CONF_STR("db_user",         dbUser),
+    CONF_STR("db_pass",         dbPass),
+    CONF_INT("job_timeout",     jobTimeoutS,    0, 86400 * 7),
+    CONF_INT("job_cache_ttl",   jobCacheTtlS,   0, 86400),
+};
+
+const char *gConfPath = CONF_FILE;
+
+// Local variables
+static pthread_mutex_t confLock = PTHREAD_MUTEX_INITIALIZER;
+static confStruct *conf = NULL;
+static int baseLevel;           // From command line, used when file has none
+
+static void conf_defaults(confStruct *c) {
+    c->logLevel = baseLevel;
+    c->poolWorkers = POOL_WORKERS;
+    c->poolQueue = POOL_QUEUE;
+    c->tgChatRate = TG_CHAT_RATE;
+    c->tgGlobalRate = TG_GLOBAL_RATE;
+    c->tgCoalesceMs = TG_COALESCE_MS;
+    c->tgProgressMs = TG_PROGRESS_MS;
+    snprintf(c->apiUrl, sizeof(c->apiUrl), "%s", gApiUrl);
+    snprintf(c->apiKey, sizeof(c->apiKey), "%s", API_KEY);
+    snprintf(c->metricsListen, sizeof(c->metricsListen), "%s", METRICS_LISTEN);
+    snprintf(c->fcgiSocket, sizeof(c->fcgiSocket), "%s", PHP_FCGI_SOCKET);
+    snprintf(c->dbServ, sizeof(c->dbServ), "%s", SQL_SERV);
+    c->dbPort = SQL_PORT;
+    snprintf(c->dbBase, sizeof(c->dbBase), "%s", SQL_BASE);
+    snprintf(c->dbUser, sizeof(c->dbUser), "%s", SQL_USER);
+    snprintf(c->dbPass, sizeof(c->dbPass), "%s", SQL_PASS);
+    c->jobTimeoutS = JOB_TIMEOUT_S;
+    c->jobCacheTtlS = JOB_CACHE_TTL_S;
+}
+
+/**
+ * @brief Applies one value from file, out of range or mistyped one
+ *        fails whole file
+ */
+static int conf_set(confStruct *c, const confKey *k, json_t *v) {
+    json_int_t n;
+    const char *s;
+
+    if(k->type == ConfInt) {
+        if(!json_is_integer(v)) {
+            logErr("Config %s must be integer", k->name);
+            return -EINVAL;
+        }
+        n = json_integer_value(v);
+        if(n < k->min || n > k->max) {
+            logErr("Config %s %lld out of range %d..%d", k->name, n, k->min, k->max);
+            return -ERANGE;
+        }
+        *(int*)((char*)c + k->off) = n;
+        return 0;
+    }
+    s = json_string_value(v);
+    if(!s) {
+        logErr("Config %s must be string", k->name);
+        return -EINVAL;
+    }
+    if(strlen(s) >= k->size) {
+        logErr("Config %s over %zu chars", k->name, k->size - 1);
+        return -ENAMETOOLONG;
+    }
+    strcpy((char*)c + k->off, s);
+    return 0;
+}
+
+/**
+ * @brief Reads config file over defaults. Missing file means defaults.
+ * @return new snapshot or NULL when file is broken
+ */
+static confStruct *conf_load(const char *path) {
+    int r = 0;
+    size_t i;
+    const char *key;
+    json_t *root, *v;
+    json_error_t err;
+    confStruct *c = calloc(1, sizeof(confStruct));
+
+    atomic_init(&c->refs, 1);
+    conf_defaults(c);
+    root = json_load_file(path, 0, &err);
+    if(!root) {
+        if(strstr(err.text, "unable to open")) {
+            logDbg("Config %s: %s, defaults used", path, err.text);
+            return c;
+        }
+        logErr("Config %s error at line %d: %s", path, err.line, err.text);
+        free(c);
+        return NULL;
+    }
+    if(!json_is_object(root)) {
+        logErr("Config %s is not an object", path);
+        r = -EINVAL;
+    }
+    json_object_foreach(root, key, v) {
+        if(r < 0) break;
+        for(i = 0; i < sizeof(confKeys) / sizeof(confKeys[0]) && strcmp(confKeys[i].name, key); i++);
+        if(i == sizeof(confKeys) / sizeof(confKeys[0])) {
+            logWrn("Config %s: unknown key %s", path, key);
+            continue;
+        }
+        r = conf_set(c, &confKeys[i], v);
+    }
+    json_decref(root);
+    if(r < 0) {
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+static bool conf_db_changed(const confStruct *a, const confStruct *b) {
+    return strcmp(a->dbServ, b->dbServ) || a->dbPort != b->dbPort || strcmp(a->dbBase, b->dbBase)
+        || strcmp(a->dbUser, b->dbUser) || strcmp(a->dbPass, b->dbPass);
+}
+
+/**
+ * @brief Loads config file, must run before modules using it start
+ */
+int conf_init() {
+    confStruct *c;
+
+    baseLevel = gLogLevel;
+    c = conf_load(gConfPath);
+    if(!c) return -EINVAL;
+    conf = c;
+    if(c->logLevel != gLogLevel) log_set_level(LOG_MOD_ALL, c->logLevel);
+    return 0;
+}
+
+/**
+ * @brief Re-reads config and commands files on SIGHUP, event loop thread.
+ *        New snapshot is published at once, jobs already running keep
+ *        the one they took. Broken file leaves everything as it was.
+ */
+int conf_reload() {
+    int r;
+    confStruct *c, *old;
+
+    logInf("Reloading %s", gConfPath);
+    c = conf_load(gConfPath);
+    if(!c) return -EINVAL;
+
+    pthread_mutex_lock(&confLock);
+    old = conf;
+    c->dbGen = old->dbGen + conf_db_changed(old, c);
+    conf = c;
+    pthread_mutex_unlock(&confLock);
+
+    if(c->logLevel != old->logLevel) {
+        log_set_level(LOG_MOD_ALL, c->logLevel);
+        logInf("Log level %d", c->logLevel);
+    }
+    if(c->poolWorkers != old->poolWorkers || c->poolQueue != old->poolQueue) {
+        pool_resize(c->poolWorkers, c->poolQueue);
+    }
+    if(strcmp(c->metricsListen, old->metricsListen)) {
+        metrics_relisten(c->metricsListen);
+    }
+    if(c->dbGen != old->dbGen) {
+        logInf("Database %s:%d/%s, connections reopen on next use", c->dbServ, c->dbPort, c->dbBase);
+    }
+    conf_put(old);
+
+    r = command_load(gCommandsPath);
+    return r < 0 ? r : 0;
+}
+
+/**
+ * @brief Current snapshot, valid until put even when reloaded meanwhile
+ */
+const confStruct *conf_get() {
+    confStruct *c;
+
+    pthread_mutex_lock(&confLock);
+    c = conf;
+    atomic_fetch_add(&c->refs, 1);
+    pthread_mutex_unlock(&confLock);
+    return c;
+}
+
+void conf_put(const confStruct *c) {
+    if(c && atomic_fetch_sub(&((confStruct*)c)->refs, 1) == 1) free((confStruct*)c);
+}
+
+void conf_deinit() {
+    pthread_mutex_lock(&confLock);
+    conf_put(conf);
+    conf = NULL;
+    pthread_mutex_unlock(&confLock);
+}
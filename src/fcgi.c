@@ -0,0 +1,367 @@
+#define LOG_MODULE  LOG_MOD_SYS
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "fcgi.h"
+#include "conf.h"
+#include "metrics.h"
+#include "sys.h"
+#include "debug.h"
+
+#define FCGI_VERSION        1
+#define FCGI_BEGIN_REQUEST  1
+#define FCGI_ABORT_REQUEST  2
+#define FCGI_END_REQUEST    3
+#define FCGI_PARAMS         4
+#define FCGI_STDIN          5
+#define FCGI_STDOUT         6
+#define FCGI_STDERR         7
+#define FCGI_RESPONDER      1
+#define FCGI_OVERLOADED     2
+
+#define FCGI_REQUEST_ID     1       // One request per connection
+#define FCGI_HDR_SZ         8
+#define FCGI_CHUNK          65528   // Max record content, 8 byte aligned
+#define FCGI_RECORD_MAX     (65535 + 255)
+#define FCGI_HEADERS_SZ     1024    // Response header block limit
+#define FCGI_CANCEL_MS      250     // Cancel request check interval
+
+typedef struct fcgiBufS {
+    char *data;
+    size_t len;
+    size_t size;
+} fcgiBuf;
+
+typedef struct fcgiReqS {
+    int fd;
+    int outFd;                  // opt->outFile when no output stream
+    const procOptions *opt;
+    procResult *res;
+    uint64_t deadline;          // us, CLOCK_MONOTONIC, 0 = none
+    bool body;                  // Response headers are passed
+    char headers[FCGI_HEADERS_SZ];
+    size_t headersLen;
+    int status;                 // "Status:" response header
+} fcgiReq;
+
+// Local variables
+static _Atomic(metric *) spawnUs;      // Found on first request
+
+static uint64_t fcgi_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void fcgi_put(fcgiBuf *b, const void *p, size_t n) {
+    if(b->len + n > b->size) {
+        b->size = (b->len + n) * 2;
+        b->data = realloc(b->data, b->size);
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void fcgi_record(fcgiBuf *b, int type, const void *data, size_t len) {
+    static const char zero[8] = {0};
+    unsigned char pad = (8 - len % 8) % 8;
+    unsigned char h[FCGI_HDR_SZ] = {
+        FCGI_VERSION, type, 0, FCGI_REQUEST_ID, len >> 8, len & 0xff, pad, 0
+    };
+    fcgi_put(b, h, FCGI_HDR_SZ);
+    fcgi_put(b, data, len);
+    fcgi_put(b, zero, pad);
+}
+
+static size_t fcgi_len(unsigned char *p, size_t n) {
+    if(n < 128) {
+        p[0] = n;
+        return 1;
+    }
+    p[0] = (n >> 24) | 0x80;
+    p[1] = n >> 16;
+    p[2] = n >> 8;
+    p[3] = n;
+    return 4;
+}
+
+static void fcgi_param(fcgiBuf *b, const char *name, const char *value) {
+    unsigned char len[8];
+    size_t k, nl = strlen(name), vl = strlen(value);
+
+    k = fcgi_len(len, nl);
+    k += fcgi_len(len + k, vl);
+    fcgi_put(b, len, k);
+    fcgi_put(b, name, nl);
+    fcgi_put(b, value, vl);
+}
+
+/**
+ * @brief Arguments as CGI query: PHP splits it on '+' into $_SERVER['argv']
+ *        without URL decoding, so script name goes first as in CLI and
+ *        arguments are passed as is (one holding '+' splits in two)
+ */
+static void fcgi_query(fcgiBuf *q, char *const argv[]) {
+    int i;
+
+    for(i = 0; argv[i]; i++) {
+        if(i) fcgi_put(q, "+", 1);
+        fcgi_put(q, argv[i], strlen(argv[i]));
+    }
+    fcgi_put(q, "", 1);
+}
+
+/**
+ * @brief Whole request: begin, params (script, args), empty stdin
+ */
+static void fcgi_request(fcgiBuf *b, char *const argv[]) {
+    unsigned char begin[8] = { 0, FCGI_RESPONDER, 0 };
+    char name[32], num[16];
+    fcgiBuf p = {0}, q = {0};
+    size_t off, n;
+    int i;
+
+    fcgi_query(&q, argv);
+    fcgi_param(&p, "SCRIPT_FILENAME", argv[0]);
+    fcgi_param(&p, "SCRIPT_NAME", argv[0]);
+    fcgi_param(&p, "DOCUMENT_ROOT", gScriptsPath);
+    fcgi_param(&p, "REQUEST_METHOD", "GET");
+    fcgi_param(&p, "GATEWAY_INTERFACE", "CGI/1.1");
+    fcgi_param(&p, "SERVER_PROTOCOL", "HTTP/1.1");
+    fcgi_param(&p, "SERVER_SOFTWARE", "executor");
+    fcgi_param(&p, "QUERY_STRING", q.data);
+    // Exact arguments, for ones holding '+' or without register_argc_argv
+    for(i = 1; argv[i]; i++) {
+        snprintf(name, sizeof(name), "EXEC_ARGV%d", i);
+        fcgi_param(&p, name, argv[i]);
+    }
+    snprintf(num, sizeof(num), "%d", i - 1);
+    fcgi_param(&p, "EXEC_ARGC", num);
+
+    fcgi_record(b, FCGI_BEGIN_REQUEST, begin, sizeof(begin));
+    for(off = 0; off < p.len; off += n) {
+        n = p.len - off < FCGI_CHUNK ? p.len - off : FCGI_CHUNK;
+        fcgi_record(b, FCGI_PARAMS, p.data + off, n);
+    }
+    fcgi_record(b, FCGI_PARAMS, NULL, 0);
+    fcgi_record(b, FCGI_STDIN, NULL, 0);
+    free(p.data);
+    free(q.data);
+}
+
+/**
+ * @brief Waits for socket until request deadline or job cancel
+ * @return 0 ready, negative errno
+ */
+static int fcgi_wait(fcgiReq *rq, short events) {
+    int r, ms;
+    uint64_t now;
+    struct pollfd pfd = { .fd = rq->fd, .events = events };
+
+    do {
+        if(rq->opt->cancelled && rq->opt->cancelled(rq->opt->userdata)) return -ECANCELED;
+        ms = rq->opt->cancelled ? FCGI_CANCEL_MS : -1;
+        if(rq->deadline) {
+            now = fcgi_now();
+            if(now >= rq->deadline) return -ETIMEDOUT;
+            if(ms < 0 || rq->deadline - now < (uint64_t)ms * 1000)
+                ms = (rq->deadline - now + 999) / 1000;
+        }
+        r = poll(&pfd, 1, ms);
+    } while(r == 0 || (r < 0 && errno == EINTR));
+    if(r < 0) return -errno;
+    return 0;
+}
+
+static int fcgi_send(fcgiReq *rq, const char *buf, size_t len) {
+    ssize_t n;
+    int r;
+
+    while(len) {
+        n = send(rq->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN) return -errno;
+            if((r = fcgi_wait(rq, POLLOUT)) < 0) return r;
+            continue;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int fcgi_recv(fcgiReq *rq, char *buf, size_t len) {
+    ssize_t n;
+    int r;
+
+    while(len) {
+        n = recv(rq->fd, buf, len, MSG_DONTWAIT);
+        if(n == 0) return -ECONNRESET;
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN) return -errno;
+            if((r = fcgi_wait(rq, POLLIN)) < 0) return r;
+            continue;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void fcgi_out(fcgiReq *rq, const char *buf, size_t n) {
+    rq->res->bytes += n;
+    if(rq->opt->output && rq->opt->output->ring) {
+        proc_output_write(rq->opt->output, buf, n);
+    } else if(rq->outFd >= 0 && write(rq->outFd, buf, n) < 0) {
+        logWrn("Output %s write error(%d): %m", rq->opt->outFile, errno);
+        close(rq->outFd);
+        rq->outFd = -1;
+    }
+}
+
+/**
+ * @brief Stdout starts with CGI headers, they are dropped (but Status)
+ */
+static void fcgi_stdout(fcgiReq *rq, const char *buf, size_t n) {
+    char *end, *st;
+    size_t take;
+
+    if(rq->body) {
+        fcgi_out(rq, buf, n);
+        return;
+    }
+    take = sizeof(rq->headers) - 1 - rq->headersLen;
+    if(take > n) take = n;
+    memcpy(rq->headers + rq->headersLen, buf, take);
+    rq->headersLen += take;
+    rq->headers[rq->headersLen] = 0;
+
+    end = strstr(rq->headers, "\r\n\r\n");
+    if(!end && rq->headersLen < sizeof(rq->headers) - 1) return;
+
+    rq->body = true;
+    if(!end) {
+        // No header block, pass everything as is
+        fcgi_out(rq, rq->headers, rq->headersLen);
+    } else {
+        *end = 0;
+        st = strcasestr(rq->headers, "Status:");
+        if(st) rq->status = atoi(st + 7);
+        end += 4;
+        fcgi_out(rq, end, rq->headers + rq->headersLen - end);
+    }
+    fcgi_out(rq, buf + take, n - take);
+}
+
+static int fcgi_response(fcgiReq *rq) {
+    int r, type;
+    size_t len;
+    unsigned char h[FCGI_HDR_SZ];
+    char *content = malloc(FCGI_RECORD_MAX);
+
+    while(true) {
+        if((r = fcgi_recv(rq, (char*)h, FCGI_HDR_SZ)) < 0) break;
+        type = h[1];
+        len = (h[4] << 8) | h[5];
+        if((r = fcgi_recv(rq, content, len + h[6])) < 0) break;
+
+        if(type == FCGI_STDOUT) {
+            fcgi_stdout(rq, content, len);
+        } else if(type == FCGI_STDERR) {
+            fcgi_out(rq, content, len);
+        } else if(type == FCGI_END_REQUEST && len >= 8) {
+            const unsigned char *c = (const unsigned char*)content;
+            rq->res->code = (c[0] << 24) | (c[1] << 16) | (c[2] << 8) | c[3];
+            r = c[4] == 0 ? 0 : c[4] == FCGI_OVERLOADED ? -EAGAIN : -EPROTO;
+            break;
+        }
+    }
+    free(content);
+    return r;
+}
+
+/**
+ * @brief Runs PHP script argv[0] with arguments in persistent PHP-FPM
+ *        pool over FastCGI, blocking calling thread like proc_run.
+ *        Response headers are dropped, stdout and stderr go to output.
+ * @return 0 when script ran (res->code is its exit status, 255 for
+ *         5xx status), negative errno otherwise
+ */
+int fcgi_run(char *const argv[], const procOptions *opt, procResult *res) {
+    int r;
+    uint64_t t0 = fcgi_now();
+    metric *m;
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    fcgiBuf req = {0};
+    fcgiReq rq = { .fd = -1, .outFd = -1, .opt = opt, .res = res };
+    static const procOptions noOpt = {0};
+    const confStruct *c = conf_get();
+
+    if(!opt) rq.opt = opt = &noOpt;
+    memset(res, 0, sizeof(procResult));
+    if(proc_timeout(opt)) rq.deadline = t0 + proc_timeout(opt) * 1000000ULL;
+
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", c->fcgiSocket);
+    conf_put(c);
+    rq.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(rq.fd < 0 || connect(rq.fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+        r = -errno;
+        goto out;
+    }
+    res->spawnUs = fcgi_now() - t0;
+    // Racing first lookups get same series
+    m = atomic_load(&spawnUs);
+    if(!m) {
+        m = metrics_get(MetricHistogram, "executor_spawn_seconds", "Process start latency", "backend=\"fcgi\"");
+        atomic_store(&spawnUs, m);
+    }
+    metrics_observe(m, res->spawnUs);
+
+    if(!(opt->output && opt->output->ring) && opt->outFile) {
+        rq.outFd = open(opt->outFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664);
+    }
+
+    fcgi_request(&req, argv);
+    r = fcgi_send(&rq, req.data, req.len);
+    if(r == 0) r = fcgi_response(&rq);
+    res->runUs = fcgi_now() - t0;
+
+    if(r == -ETIMEDOUT || r == -ECANCELED) {
+        // Pool worker is freed by abort, or by connection close
+        unsigned char h[FCGI_HDR_SZ] = { FCGI_VERSION, FCGI_ABORT_REQUEST, 0, FCGI_REQUEST_ID };
+        if(r == -ETIMEDOUT) logWrn("FastCGI %s timed out after %us", argv[0], proc_timeout(opt));
+        else logInf("FastCGI %s cancelled, aborting request", argv[0]);
+        send(rq.fd, h, FCGI_HDR_SZ, MSG_NOSIGNAL | MSG_DONTWAIT);
+        res->timedOut = r == -ETIMEDOUT;
+        res->cancelled = r == -ECANCELED;
+    } else if(r == 0 && !res->code && rq.status >= 500) {
+        res->code = 255;
+    }
+    if(r == 0) {
+        logDbg("FastCGI %s done, code=%d status=%d, %lu us", argv[0], res->code, rq.status, res->runUs);
+    }
+
+out:
+    if(r < 0) {
+        res->error = -r;
+        if(r != -ECANCELED) logWrn("FastCGI %s error(%d): %s", argv[0], r, strerror(-r));
+    }
+    free(req.data);
+    if(rq.outFd >= 0) close(rq.outFd);
+    if(rq.fd >= 0) close(rq.fd);
+    return r;
+}
@@ -0,0 +1,338 @@
+#define LOG_MODULE  LOG_MOD_SYS
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <systemd/sd-event.h>
+
+#include "job.h"
+#include "bus.h"
+#include "loop.h"
+#include "metrics.h"
+#include "proc.h"
+#include "debug.h"
+
+#define JOB_HISTORY     128     // Finished jobs kept for queries
+#define JOB_PIDS_MAX    64      // Processes of one job running at once
+
+// Metric handles of one command label, found once
+typedef struct jobMetricsS {
+    struct jobMetricsS *next;
+    char cmd[16];
+    metric *queueUs;
+    metric *runUs;
+    metric *total[JobCancelled + 1];    // By final state
+} jobMetrics;
+
+struct jobS {
+    struct jobS *next;
+    uint64_t id;
+    char title[64];
+    char cmd[16];               // Metrics label, leading word of title
+    uint32_t chat;
+    jobMetrics *metrics;
+    jobState state;
+    bool cancel;
+    int code;
+    uint64_t start;             // us, CLOCK_MONOTONIC
+    uint64_t run;               // Became running
+    uint64_t durationUs;
+    uint64_t bytes;
+    int pids;
+    pid_t pid[JOB_PIDS_MAX];
+};
+
+// Finish notification, passed to event loop thread
+typedef struct jobEventS {
+    uint64_t id;
+    int code;
+    uint64_t durationUs;
+    uint64_t bytes;
+} jobEvent;
+
+typedef struct jobRegistryS {
+    pthread_mutex_t lock;
+    job *head;                  // Newest first
+    uint64_t seq;
+    jobMetrics *metrics;        // Per command, kept for lifetime
+    metric *running;
+} jobRegistry;
+
+// Local variables
+static jobRegistry jobs = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static const char *stateNames[] = { "queued", "running", "done", "failed", "cancelled" };
+
+static uint64_t job_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Handles of command label, registered on its first job.
+ *        Called with jobs.lock held.
+ */
+static jobMetrics *job_metrics(const char *cmd) {
+    int s;
+    jobMetrics *m;
+
+    for(m = jobs.metrics; m && strcmp(m->cmd, cmd); m = m->next);
+    if(m) return m;
+    m = calloc(1, sizeof(jobMetrics));
+    strcpy(m->cmd, cmd);
+    m->queueUs = metrics_get(MetricHistogram, "executor_job_queue_seconds", "Job wait for worker", "cmd=\"%s\"", cmd);
+    m->runUs = metrics_get(MetricHistogram, "executor_job_run_seconds", "Job execution time", "cmd=\"%s\"", cmd);
+    for(s = JobDone; s <= JobCancelled; s++) {
+        m->total[s] = metrics_get(MetricCounter, "executor_jobs_total", "Finished jobs"
+            , "cmd=\"%s\",state=\"%s\"", cmd, stateNames[s]);
+    }
+    m->next = jobs.metrics;
+    jobs.metrics = m;
+    return m;
+}
+
+static job *job_find(uint64_t id) {
+    job *j;
+    for(j = jobs.head; j && j->id != id; j = j->next);
+    return j;
+}
+
+static void job_info(const job *j, jobInfo *info, uint64_t now) {
+    info->id = j->id;
+    snprintf(info->title, sizeof(info->title), "%s", j->title);
+    info->chat = j->chat;
+    info->state = j->state;
+    info->code = j->code;
+    info->durationUs = j->state >= JobDone ? j->durationUs : now - j->start;
+    info->bytes = j->bytes;
+}
+
+/**
+ * @brief Emits finish signal on event loop thread
+ */
+static void job_finished(void *userdata) {
+    jobEvent *ev = userdata;
+
+    bus_job_finished(ev->id, ev->code, ev->durationUs, ev->bytes);
+    free(ev);
+}
+
+int job_init() {
+    jobs.running = metrics_get(MetricGauge, "executor_jobs_running", "Jobs being executed", NULL);
+    return 0;
+}
+
+/**
+ * @brief Registers queued job, forgetting finished ones over JOB_HISTORY.
+ *        Job belongs to caller until job_done.
+ */
+job *job_new(const char *title, uint32_t chat) {
+    int i, kept = 0;
+    job *j = calloc(1, sizeof(job)), **it, *old;
+
+    snprintf(j->title, sizeof(j->title), "%s", title);
+    for(i = 0; i < (int)sizeof(j->cmd) - 1 && isalpha((unsigned char)title[i]); i++) {
+        j->cmd[i] = tolower((unsigned char)title[i]);
+    }
+    j->chat = chat;
+    j->state = JobQueued;
+    j->start = job_now();
+
+    pthread_mutex_lock(&jobs.lock);
+    j->metrics = job_metrics(j->cmd);
+    j->id = ++jobs.seq;
+    j->next = jobs.head;
+    jobs.head = j;
+    for(it = &jobs.head; (old = *it); ) {
+        if(old->state >= JobDone && ++kept > JOB_HISTORY) {
+            *it = old->next;
+            free(old);
+        } else {
+            it = &old->next;
+        }
+    }
+    pthread_mutex_unlock(&jobs.lock);
+    return j;
+}
+
+uint64_t job_id(const job *j) {
+    return j ? j->id : 0;
+}
+
+/**
+ * @brief Marks job running
+ * @return false when it was cancelled while queued
+ */
+bool job_start(job *j) {
+    bool run, first = false;
+
+    pthread_mutex_lock(&jobs.lock);
+    run = !j->cancel;
+    if(run && j->state == JobQueued) {
+        j->state = JobRunning;
+        j->run = job_now();
+        first = true;
+    }
+    pthread_mutex_unlock(&jobs.lock);
+
+    if(first) {
+        metrics_observe(j->metrics->queueUs, j->run - j->start);
+        metrics_add(jobs.running, 1);
+    }
+    return run;
+}
+
+/**
+ * @brief Tracks job process for cancel. Process spawned after cancel
+ *        request is terminated at once.
+ */
+void job_pid(job *j, pid_t pid, bool running) {
+    int i;
+    bool kill = false;
+
+    pthread_mutex_lock(&jobs.lock);
+    if(running) {
+        if(j->pids < JOB_PIDS_MAX) j->pid[j->pids++] = pid;
+        kill = j->cancel;
+    } else {
+        for(i = 0; i < j->pids && j->pid[i] != pid; i++);
+        if(i < j->pids) j->pid[i] = j->pid[--j->pids];
+    }
+    pthread_mutex_unlock(&jobs.lock);
+    if(kill) proc_kill(pid);
+}
+
+/**
+ * @brief Finishes job and queues finish signal, job is owned by registry
+ *        afterwards
+ */
+/**
+ * @brief Cancel request check for jobs run without own process
+ */
+bool job_cancelled(job *j) {
+    bool r;
+
+    pthread_mutex_lock(&jobs.lock);
+    r = j->cancel;
+    pthread_mutex_unlock(&jobs.lock);
+    return r;
+}
+
+void job_done(job *j, int code, uint64_t bytes) {
+    uint64_t run;
+    jobMetrics *m = j->metrics;
+    jobState state;
+    jobEvent *ev = calloc(1, sizeof(jobEvent));
+
+    pthread_mutex_lock(&jobs.lock);
+    run = j->state == JobRunning ? job_now() - j->run : 0;
+    j->code = code;
+    j->bytes = bytes;
+    j->durationUs = job_now() - j->start;
+    j->state = j->cancel ? JobCancelled : code ? JobFailed : JobDone;
+    state = j->state;
+    ev->id = j->id;
+    ev->code = code;
+    ev->durationUs = j->durationUs;
+    ev->bytes = bytes;
+    logDbg("Job %lu %s, code=%d, %lu us", j->id, stateNames[j->state], code, j->durationUs);
+    pthread_mutex_unlock(&jobs.lock);
+
+    // Job may be forgotten by registry from now on
+    metrics_add(m->total[state], 1);
+    if(run) {
+        metrics_observe(m->runUs, run);
+        metrics_add(jobs.running, -1);
+    }
+
+    if(loop_call(job_finished, free, ev) < 0) free(ev);
+}
+
+int job_get(uint64_t id, jobInfo *info) {
+    int r = -ENOENT;
+    job *j;
+
+    pthread_mutex_lock(&jobs.lock);
+    if((j = job_find(id))) {
+        job_info(j, info, job_now());
+        r = 0;
+    }
+    pthread_mutex_unlock(&jobs.lock);
+    return r;
+}
+
+/**
+ * @brief Snapshot of known jobs, newest first. List is freed by caller.
+ * @return job count
+ */
+int job_list(jobInfo **list) {
+    int n = 0;
+    uint64_t now = job_now();
+    job *j;
+
+    pthread_mutex_lock(&jobs.lock);
+    for(j = jobs.head; j; j = j->next) n++;
+    *list = calloc(n ? n : 1, sizeof(jobInfo));
+    for(n = 0, j = jobs.head; j; j = j->next) {
+        job_info(j, &(*list)[n++], now);
+    }
+    pthread_mutex_unlock(&jobs.lock);
+    return n;
+}
+
+/**
+ * @brief Queued job is dropped when its worker picks it, running
+ *        processes get SIGTERM (SIGKILL after grace), FastCGI requests
+ *        are aborted by their worker (job_cancelled). Safe from any
+ *        thread: only job lock is taken and proc_kill is thread-safe.
+ * @return 0, -ENOENT for unknown or -EALREADY for finished job
+ */
+int job_cancel(uint64_t id) {
+    int i, n = 0;
+    pid_t pid[JOB_PIDS_MAX];
+    job *j;
+
+    pthread_mutex_lock(&jobs.lock);
+    j = job_find(id);
+    if(!j) {
+        pthread_mutex_unlock(&jobs.lock);
+        return -ENOENT;
+    }
+    if(j->state >= JobDone) {
+        pthread_mutex_unlock(&jobs.lock);
+        return -EALREADY;
+    }
+    j->cancel = true;
+    n = j->pids;
+    memcpy(pid, j->pid, n * sizeof(pid_t));
+    pthread_mutex_unlock(&jobs.lock);
+
+    logInf("Job %lu cancel, %d processes", id, n);
+    for(i = 0; i < n; i++) proc_kill(pid[i]);
+    return 0;
+}
+
+const char *job_state_name(jobState state) {
+    return state <= JobCancelled ? stateNames[state] : "unknown";
+}
+
+void job_deinit() {
+    job *j;
+    jobMetrics *m;
+
+    pthread_mutex_lock(&jobs.lock);
+    while((j = jobs.head)) {
+        jobs.head = j->next;
+        free(j);
+    }
+    while((m = jobs.metrics)) {
+        jobs.metrics = m->next;
+        free(m);
+    }
+    pthread_mutex_unlock(&jobs.lock);
+}
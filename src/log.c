@@ -0,0 +1,676 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#define SD_JOURNAL_SUPPRESS_LOCATION    // Location fields come from caller
+#include <systemd/sd-journal.h>
+
+#include "debug.h"
+#include "metrics.h"
+#include "config.h"
+
+#define LOG_RING_SZ     512         // Power of two
+#define LOG_LINE_SZ     2048
+#define LOG_BATCH       64          // Lines per writev, below IOV_MAX
+#define LOG_SYNC_MS     2000
+#define LOG_PACK_BUF    65536
+#define LOG_ROTATE_SZ   ((off_t)LOG_ROTATE_MB * 1024 * 1024)
+#define LOG_ROTATE_S    ((time_t)LOG_ROTATE_HOURS * 3600)
+
+typedef struct logEntryS {
+    int level;
+    int line;
+    const char *file;       // Static strings from log macros
+    const char *func;
+    uint64_t job;
+    uint32_t chat;
+} logEntry;
+
+typedef struct logSlotS {
+    atomic_size_t seq;
+    logEntry entry;
+    size_t len;
+    char line[LOG_LINE_SZ];
+} logSlot;
+
+typedef struct logWriterS {
+    pthread_t thread;
+    int wakeFd;
+    atomic_bool wakePending;
+    atomic_bool flush;
+    atomic_bool stop;
+    atomic_ulong dropped;
+    bool started;
+    metric *bytes;                      // Written to file or journal
+    off_t size;                         // Current file size, writer thread only
+    time_t opened;                      // Current file creation
+    _Alignas(64) atomic_size_t tail;    // Producers claim here
+    _Alignas(64) size_t head;           // Writer thread only
+    logSlot ring[LOG_RING_SZ];
+} logWriter;
+
+typedef struct logPackerS {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool pending;
+    bool stop;
+    bool started;
+} logPacker;
+
+/* global variables and constants */
+
+int                     gLogFile    = 0;
+int                     gLogConsole = false;
+int                     gLogLevel   = LOG_LEVEL_WARNING;    // Default logging level
+_Atomic int             gLogLevels[LOG_MOD_MAX + 1] = {     // Per module levels
+    LOG_LEVEL_WARNING, LOG_LEVEL_WARNING, LOG_LEVEL_WARNING, LOG_LEVEL_WARNING, LOG_LEVEL_WARNING
+};
+int                     gLogType    = LOG_TYPE_NORMAL;
+int                     gLogSink    = LOG_SINK_FILE;
+
+// Local variables
+static logWriter        *writer;
+static logPacker        packer      = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static __thread char    tlsLine[LOG_LINE_SZ];
+static __thread time_t  tlsSec      = -1;                   // Cached timestamp second
+static __thread char    tlsStamp[24];
+static __thread size_t  tlsStampLen;
+static __thread uint64_t tlsJob;                            // Context of current thread
+static __thread uint32_t tlsChat;
+
+// syslog(3) priorities of log levels
+static const int logPriority[] = { 5, 3, 4, 6, 7, 7 };
+
+const char *logLevelHeader[] = {
+    "\033[1;37mLOG\033[0m",  // LOG_LEVEL_ALWAYS    //
+    "\033[1;31mERR\033[0m",  // LOG_LEVEL_ERROR     // q = quiet
+    "\033[1;91mWRN\033[0m",  // LOG_LEVEL_WARNING   //   = default
+    "\033[1;37mINF\033[0m",  // LOG_LEVEL_INFO      // v = verbose
+    "\033[1;36mDBG\033[0m",  // LOG_LEVEL_DEBUG     // vv = verbose+
+    "\033[1;33mTRC\033[0m"   // LOG_LEVEL_TRACE     // vvv = verbose++
+};
+
+const char *logModuleName[] = {
+    "main",     // LOG_MOD_MAIN
+    "bus",      // LOG_MOD_BUS
+    "sys",      // LOG_MOD_SYS
+    "report",   // LOG_MOD_REPORT
+    "storage"   // LOG_MOD_STORAGE
+};
+
+const char *logLevelColor[] = {
+    "\033[0;37m",  // LOG_LEVEL_ALWAYS  #D0CFCC
+    "\033[0;31m",  // LOG_LEVEL_ERROR   #BC1B27
+    "\033[0;91m",  // LOG_LEVEL_WARNING #F15E42
+    "\033[0;37m",  // LOG_LEVEL_INFO    #D0CFCC
+    "\033[0;36m",  // LOG_LEVEL_DEBUG   #2AA1B3
+    "\033[0;33m"   // LOG_LEVEL_TRACE   #A2734C
+};
+
+static size_t log_append(char *buf, size_t pos, const char *fmt, ...) {
+    int r;
+    va_list ap;
+    if(pos >= LOG_LINE_SZ - 1) return pos;
+    va_start(ap, fmt);
+    r = vsnprintf(buf + pos, LOG_LINE_SZ - pos, fmt, ap);
+    va_end(ap);
+    if(r < 0) return pos;
+    pos += r;
+    return pos < LOG_LINE_SZ - 1 ? pos : LOG_LINE_SZ - 1;
+}
+
+/**
+ * @brief Claims ring slot and publishes line to writer thread.
+ *        Never blocks: line is dropped when ring is full.
+ */
+static bool log_enqueue(const logEntry *entry, const char *line, size_t len) {
+    logSlot *slot;
+    size_t pos = atomic_load_explicit(&writer->tail, memory_order_relaxed), seq;
+    intptr_t diff;
+
+    while(true) {
+        slot = &writer->ring[pos & (LOG_RING_SZ - 1)];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0) {
+            if(atomic_compare_exchange_weak_explicit(&writer->tail, &pos, pos + 1
+                    , memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if(diff < 0) {
+            atomic_fetch_add(&writer->dropped, 1);
+            return false;
+        } else {
+            pos = atomic_load_explicit(&writer->tail, memory_order_relaxed);
+        }
+    }
+
+    slot->entry = *entry;
+    memcpy(slot->line, line, len);
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    if(!atomic_exchange(&writer->wakePending, true)) {
+        eventfd_write(writer->wakeFd, 1);
+    }
+    return true;
+}
+
+static void log_write_all(int fd, struct iovec *iov, int cnt) {
+    ssize_t r;
+    while(cnt > 0) {
+        r = writev(fd, iov, cnt);
+        if(r < 0) {
+            if(errno == EINTR) continue;
+            return;
+        }
+        while(cnt > 0 && (size_t)r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if(cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+}
+
+/**
+ * @brief Sends one entry to journal as structured fields
+ */
+static void log_journal(const logEntry *e, const char *msg, size_t len) {
+    int n = 0;
+    char pri[16], file[LOG_LINE_SZ / 4], line[32], func[LOG_LINE_SZ / 4], job[40], chat[24];
+    struct iovec iov[8];
+
+    while(len && msg[len - 1] == '\n') len--;
+
+#define LOG_IOV(BUF, FMT, ...) do { int l = snprintf(BUF, sizeof(BUF), FMT, __VA_ARGS__); \
+        iov[n++] = (struct iovec){ BUF, l < (int)sizeof(BUF) ? (size_t)l : sizeof(BUF) - 1 }; } while (0)
+    LOG_IOV(pri, "PRIORITY=%d", logPriority[e->level]);
+    LOG_IOV(file, "CODE_FILE=%s", e->file);
+    LOG_IOV(line, "CODE_LINE=%d", e->line);
+    LOG_IOV(func, "CODE_FUNC=%s", e->func);
+    if(e->job)
+        LOG_IOV(job, "JOB_ID=%lu", (unsigned long)e->job);
+    if(e->chat)
+        LOG_IOV(chat, "CHAT=%u", e->chat);
+#undef LOG_IOV
+
+    // MESSAGE= prefix is stored in front of text by caller
+    iov[n++] = (struct iovec){ (void *)msg, len };
+    sd_journal_sendv(iov, n);
+}
+
+/**
+ * @brief Writes published lines in batches
+ * @return number of lines written
+ */
+static int log_drain() {
+    int i, cnt = 0, total = 0;
+    size_t seq;
+    logSlot *slot, *batch[LOG_BATCH];
+    struct iovec iov[LOG_BATCH];
+    off_t bytes;
+
+    do {
+        bytes = 0;
+        for(cnt = 0; cnt < LOG_BATCH; cnt++) {
+            slot = &writer->ring[writer->head & (LOG_RING_SZ - 1)];
+            seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+            if(seq != writer->head + 1) break;
+            batch[cnt] = slot;
+            iov[cnt].iov_base = slot->line;
+            iov[cnt].iov_len = slot->len;
+            bytes += slot->len;
+            writer->head++;
+        }
+        if(cnt && gLogSink == LOG_SINK_JOURNAL) {
+            for(i = 0; i < cnt; i++) {
+                log_journal(&batch[i]->entry, batch[i]->line, batch[i]->len);
+            }
+        } else if(cnt) {
+            log_write_all(gLogFile, iov, cnt);
+            writer->size += bytes;
+        }
+        if(cnt) {
+            metrics_add(writer->bytes, bytes);
+            for(i = 0; i < cnt; i++) {
+                atomic_store_explicit(&batch[i]->seq
+                    , writer->head - cnt + i + LOG_RING_SZ, memory_order_release);
+            }
+            total += cnt;
+        }
+    } while(cnt == LOG_BATCH);
+
+    return total;
+}
+
+/**
+ * @brief Compresses one rotated segment into <name>.gz and removes it
+ */
+static void log_pack(const char *name) {
+    int fd;
+    ssize_t n;
+    gzFile gz;
+    char part[PATH_MAX], dst[PATH_MAX];
+    static char buf[LOG_PACK_BUF];   // Packer thread only
+
+    snprintf(dst, PATH_MAX, "%s.gz", name);
+    snprintf(part, PATH_MAX, "%s.gz.part", name);
+
+    fd = open(name, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return;
+    gz = gzopen(part, "wb6");
+    if(!gz) {
+        close(fd);
+        return;
+    }
+    while((n = read(fd, buf, LOG_PACK_BUF)) > 0) {
+        if(gzwrite(gz, buf, (unsigned)n) != n) {
+            n = -1;
+            break;
+        }
+    }
+    close(fd);
+    if(gzclose(gz) != Z_OK || n < 0 || rename(part, dst) < 0) {
+        unlink(part);
+        return;
+    }
+    unlink(name);
+}
+
+// Length of "%Y%m%d-%H%M%S" stamp in segment names
+#define LOG_STAMP_LEN   15
+
+/**
+ * @brief Orders segments LOG_FILENAME.<stamp>[-<n>].gz by stamp, then by
+ *        suffix n of segments rotated within the same second
+ */
+static int log_segment_cmp(const void *a, const void *b) {
+    const char *x = *(char * const *)a + sizeof(LOG_FILENAME);
+    const char *y = *(char * const *)b + sizeof(LOG_FILENAME);
+    int r = strncmp(x, y, LOG_STAMP_LEN);
+
+    if(r) return r;
+    x += strnlen(x, LOG_STAMP_LEN);
+    y += strnlen(y, LOG_STAMP_LEN);
+    return (*x == '-' ? atoi(x + 1) : 0) - (*y == '-' ? atoi(y + 1) : 0);
+}
+
+/**
+ * @brief Compresses every rotated segment still plain (also ones left by
+ *        previous run) and removes oldest archives above LOG_ROTATE_KEEP
+ */
+static void log_pack_all() {
+    size_t i, len;
+    glob_t g;
+
+    if(glob(LOG_FILENAME ".[0-9]*", 0, NULL, &g) == 0) {
+        for(i = 0; i < g.gl_pathc; i++) {
+            if(strstr(g.gl_pathv[i], ".gz")) continue;
+            log_pack(g.gl_pathv[i]);
+        }
+        globfree(&g);
+    }
+
+    if(glob(LOG_FILENAME ".[0-9]*.gz", GLOB_NOSORT, NULL, &g) == 0) {
+        // Name order puts "-<n>" of same second before plain stamp
+        qsort(g.gl_pathv, g.gl_pathc, sizeof(char *), log_segment_cmp);
+        len = g.gl_pathc;
+        for(i = 0; len > LOG_ROTATE_KEEP && i < g.gl_pathc; i++, len--) {
+            unlink(g.gl_pathv[i]);
+        }
+        globfree(&g);
+    }
+}
+
+static void* log_packer(void *pData) {
+    struct sched_param sp = {0};
+
+    // Lowest CPU and I/O priority, archives are never urgent
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, 3 << 13 /* IOPRIO_CLASS_IDLE */);
+
+    pthread_mutex_lock(&packer.lock);
+    while(!packer.stop) {
+        if(!packer.pending) {
+            pthread_cond_wait(&packer.cond, &packer.lock);
+            continue;
+        }
+        packer.pending = false;
+        pthread_mutex_unlock(&packer.lock);
+        log_pack_all();
+        pthread_mutex_lock(&packer.lock);
+    }
+    pthread_mutex_unlock(&packer.lock);
+    return NULL;
+}
+
+static void log_pack_request() {
+    pthread_mutex_lock(&packer.lock);
+    packer.pending = true;
+    pthread_cond_signal(&packer.cond);
+    pthread_mutex_unlock(&packer.lock);
+}
+
+/**
+ * @brief Replaces log fd in place with freshly opened LOG_FILENAME
+ */
+static int log_reopen() {
+    int fd = open (LOG_FILENAME, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0664);
+    struct stat st;
+    if(fd < 0) return -errno;
+    fdatasync(gLogFile);
+    dup3(fd, gLogFile, O_CLOEXEC);
+    close(fd);
+    writer->size = fstat(gLogFile, &st) == 0 ? st.st_size : 0;
+    writer->opened = time(NULL);
+    writer->bytes = metrics_get(MetricCounter, "executor_log_bytes_total", "Log bytes written", NULL);
+    return 0;
+}
+
+/**
+ * @brief Rotates log by size or age: current file is renamed atomically
+ *        to LOG_FILENAME.<time>, new one is opened and packer is woken.
+ *        Also follows file moved away by external tool.
+ */
+static void log_rotate_check() {
+    int i;
+    time_t now = time(NULL);
+    struct tm t;
+    struct stat cur, st;
+    char name[PATH_MAX];
+    size_t n;
+
+    if(gLogConsole || gLogSink != LOG_SINK_FILE) return;
+
+    if(stat(LOG_FILENAME, &st) < 0 || fstat(gLogFile, &cur) < 0
+            || st.st_ino != cur.st_ino || st.st_dev != cur.st_dev) {
+        log_reopen();
+        return;
+    }
+
+    // At most one rotation per second keeps segment names unique and ordered
+    if(now == writer->opened) return;
+    if(!((LOG_ROTATE_MB && writer->size >= LOG_ROTATE_SZ)
+            || (LOG_ROTATE_HOURS && writer->size && now - writer->opened >= LOG_ROTATE_S)))
+        return;
+
+    localtime_r(&now, &t);
+    n = snprintf(name, PATH_MAX, "%s.", LOG_FILENAME);
+    n += strftime(name + n, PATH_MAX - n, "%Y%m%d-%H%M%S", &t);
+    for(i = 1; access(name, F_OK) == 0 && i < 100; i++) {
+        snprintf(name + n, PATH_MAX - n, "-%d", i);
+    }
+
+    if(rename(LOG_FILENAME, name) < 0) {
+        dprintf(gLogFile, "[%s] Log rotation error(%d): %m\n", logLevelHeader[LOG_LEVEL_ERROR], errno);
+        writer->opened = now;
+        return;
+    }
+    if(log_reopen() < 0) {
+        // Keep appending to renamed file, retry on next check
+        dprintf(gLogFile, "[%s] Log reopen error(%d): %m\n", logLevelHeader[LOG_LEVEL_ERROR], errno);
+        return;
+    }
+    if(packer.started)
+        log_pack_request();
+}
+
+static void* log_writer(void *pData) {
+    int n;
+    bool dirty = false;
+    unsigned long lost;
+    eventfd_t val;
+    struct pollfd pfd = { .fd = writer->wakeFd, .events = POLLIN };
+
+    while(true) {
+        n = poll(&pfd, 1, dirty ? LOG_SYNC_MS : -1);
+        if(n > 0)
+            eventfd_read(writer->wakeFd, &val);
+        atomic_store(&writer->wakePending, false);
+
+        if(log_drain())
+            dirty = true;
+
+        lost = atomic_exchange(&writer->dropped, 0);
+        if(lost && gLogSink == LOG_SINK_JOURNAL) {
+            sd_journal_send("MESSAGE=%lu log lines dropped, ring full", lost, "PRIORITY=4", NULL);
+        } else if(lost) {
+            dprintf(gLogFile, "[%s] %lu log lines dropped, ring full\n", logLevelHeader[LOG_LEVEL_WARNING], lost);
+        }
+
+        if(dirty && !gLogConsole && gLogSink == LOG_SINK_FILE && (n == 0 || atomic_exchange(&writer->flush, false))) {
+            fdatasync(gLogFile);
+            dirty = false;
+            log_rotate_check();
+        }
+
+        if(atomic_load(&writer->stop)) {
+            log_drain();
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Opens log output and starts writer thread.
+ *        Until started (and after stop) lines are written synchronously.
+ */
+int log_init() {
+    int r;
+    size_t i;
+    struct stat st;
+
+    log_set_level(LOG_MOD_ALL, gLogLevel);
+
+    if (gLogConsole || gLogSink == LOG_SINK_JOURNAL) {
+        gLogFile = fileno (stdout);
+    } else {
+        gLogFile = open (LOG_FILENAME, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0664);
+        if (gLogFile < 0) {
+            gLogFile = 0;
+            return -errno;
+        }
+    }
+
+    writer = aligned_alloc(64, sizeof(logWriter));
+    if(!writer) return -ENOMEM;
+    memset(writer, 0, sizeof(logWriter));
+    for(i = 0; i < LOG_RING_SZ; i++) {
+        atomic_init(&writer->ring[i].seq, i);
+    }
+
+    writer->wakeFd = eventfd(0, EFD_CLOEXEC);
+    if(writer->wakeFd < 0) {
+        r = -errno;
+        free(writer);
+        writer = NULL;
+        return r;
+    }
+
+    if(fstat(gLogFile, &st) == 0)
+        writer->size = st.st_size;
+    writer->opened = time(NULL);
+
+    r = pthread_create(&writer->thread, NULL, log_writer, NULL);
+    if(r != 0) {
+        close(writer->wakeFd);
+        free(writer);
+        writer = NULL;
+        return -r;
+    }
+    writer->started = true;
+
+    if(!gLogConsole && gLogSink == LOG_SINK_FILE && (LOG_ROTATE_MB || LOG_ROTATE_HOURS)) {
+        packer.pending = true;  // Pick up segments of previous run
+        packer.started = pthread_create(&packer.thread, NULL, log_packer, NULL) == 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief Changes runtime level of one module or of all (LOG_MOD_ALL)
+ * @return previous level or -EINVAL
+ */
+int log_set_level(int module, int level) {
+    int i, r;
+
+    if(level < LOG_LEVEL_ALWAYS || level > LOG_LEVEL_MAX) return -EINVAL;
+    if(module == LOG_MOD_ALL) {
+        r = gLogLevel;
+        gLogLevel = level;
+        for(i = 0; i <= LOG_MOD_MAX; i++) {
+            atomic_store(&gLogLevels[i], level);
+        }
+        return r;
+    }
+    if(module < 0 || module > LOG_MOD_MAX) return -EINVAL;
+    r = atomic_exchange(&gLogLevels[module], level);
+    return r;
+}
+
+/**
+ * @brief Looks up module by name, "all" or empty name means LOG_MOD_ALL
+ * @return module index or -ENOENT
+ */
+int log_module(const char *name) {
+    int i;
+    if(!name || !*name || strcmp(name, "all") == 0) return LOG_MOD_ALL;
+    for(i = 0; i <= LOG_MOD_MAX; i++) {
+        if(strcmp(name, logModuleName[i]) == 0) return i;
+    }
+    return -ENOENT;
+}
+
+void log_flush() {
+    if(writer && writer->started) {
+        atomic_store(&writer->flush, true);
+        if(!atomic_exchange(&writer->wakePending, true)) {
+            eventfd_write(writer->wakeFd, 1);
+        }
+    }
+}
+
+void log_deinit() {
+    logWriter *w = writer;
+    if(!w || !w->started) return;
+
+    atomic_store(&w->stop, true);
+    atomic_store(&w->flush, true);
+    eventfd_write(w->wakeFd, 1);
+    pthread_join(w->thread, NULL);
+
+    writer = NULL;
+    close(w->wakeFd);
+    free(w);
+
+    if(packer.started) {
+        pthread_mutex_lock(&packer.lock);
+        packer.stop = true;
+        pthread_cond_signal(&packer.cond);
+        pthread_mutex_unlock(&packer.lock);
+        pthread_join(packer.thread, NULL);
+        packer.started = false;
+    }
+    if(!gLogConsole && gLogSink == LOG_SINK_FILE)
+        fsync(gLogFile);
+}
+
+/**
+ * @brief Tags following log entries of calling thread with job and chat,
+ *        zero clears tag
+ */
+void log_set_job(uint64_t job) {
+    tlsJob = job;
+}
+
+void log_set_chat(uint32_t chat) {
+    tlsChat = chat;
+}
+
+void selfLogFunction(const char *file, int line, const char *fun, int logLevel, const char *fmt, ...) {
+    int r, err = errno;
+    size_t pos;
+    va_list ap;
+    struct tm t = {0};
+    struct timespec ts;
+    logEntry entry;
+
+    if (logLevel < 0) logLevel = 0;
+    if (logLevel > LOG_LEVEL_MAX) logLevel = LOG_LEVEL_MAX;
+    entry = (logEntry){ logLevel, line, file, fun, tlsJob, tlsChat };
+
+    if (gLogSink == LOG_SINK_JOURNAL) {
+        // Plain message, journal keeps time, level and location as fields
+        memcpy(tlsLine, "MESSAGE=", 8);
+        pos = 8;
+    } else {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        if (ts.tv_sec != tlsSec) {
+            tlsSec = ts.tv_sec;
+            localtime_r(&ts.tv_sec, &t);
+            tlsStampLen = strftime(tlsStamp, sizeof(tlsStamp), "%F %T", &t); // %F => %Y-%m-%d,  %T => %H:%M:%S
+        }
+        memcpy(tlsLine, tlsStamp, tlsStampLen);
+        pos = log_append(tlsLine, tlsStampLen, ".%03ld: [%s] %s %s"
+            , ts.tv_nsec / 1000000
+            , logLevelHeader[logLevel]
+            , fun
+            , logLevelColor[logLevel]);
+    }
+
+    va_start(ap, fmt);
+    errno = err;    // Keep %m of caller
+    r = vsnprintf(tlsLine + pos, LOG_LINE_SZ - pos, fmt, ap);
+    va_end(ap);
+
+    if (r >= 0) {
+        pos += r;
+        if (pos >= LOG_LINE_SZ - 1) pos = LOG_LINE_SZ - 1;
+        if (gLogSink == LOG_SINK_JOURNAL) {
+            pos = log_append(tlsLine, pos, "\n");
+        } else if (gLogType == LOG_TYPE_NORMAL) {
+            pos = log_append(tlsLine, pos, "%s\n", COLOR_NONE);
+        } else {
+            pos = log_append(tlsLine, pos, "%s [%s:%d]\n", COLOR_NONE, file, line);
+        }
+    } else {
+        err = errno;
+        pos = log_append(tlsLine, pos, "Message parse error(%d): %s%s\n", err, strerror(err)
+            , gLogSink == LOG_SINK_JOURNAL ? "" : COLOR_NONE);
+    }
+    tlsLine[pos - 1] = '\n';
+
+    if (writer && writer->started) {
+        log_enqueue(&entry, tlsLine, pos);
+    } else if (gLogSink == LOG_SINK_JOURNAL) {
+        log_journal(&entry, tlsLine, pos);
+    } else {
+        r = write(gLogFile ? gLogFile : fileno(stdout), tlsLine, pos);
+    }
+    errno = err;
+}
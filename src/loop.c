@@ -0,0 +1,207 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <systemd/sd-event.h>
+
+#include "loop.h"
+#include "conf.h"
+#include "debug.h"
+
+#define FLUSH_INTERVAL_US   2000000ULL  // Log fsync period
+#define FLUSH_ACCURACY_US   100000ULL
+
+// Call queued by other thread
+typedef struct loopCallS {
+    struct loopCallS *next;
+    loopFunc func;
+    loopFunc drop;              // Frees userdata of call that never runs
+    void *userdata;
+} loopCall;
+
+// Local variables
+static sd_event         *event;
+static sd_event_source  *flushSource;
+static sd_event_source  *callSource;
+static pthread_mutex_t  callLock = PTHREAD_MUTEX_INITIALIZER;
+static loopCall         *calls;         // Newest first
+static int              callFd = -1;
+static pthread_t        loopThread;     // Thread that called loop_init and runs loop
+
+static int loop_signal_cb (sd_event_source *s, const struct signalfd_siginfo *si, void *userdata) {
+    logInf("Signal %d (%s) received, exiting", si->ssi_signo, strsignal(si->ssi_signo));
+    sd_event_exit(event, 0);
+    return 0;
+}
+
+static int loop_reload_cb (sd_event_source *s, const struct signalfd_siginfo *si, void *userdata) {
+    int r = conf_reload();
+    if(r < 0) logErr("Reload failed(%d): %s, settings kept", r, strerror(-r));
+    return 0;
+}
+
+static int loop_flush_cb (sd_event_source *s, uint64_t usec, void *userdata) {
+    log_flush();
+    sd_event_source_set_time(s, usec + FLUSH_INTERVAL_US);
+    return 0;
+}
+
+static int loop_call_cb (sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+    eventfd_t val;
+    loopCall *c, *fifo = NULL, *next;
+
+    eventfd_read(fd, &val);
+    pthread_mutex_lock(&callLock);
+    c = calls;
+    calls = NULL;
+    pthread_mutex_unlock(&callLock);
+
+    for(; c; c = next) {
+        next = c->next;
+        c->next = fifo;
+        fifo = c;
+    }
+    for(c = fifo; c; c = next) {
+        next = c->next;
+        c->func(c->userdata);
+        free(c);
+    }
+    return 0;
+}
+
+/**
+ * @brief Blocks signals handled by loop. Must be called before any thread
+ *        is created (log threads too), so all threads inherit the mask
+ *        and signals land on signalfd of loop.
+ * @return 0 or negative error
+ */
+int loop_block_signals() {
+    sigset_t ss;
+
+    sigemptyset(&ss);
+    sigaddset(&ss, SIGTERM);
+    sigaddset(&ss, SIGINT);
+    sigaddset(&ss, SIGHUP);
+    return -pthread_sigmask(SIG_BLOCK, &ss, NULL);
+}
+
+/**
+ * @brief Creates main event loop with signal and housekeeping sources,
+ *        signals are blocked by loop_block_signals before
+ */
+int loop_init() {
+    int r;
+    uint64_t now;
+
+    loopThread = pthread_self();
+    r = sd_event_default(&event);
+    if(r < 0) {
+        logErr("Event loop creation error(%d): %s", r, strerror(-r));
+        return r;
+    }
+
+    r = sd_event_add_signal(event, NULL, SIGTERM, loop_signal_cb, NULL);
+    if(r >= 0)
+        r = sd_event_add_signal(event, NULL, SIGINT, loop_signal_cb, NULL);
+    if(r >= 0)
+        r = sd_event_add_signal(event, NULL, SIGHUP, loop_reload_cb, NULL);
+    if(r < 0) {
+        logErr("Signal source error(%d): %s", r, strerror(-r));
+        return r;
+    }
+
+    sd_event_now(event, CLOCK_MONOTONIC, &now);
+    r = sd_event_add_time(event, &flushSource, CLOCK_MONOTONIC
+                        , now + FLUSH_INTERVAL_US, FLUSH_ACCURACY_US
+                        , loop_flush_cb, NULL);
+    if(r < 0) {
+        logErr("Flush timer error(%d): %s", r, strerror(-r));
+        return r;
+    }
+    sd_event_source_set_enabled(flushSource, SD_EVENT_ON);
+
+    callFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(callFd < 0) {
+        logErr("Loop eventfd error(%d): %m", errno);
+        return -errno;
+    }
+    r = sd_event_add_io(event, &callSource, callFd, EPOLLIN, loop_call_cb, NULL);
+    if(r < 0) {
+        logErr("Loop call source error(%d): %s", r, strerror(-r));
+        return r;
+    }
+
+    logTrc("Event loop initialized");
+    return 0;
+}
+
+int loop_run() {
+    int r = sd_event_loop(event);
+    if(r < 0) {
+        logErr("Event loop error(%d): %s", r, strerror(-r));
+    }
+    return r;
+}
+
+bool loop_on_thread() {
+    return event && pthread_equal(pthread_self(), loopThread);
+}
+
+void loop_exit(int code) {
+    if(event) {
+        sd_event_exit(event, code);
+    }
+}
+
+/**
+ * @brief Runs func on event loop thread, callable from any thread.
+ *        Calls run in order they were queued. Call still queued at
+ *        loop_deinit gets drop (when given) instead. On error nothing is
+ *        called, userdata stays with caller.
+ */
+int loop_call(loopFunc func, loopFunc drop, void *userdata) {
+    loopCall *c;
+
+    c = malloc(sizeof(loopCall));
+    if(!c) return -ENOMEM;
+    c->func = func;
+    c->drop = drop;
+    c->userdata = userdata;
+    pthread_mutex_lock(&callLock);
+    if(callFd < 0) {
+        pthread_mutex_unlock(&callLock);
+        free(c);
+        return -EBADF;
+    }
+    c->next = calls;
+    calls = c;
+    eventfd_write(callFd, 1);
+    pthread_mutex_unlock(&callLock);
+    return 0;
+}
+
+sd_event *loop_event() {
+    return event;
+}
+
+void loop_deinit() {
+    loopCall *c;
+
+    callSource = sd_event_source_disable_unref(callSource);
+    pthread_mutex_lock(&callLock);
+    if(callFd >= 0) close(callFd);
+    callFd = -1;
+    while((c = calls)) {
+        calls = c->next;
+        if(c->drop) c->drop(c->userdata);
+        free(c);
+    }
+    pthread_mutex_unlock(&callLock);
+    flushSource = sd_event_source_unref(flushSource);
+    event = sd_event_unref(event);
+}
@@ -14,17 +14,22 @@
 #include "storage.h"
 #include "debug.h"
 #include "bus.h"
+#include "command.h"
+#include "conf.h"
+#include "loop.h"
+#include "metrics.h"
+#include "job.h"
+#include "pool.h"
+#include "proc.h"
+#include "queue.h"
+#include "report.h"
+#include "sys.h"
+#include "watch.h"
 #include "config.h"
 
 /* global variables and constants */
 
-pthread_mutex_t         gLogMutex;
-int                     gLogFile    = 0;
-int                     gLogConsole = false;
 int                     gPrintHelp  = false;
-static int              gLogLevel   = LOG_LEVEL_WARNING;    // Logging level
-static int              gLogType    = LOG_TYPE_NORMAL;
-static unsigned long    gLogFlush   = 0;
 
 
 
@@ -34,6 +39,14 @@ const struct option longOptions[] = {
     {"quiet",           no_argument,        0,  'q'},
     {"extended-log",    no_argument,        0,  'x'},
     {"console",         no_argument,        0,  'c'},
+    {"journal",         no_argument,        0,  'j'},
+    {"scripts",         required_argument,  0,  's'},
+    {"out",             required_argument,  0,  'o'},
+    {"php-log",         required_argument,  0,  'l'},
+    {"api-url",         required_argument,  0,  'a'},
+    {"spool",           required_argument,  0,  'p'},
+    {"commands",        required_argument,  0,  'm'},
+    {"config",          required_argument,  0,  'f'},
     {"help",            no_argument,        0,  'h'}
 };
 const char *optionDesc[] = {
@@ -41,104 +54,17 @@ const char *optionDesc[] = {
     "\tminimal log level (ERR)",
     "extended log format",
     "\trun as a service (No timestamp in log)",
+    "\tlog to systemd journal with structured fields",
+    "\tscripts directory (" SCRIPTS_PATH ")",
+    "\tjob output directory (" OUT_PATH ")",
+    "\tPHP error log for tail (" PHP_LOG ")",
+    "\tTelegram Bot API base URL",
+    "\tundelivered reports file (" TG_SPOOL ")",
+    "\tcommand definitions (" COMMANDS_FILE ")",
+    "\truntime settings, re-read on SIGHUP (" CONF_FILE ")",
     "\tdisplay this help"
 };
-const char *shortOptions = "vqxch";
-
-const char *logLevelHeader[] = {
-    "\033[1;37mLOG\033[0m",  // LOG_LEVEL_ALWAYS    //
-    "\033[1;31mERR\033[0m",  // LOG_LEVEL_ERROR     // q = quiet
-    "\033[1;91mWRN\033[0m",  // LOG_LEVEL_WARNING   //   = default
-    "\033[1;37mINF\033[0m",  // LOG_LEVEL_INFO      // v = verbose
-    "\033[1;36mDBG\033[0m",  // LOG_LEVEL_DEBUG     // vv = verbose+
-    "\033[1;33mTRC\033[0m"   // LOG_LEVEL_TRACE     // vvv = verbose++
-};
-
-const char *logLevelColor[] = {
-    "\033[0;37m",  // LOG_LEVEL_ALWAYS  #D0CFCC
-    "\033[0;31m",  // LOG_LEVEL_ERROR   #BC1B27
-    "\033[0;91m",  // LOG_LEVEL_WARNING #F15E42
-    "\033[0;37m",  // LOG_LEVEL_INFO    #D0CFCC
-    "\033[0;36m",  // LOG_LEVEL_DEBUG   #2AA1B3
-    "\033[0;33m"   // LOG_LEVEL_TRACE   #A2734C
-};
-
-void selfLogFunction(const char *file, int line, const char *fun, int logLevel, const char *fmt, ...) {
-    if (logLevel <= gLogLevel) {
-        int r, err;
-        size_t sz;
-        va_list ap;
-        char *msg = NULL;
-        struct tm t = {0};
-        struct timeval tv;
-        char tms[34] = {0};
-
-        pthread_mutex_lock (&gLogMutex);
-
-        if (logLevel < 0) logLevel = 0;
-        if (logLevel > LOG_LEVEL_MAX) logLevel = LOG_LEVEL_MAX;
-
-        if (gLogConsole) {
-            gLogFile = fileno (stdout);
-        } else {
-            if (!gLogFile) {
-                gLogFile = open (LOG_FILENAME, O_WRONLY | O_APPEND | O_CREAT, 0664);
-            }
-            if (!gLogFile) return;
-        }
-
-        gettimeofday(&tv, NULL);
-        localtime_r(&tv.tv_sec, &t);
-        sz = strftime(tms, sizeof(tms), "%F %T", &t); // %F => %Y-%m-%d,  %T => %H:%M:%S
-        sprintf(tms + sz, ".%03ld: ", tv.tv_usec);
-
-        va_start(ap, fmt);
-        r = vasprintf(&msg, fmt, ap);
-        err = errno;
-        va_end(ap);
-
-        if (r) {
-            if (gLogType == LOG_TYPE_NORMAL) {
-                dprintf(gLogFile, "%s[%s] %s %s%s%s\n"
-                    , tms
-                    , logLevelHeader[logLevel]
-                    , fun
-                    , logLevelColor[logLevel]
-                    , msg
-                    , COLOR_NONE);
-            } else {
-                dprintf(gLogFile, "%s[%s] %s %s%s%s [%s:%d]\n"
-                    , tms
-                    , logLevelHeader[logLevel]
-                    , fun
-                    , logLevelColor[logLevel]
-                    , msg
-                    , COLOR_NONE
-                    , file
-                    , line);
-            }
-        } else {
-            dprintf(gLogFile, "%s[%s] %s %sMessage parse error(%d): %s%s\n"
-                , tms
-                , logLevelHeader[LOG_LEVEL_ERROR]
-                , fun
-                , logLevelColor[LOG_LEVEL_ERROR]
-                , err
-                , strerror(err)
-                , COLOR_NONE);
-        }
-
-        if (gLogFlush <= tv.tv_sec) {
-            fsync(gLogFile);
-            gLogFlush = tv.tv_sec + 2;
-        }
-
-        if(msg)
-            free(msg);
-
-        pthread_mutex_unlock (&gLogMutex);
-    }
-}
+const char *shortOptions = "vqxcjs:o:l:a:p:m:f:h";
 
 void parse_options(int argc, char **argv) {
     int i;
@@ -164,6 +90,38 @@ void parse_options(int argc, char **argv) {
                 gLogConsole = true;
                 break;
 
+            case 'j': // journal
+                gLogSink = LOG_SINK_JOURNAL;
+                break;
+
+            case 's': // scripts
+                gScriptsPath = optarg;
+                break;
+
+            case 'o': // out
+                gOutPath = optarg;
+                break;
+
+            case 'l': // php-log
+                gPhpLog = optarg;
+                break;
+
+            case 'a': // api-url
+                gApiUrl = optarg;
+                break;
+
+            case 'p': // spool
+                gSpoolPath = optarg;
+                break;
+
+            case 'm': // commands
+                gCommandsPath = optarg;
+                break;
+
+            case 'f': // config
+                gConfPath = optarg;
+                break;
+
             case 'h': // help
                 gPrintHelp = true;
                 break;
@@ -175,6 +133,8 @@ void parse_options(int argc, char **argv) {
 }
 
 int main(int argc, char **argv) {
+    int r;
+    const confStruct *c;
 
     parse_options(argc, argv);
 
@@ -192,22 +152,101 @@ int main(int argc, char **argv) {
         return 0;
     }
 
+    r = loop_block_signals();
+    if(r < 0) {
+        fprintf(stderr, "Signal mask error(%d): %s\n", r, strerror(-r));
+        return 1;
+    }
+
+    r = log_init();
+    if(r < 0) {
+        fprintf(stderr, "Log %s open error(%d): %s\n", LOG_FILENAME, r, strerror(-r));
+        return 1;
+    }
+
     log("Run %s with %d args", argv[0], argc);
-    // if(!storage_init(argc, argv)) {
-    //     logErr("Error exit");
-    //     return 1;
-    // }
+    if(conf_init() < 0) {
+        logErr("Config %s error", gConfPath);
+        return 1;
+    }
 
-    if(bus_init() < 0) {
-        logErr("Bus error");
+    if(loop_init() < 0) {
+        logErr("Event loop error");
         return 1;
     }
 
-    while(true) {
-        bus_process();
-        usleep(10000);
+    // Daemon works without endpoint, metrics are still kept for bus
+    if(metrics_init() < 0) {
+        logWrn("Metrics endpoint disabled");
+    }
+
+    if(report_init() < 0) {
+        logErr("Report sender error");
+        return 1;
+    }
+
+    if(proc_init() < 0) {
+        logErr("Process engine error");
+        return 1;
+    }
+
+    if(job_init() < 0) {
+        logErr("Job registry error");
+        return 1;
+    }
+
+    c = conf_get();
+    r = pool_init(c->poolWorkers, c->poolQueue);
+    conf_put(c);
+    if(r < 0) {
+        logErr("Job pool error");
+        return 1;
+    }
+
+    if(command_init() < 0) {
+        logErr("Commands %s error", gCommandsPath);
+        return 1;
+    }
+
+    // Shared command queue and lookups need database, bus commands work without it
+    if((QUEUE_BATCH > 0 || DB_LOOKUP) && storage_init(argc, argv) < 0) {
+        logErr("Storage error");
+        return 1;
+    }
+
+    if(queue_init() < 0) {
+        logErr("Command queue error");
+        return 1;
+    }
+
+    // Error summaries are optional, commands work without them
+    if(watch_init() < 0) {
+        logWrn("PHP log watcher disabled");
+    }
+
+    if(bus_init() < 0) {
+        logErr("Bus error");
+        return 1;
     }
 
-    return 0;
+    r = loop_run();
+
+    log("Stop %s (%d)", argv[0], r);
+    bus_deinit();
+    queue_deinit();
+    watch_deinit();
+    proc_deinit();
+    pool_deinit();
+    sys_deinit();
+    command_deinit();
+    job_deinit();
+    if(QUEUE_BATCH > 0 || DB_LOOKUP) storage_close();
+    report_deinit();
+    loop_deinit();
+    log_deinit();
+    metrics_deinit();
+    conf_deinit();
+
+    return r < 0 ? 1 : 0;
 }
 
@@ -0,0 +1,434 @@
+#define LOG_MODULE  LOG_MOD_MAIN
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <systemd/sd-event.h>
+
+#include "metrics.h"
+#include "loop.h"
+#include "conf.h"
+#include "debug.h"
+#include "config.h"
+
+// HDR-style histogram: values below HIST_LINEAR are exact, above them
+// every power of two is split into 2^HIST_SUB_BITS equal buckets
+#define HIST_LINEAR     16
+#define HIST_SUB_BITS   3
+#define HIST_EXP_MIN    4                   // log2(HIST_LINEAR)
+#define HIST_EXP_MAX    39                  // ~6 days in us
+#define HIST_BUCKETS    (HIST_LINEAR + (HIST_EXP_MAX - HIST_EXP_MIN + 1) * (1 << HIST_SUB_BITS))
+#define HIST_EXPORT_MAX 36                  // Last exported le, 2^36 us ~ 19 hours
+
+#define METRICS_LABELS_SZ   96
+#define METRICS_BACKLOG     8
+#define METRICS_REQUEST_SZ  1024
+
+struct metricS {
+    struct metricS *next;
+    metricType type;
+    const char *name;           // Static strings
+    const char *help;
+    char labels[METRICS_LABELS_SZ];
+    _Atomic int64_t value;      // Counter or gauge
+    atomic_uint_fast64_t count; // Histogram observations
+    atomic_uint_fast64_t sum;   // us
+    atomic_uint_fast64_t *buckets;
+};
+
+// Scrape in progress
+typedef struct metricsClientS {
+    struct metricsClientS *next;
+    int fd;
+    sd_event_source *src;
+    char *buf;                  // Response, NULL until request is read
+    size_t len;
+    size_t off;
+} metricsClient;
+
+typedef struct metricsRegistryS {
+    pthread_mutex_t lock;
+    metric *head;               // Series of one name are adjacent
+    int listenFd;
+    char listenAddr[108];       // Socket path or "address:port" bound
+    sd_event_source *listenSrc;
+    metricsClient *clients;
+} metricsRegistry;
+
+// Local variables
+static metricsRegistry registry = { .lock = PTHREAD_MUTEX_INITIALIZER, .listenFd = -1 };
+
+static const char *typeNames[] = { "counter", "gauge", "histogram" };
+
+uint64_t metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int hist_index(uint64_t v) {
+    int e;
+    if(v < HIST_LINEAR) return v;
+    e = 63 - __builtin_clzll(v);
+    if(e > HIST_EXP_MAX) return HIST_BUCKETS - 1;
+    return HIST_LINEAR + (e - HIST_EXP_MIN) * (1 << HIST_SUB_BITS)
+        + ((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+// First value of bucket, next bucket starts at hist_lower(i + 1)
+static uint64_t hist_lower(int i) {
+    int e, sub;
+    if(i < HIST_LINEAR) return i;
+    e = (i - HIST_LINEAR) / (1 << HIST_SUB_BITS) + HIST_EXP_MIN;
+    sub = (i - HIST_LINEAR) % (1 << HIST_SUB_BITS);
+    return (1ULL << e) + ((uint64_t)sub << (e - HIST_SUB_BITS));
+}
+
+/**
+ * @brief Finds or registers series. Name and help must be static strings,
+ *        labels are printf formatted: "cmd=\"%s\"". Lookup takes registry
+ *        lock, so hot paths keep returned handle, updates are lock-free.
+ * @return series or NULL when out of memory
+ */
+metric *metrics_get(metricType type, const char *name, const char *help, const char *labels, ...) {
+    char buf[METRICS_LABELS_SZ] = "";
+    va_list ap;
+    metric *m, *last = NULL;
+
+    if(labels) {
+        va_start(ap, labels);
+        vsnprintf(buf, sizeof(buf), labels, ap);
+        va_end(ap);
+    }
+
+    pthread_mutex_lock(&registry.lock);
+    for(m = registry.head; m; m = m->next) {
+        if(strcmp(m->name, name)) continue;
+        if(!strcmp(m->labels, buf)) break;
+        last = m;
+    }
+    if(!m && (m = calloc(1, sizeof(metric)))) {
+        m->type = type;
+        m->name = name;
+        m->help = help;
+        strcpy(m->labels, buf);
+        if(type == MetricHistogram && !(m->buckets = calloc(HIST_BUCKETS, sizeof(atomic_uint_fast64_t)))) {
+            free(m);
+            m = NULL;
+        } else if(last) {
+            m->next = last->next;
+            last->next = m;
+        } else {
+            m->next = registry.head;
+            registry.head = m;
+        }
+    }
+    pthread_mutex_unlock(&registry.lock);
+    return m;
+}
+
+void metrics_add(metric *m, int64_t v) {
+    if(m) atomic_fetch_add_explicit(&m->value, v, memory_order_relaxed);
+}
+
+void metrics_set(metric *m, int64_t v) {
+    if(m) atomic_store_explicit(&m->value, v, memory_order_relaxed);
+}
+
+void metrics_observe(metric *m, uint64_t us) {
+    if(!m || !m->buckets) return;
+    atomic_fetch_add_explicit(&m->buckets[hist_index(us)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->sum, us, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->count, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Sum of all series of name: values or histogram observations
+ */
+uint64_t metrics_total(const char *name) {
+    uint64_t r = 0;
+    metric *m;
+
+    pthread_mutex_lock(&registry.lock);
+    for(m = registry.head; m; m = m->next) {
+        if(strcmp(m->name, name)) continue;
+        r += m->buckets ? atomic_load_explicit(&m->count, memory_order_relaxed)
+                        : (uint64_t)atomic_load_explicit(&m->value, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&registry.lock);
+    return r;
+}
+
+/**
+ * @brief Quantile over all series of histogram name
+ * @return us, middle of matching bucket, 0 when empty
+ */
+uint64_t metrics_quantile(const char *name, double q) {
+    int i;
+    uint64_t total = 0, rank, seen = 0, *merged = calloc(HIST_BUCKETS, sizeof(uint64_t));
+    metric *m;
+
+    if(!merged) return 0;
+    pthread_mutex_lock(&registry.lock);
+    for(m = registry.head; m; m = m->next) {
+        if(!m->buckets || strcmp(m->name, name)) continue;
+        for(i = 0; i < HIST_BUCKETS; i++) {
+            merged[i] += atomic_load_explicit(&m->buckets[i], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&registry.lock);
+
+    for(i = 0; i < HIST_BUCKETS; i++) total += merged[i];
+    rank = q * total + 0.5;
+    if(rank < 1) rank = 1;
+    for(i = 0; i < HIST_BUCKETS && total; i++) {
+        if((seen += merged[i]) >= rank) break;
+    }
+    free(merged);
+    if(!total) return 0;
+    return i < HIST_BUCKETS - 1 ? (hist_lower(i) + hist_lower(i + 1) - 1) / 2 : hist_lower(i);
+}
+
+static void metrics_series(FILE *f, const metric *m, const char *suffix, const char *le) {
+    fprintf(f, "%s%s", m->name, suffix);
+    if(m->labels[0] || le) {
+        fprintf(f, "{%s%s", m->labels, m->labels[0] && le ? "," : "");
+        if(le) fprintf(f, "le=\"%s\"", le);
+        fputc('}', f);
+    }
+    fputc(' ', f);
+}
+
+/**
+ * @brief Writes registry in Prometheus text exposition format
+ */
+static void metrics_format(FILE *f) {
+    int i, e;
+    char le[32];
+    uint64_t cum;
+    const char *family = NULL;
+    metric *m;
+
+    pthread_mutex_lock(&registry.lock);
+    for(m = registry.head; m; m = m->next) {
+        if(!family || strcmp(family, m->name)) {
+            family = m->name;
+            fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, typeNames[m->type]);
+        }
+        if(!m->buckets) {
+            metrics_series(f, m, "", NULL);
+            fprintf(f, "%ld\n", (long)atomic_load_explicit(&m->value, memory_order_relaxed));
+            continue;
+        }
+        cum = 0;
+        for(i = 0, e = HIST_EXP_MIN; e <= HIST_EXPORT_MAX; e++) {
+            for(; hist_lower(i) < (1ULL << e); i++) {
+                cum += atomic_load_explicit(&m->buckets[i], memory_order_relaxed);
+            }
+            snprintf(le, sizeof(le), "%g", (double)(1ULL << e) / 1e6);
+            metrics_series(f, m, "_bucket", le);
+            fprintf(f, "%lu\n", cum);
+        }
+        for(; i < HIST_BUCKETS; i++) {
+            cum += atomic_load_explicit(&m->buckets[i], memory_order_relaxed);
+        }
+        metrics_series(f, m, "_bucket", "+Inf");
+        fprintf(f, "%lu\n", cum);
+        metrics_series(f, m, "_sum", NULL);
+        fprintf(f, "%.6f\n", atomic_load_explicit(&m->sum, memory_order_relaxed) / 1e6);
+        metrics_series(f, m, "_count", NULL);
+        fprintf(f, "%lu\n", cum);
+    }
+    pthread_mutex_unlock(&registry.lock);
+}
+
+static void metrics_client_free(metricsClient *c) {
+    metricsClient **it;
+
+    for(it = &registry.clients; *it && *it != c; it = &(*it)->next);
+    if(*it) *it = c->next;
+    sd_event_source_disable_unref(c->src);
+    close(c->fd);
+    free(c->buf);
+    free(c);
+}
+
+static int metrics_respond(metricsClient *c) {
+    char *body = NULL;
+    size_t len = 0;
+    int hdr;
+    FILE *f = open_memstream(&body, &len);
+
+    if(!f) return -errno;
+    metrics_format(f);
+    fclose(f);
+
+    hdr = asprintf(&c->buf, "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\n"
+                            "Connection: close\r\n\r\n%s", len, body);
+    free(body);
+    if(hdr < 0) {
+        c->buf = NULL;
+        return -ENOMEM;
+    }
+    c->len = hdr;
+    return sd_event_source_set_io_events(c->src, EPOLLOUT);
+}
+
+/**
+ * @brief Any request gets metrics page, answered once first bytes arrive
+ */
+static int metrics_client_cb(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+    char req[METRICS_REQUEST_SZ];
+    ssize_t r;
+    metricsClient *c = userdata;
+
+    if(!c->buf) {
+        r = read(fd, req, sizeof(req));
+        if(r < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+        if(r <= 0 || metrics_respond(c) < 0) {
+            metrics_client_free(c);
+            return 0;
+        }
+    }
+    r = write(fd, c->buf + c->off, c->len - c->off);
+    if(r < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+    if(r > 0) c->off += r;
+    if(r <= 0 || c->off == c->len) metrics_client_free(c);
+    return 0;
+}
+
+static int metrics_accept_cb(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+    int r, cfd;
+    metricsClient *c;
+
+    while((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        c = calloc(1, sizeof(metricsClient));
+        c->fd = cfd;
+        r = sd_event_add_io(loop_event(), &c->src, cfd, EPOLLIN, metrics_client_cb, c);
+        if(r < 0) {
+            logWrn("Metrics client source error(%d): %s", r, strerror(-r));
+            close(cfd);
+            free(c);
+            continue;
+        }
+        c->next = registry.clients;
+        registry.clients = c;
+    }
+    if(errno != EAGAIN && errno != EINTR) logWrn("Metrics accept error(%d): %m", errno);
+    return 0;
+}
+
+/**
+ * @brief Opens metrics_listen endpoint: socket path or loopback "address:port",
+ *        empty disables endpoint
+ */
+static int metrics_listen(const char *addr) {
+    int fd, port;
+    char host[INET_ADDRSTRLEN];
+    const char *colon;
+    struct sockaddr_un un = { .sun_family = AF_UNIX };
+    struct sockaddr_in in = { .sin_family = AF_INET };
+    struct sockaddr *sa;
+    socklen_t len;
+
+    if(addr[0] == '/') {
+        if(strlen(addr) >= sizeof(un.sun_path)) return -ENAMETOOLONG;
+        strcpy(un.sun_path, addr);
+        unlink(addr);
+        sa = (struct sockaddr *)&un;
+        len = sizeof(un);
+    } else {
+        colon = strrchr(addr, ':');
+        if(!colon || colon - addr >= (int)sizeof(host)) return -EINVAL;
+        memcpy(host, addr, colon - addr);
+        host[colon - addr] = 0;
+        port = atoi(colon + 1);
+        if(port <= 0 || port > 65535 || inet_pton(AF_INET, host, &in.sin_addr) != 1) return -EINVAL;
+        in.sin_port = htons(port);
+        sa = (struct sockaddr *)&in;
+        len = sizeof(in);
+    }
+
+    fd = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) return -errno;
+    if(sa->sa_family == AF_INET) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    if(bind(fd, sa, len) < 0 || listen(fd, METRICS_BACKLOG) < 0) {
+        close(fd);
+        return -errno;
+    }
+    return fd;
+}
+
+static void metrics_unlisten() {
+    registry.listenSrc = sd_event_source_disable_unref(registry.listenSrc);
+    if(registry.listenFd >= 0) {
+        close(registry.listenFd);
+        if(registry.listenAddr[0] == '/') unlink(registry.listenAddr);
+    }
+    registry.listenFd = -1;
+    registry.listenAddr[0] = 0;
+}
+
+/**
+ * @brief Moves endpoint to addr, event loop thread. Clients already
+ *        connected are served, old endpoint stays when new one fails.
+ */
+int metrics_relisten(const char *addr) {
+    int r, fd = -1;
+    sd_event_source *src = NULL;
+
+    if(!strcmp(addr, registry.listenAddr)) return 0;
+    if(addr[0]) {
+        fd = metrics_listen(addr);
+        r = fd < 0 ? fd : sd_event_add_io(loop_event(), &src, fd, EPOLLIN, metrics_accept_cb, NULL);
+        if(r < 0) {
+            logErr("Metrics listen on %s error(%d): %s", addr, r, strerror(-r));
+            if(fd >= 0) close(fd);
+            return r;
+        }
+    }
+    metrics_unlisten();
+    registry.listenFd = fd;
+    registry.listenSrc = src;
+    snprintf(registry.listenAddr, sizeof(registry.listenAddr), "%s", addr);
+    logDbg("Metrics on %s", addr[0] ? addr : "(off)");
+    return 0;
+}
+
+int metrics_init() {
+    int r;
+    const confStruct *c = conf_get();
+
+    r = metrics_relisten(c->metricsListen);
+    conf_put(c);
+    return r;
+}
+
+void metrics_deinit() {
+    metric *m;
+
+    while(registry.clients) metrics_client_free(registry.clients);
+    metrics_unlisten();
+
+    pthread_mutex_lock(&registry.lock);
+    while((m = registry.head)) {
+        registry.head = m->next;
+        free(m->buckets);
+        free(m);
+    }
+    pthread_mutex_unlock(&registry.lock);
+}
@@ -0,0 +1,270 @@
+#define LOG_MODULE  LOG_MOD_SYS
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pool.h"
+#include "loop.h"
+#include "metrics.h"
+#include "debug.h"
+#include "config.h"
+
+#define POOL_STACK_SZ   (512 * 1024)
+
+typedef struct poolJobS {
+    poolJobFunc func;
+    void *pData;
+    int id;
+} poolJob;
+
+typedef struct poolSlotS {
+    pthread_t thread;
+    bool started;               // Joined at resize or deinit once not running
+    bool running;
+} poolSlot;
+
+typedef struct poolS {
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    poolSlot *slots;            // POOL_WORKERS_MAX
+    int workers;                // Slots at and above leave when idle
+    poolJob *queue;
+    int size;
+    int head;
+    int count;
+    int seq;
+    bool stop;
+    metric *depth;
+    metric *rejected;
+} poolStruct;
+
+// Local variables
+static poolStruct pool = {0};
+
+static void* pool_worker(void *pData) {
+    int slot = (intptr_t)pData;
+    poolJob job;
+
+    pthread_mutex_lock(&pool.lock);
+    while(true) {
+        while(!pool.count && !pool.stop && slot < pool.workers)
+            pthread_cond_wait(&pool.notEmpty, &pool.lock);
+        if(pool.stop)
+            break;
+        if(slot >= pool.workers) {
+            // Wakeup was meant for job, pass it on
+            if(pool.count) pthread_cond_signal(&pool.notEmpty);
+            break;
+        }
+
+        job = pool.queue[pool.head];
+        pool.head = (pool.head + 1) % pool.size;
+        pool.count--;
+        metrics_set(pool.depth, pool.count);
+        pthread_cond_signal(&pool.notFull);
+        pthread_mutex_unlock(&pool.lock);
+
+        log_set_job(job.id);
+        job.func(job.pData);
+        log_set_job(0);
+        log_set_chat(0);
+
+        pthread_mutex_lock(&pool.lock);
+    }
+    pool.slots[slot].running = false;
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/**
+ * @brief Starts worker in slot, joining one that left it before.
+ *        Called with pool.lock held.
+ */
+static int pool_start(int slot) {
+    int r;
+    pthread_attr_t attr;
+    poolSlot *s = &pool.slots[slot];
+
+    if(s->running) return 0;
+    if(s->started) pthread_join(s->thread, NULL);
+    s->started = false;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, POOL_STACK_SZ);
+    r = pthread_create(&s->thread, &attr, pool_worker, (void*)(intptr_t)slot);
+    pthread_attr_destroy(&attr);
+    if(r != 0) {
+        logErr("Pool worker %d creation failed(%d): %s", slot, r, strerror(r));
+        return -r;
+    }
+    s->started = s->running = true;
+    return 0;
+}
+
+/**
+ * @brief Starts fixed set of worker threads fed by bounded job queue
+ */
+int pool_init(int workers, int queueSize) {
+    int r = 0, i;
+    pthread_condattr_t cattr;
+
+    if(workers < 1) workers = 1;
+    if(workers > POOL_WORKERS_MAX) workers = POOL_WORKERS_MAX;
+    if(queueSize < 1) queueSize = 1;
+
+    pool.queue = calloc(queueSize, sizeof(poolJob));
+    pool.slots = calloc(POOL_WORKERS_MAX, sizeof(poolSlot));
+    if(!pool.queue || !pool.slots) {
+        logErr("Pool allocation failed");
+        return -ENOMEM;
+    }
+    pool.size = queueSize;
+    pool.depth = metrics_get(MetricGauge, "executor_pool_queue_depth", "Jobs waiting for worker", NULL);
+    pool.rejected = metrics_get(MetricCounter, "executor_pool_rejected_total", "Jobs rejected on full queue", NULL);
+
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.notEmpty, &cattr);
+    pthread_cond_init(&pool.notFull, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    pthread_mutex_lock(&pool.lock);
+    for(i = 0; i < workers && r == 0; i++) {
+        r = pool_start(i);
+        if(r == 0) pool.workers++;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    logDbg("Pool started %d workers, queue %d", pool.workers, pool.size);
+    return pool.workers ? pool.workers : r;
+}
+
+/**
+ * @brief Changes worker count and queue capacity while jobs run.
+ *        Surplus workers leave once their job is done, queue never
+ *        shrinks below jobs already waiting.
+ */
+int pool_resize(int workers, int queueSize) {
+    int r = 0, i, size;
+    poolJob *queue;
+
+    if(workers < 1) workers = 1;
+    if(workers > POOL_WORKERS_MAX) workers = POOL_WORKERS_MAX;
+    if(queueSize < 1) queueSize = 1;
+
+    pthread_mutex_lock(&pool.lock);
+    if(!pool.slots || pool.stop) {
+        pthread_mutex_unlock(&pool.lock);
+        return -ESHUTDOWN;
+    }
+    size = queueSize > pool.count ? queueSize : pool.count;
+    if(size != pool.size && (queue = calloc(size, sizeof(poolJob)))) {
+        for(i = 0; i < pool.count; i++) {
+            queue[i] = pool.queue[(pool.head + i) % pool.size];
+        }
+        free(pool.queue);
+        pool.queue = queue;
+        pool.head = 0;
+        pool.size = size;
+        pthread_cond_broadcast(&pool.notFull);
+    }
+    if(workers < pool.workers) {
+        pool.workers = workers;
+        pthread_cond_broadcast(&pool.notEmpty);
+    }
+    for(i = 0; i < workers && r == 0; i++) {
+        r = pool_start(i);
+    }
+    pool.workers = i - (r != 0);
+    pthread_mutex_unlock(&pool.lock);
+
+    logInf("Pool resized to %d workers, queue %d", pool.workers, pool.size);
+    return r;
+}
+
+/**
+ * @brief Queues job for execution by pool worker
+ * @return job sequence number (>0) or negative error code:
+ *         -EAGAIN when queue is full (reject policy),
+ *         -ETIMEDOUT when queue stayed full for POOL_TIMEOUT_MS (block policy).
+ *         Event loop thread is never blocked, full queue rejects it.
+ */
+int pool_submit(poolJobFunc func, void *pData) {
+    int r = 0, depth;
+    struct timespec ts;
+
+    if(!func) return -EINVAL;
+
+    pthread_mutex_lock(&pool.lock);
+    if(pool.count == pool.size && !pool.stop) {
+        if(!POOL_BLOCK || loop_on_thread()) {
+            r = -EAGAIN;
+        } else {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec += POOL_TIMEOUT_MS / 1000;
+            ts.tv_nsec += (POOL_TIMEOUT_MS % 1000) * 1000000L;
+            if(ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            while(pool.count == pool.size && !pool.stop && r == 0) {
+                r = -pthread_cond_timedwait(&pool.notFull, &pool.lock, &ts);
+            }
+        }
+    }
+    if(pool.stop) r = -ESHUTDOWN;
+
+    if(r == 0) {
+        if(++pool.seq <= 0) pool.seq = 1;
+        r = pool.seq;
+        pool.queue[(pool.head + pool.count) % pool.size] = (poolJob){ func, pData, r };
+        pool.count++;
+        metrics_set(pool.depth, pool.count);
+        pthread_cond_signal(&pool.notEmpty);
+    }
+    depth = pool.count;
+    pthread_mutex_unlock(&pool.lock);
+
+    if(r < 0) {
+        metrics_add(pool.rejected, 1);
+        logWrn("Job rejected(%d): %s, queue %d/%d", r, strerror(-r), depth, pool.size);
+    }
+    return r;
+}
+
+int pool_depth() {
+    int r;
+    pthread_mutex_lock(&pool.lock);
+    r = pool.count;
+    pthread_mutex_unlock(&pool.lock);
+    return r;
+}
+
+void pool_deinit() {
+    int i;
+
+    if(!pool.slots) return;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = true;
+    if(pool.count) {
+        logWrn("Pool stopped with %d queued jobs", pool.count);
+    }
+    pthread_cond_broadcast(&pool.notEmpty);
+    pthread_cond_broadcast(&pool.notFull);
+    pthread_mutex_unlock(&pool.lock);
+
+    for(i = 0; i < POOL_WORKERS_MAX; i++) {
+        if(pool.slots[i].started) pthread_join(pool.slots[i].thread, NULL);
+    }
+
+    free(pool.slots);
+    free(pool.queue);
+    pool.slots = NULL;
+    pool.queue = NULL;
+}
@@ -0,0 +1,882 @@
+#define LOG_MODULE  LOG_MOD_SYS
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <systemd/sd-event.h>
+
+#include "config.h"
+#include "proc.h"
+#include "conf.h"
+#include "loop.h"
+#include "metrics.h"
+#include "debug.h"
+
+#ifndef P_PIDFD
+#define P_PIDFD     3
+#endif
+#ifndef CGROUP2_SUPER_MAGIC
+#define CGROUP2_SUPER_MAGIC 0x63677270
+#endif
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP   0x200000000ULL
+#endif
+
+#define PROC_READ_SZ    4096
+#define PROC_PATH_SZ    512
+#define CGROUP_ROOT     "/sys/fs/cgroup"
+#define CGROUP_RMDIR_TRIES  50     // 10ms apart, for killed leftovers to go
+
+extern char **environ;
+
+// struct clone_args up to cgroup (kernel 5.7)
+typedef struct procCloneArgsS {
+    uint64_t flags;
+    uint64_t pidfd;
+    uint64_t childTid;
+    uint64_t parentTid;
+    uint64_t exitSignal;
+    uint64_t stack;
+    uint64_t stackSize;
+    uint64_t tls;
+    uint64_t setTid;
+    uint64_t setTidSize;
+    uint64_t cgroup;
+} procCloneArgs;
+
+// What spawn file actions do, for child started by clone3
+typedef struct procChildS {
+    int outFd;                  // stdout and stderr, -1 = outFile
+    const char *outFile;        // NULL = inherited
+    const char *cwd;
+} procChild;
+
+typedef struct procWaitS {
+    struct procWaitS *next;
+    int pidfd;
+    int outFd;                  // Capture pipe read end or -1
+    int cgFd;                   // Job cgroup directory or -1
+    sd_event_source *pidSrc;
+    sd_event_source *outSrc;
+    sd_event_source *timeSrc;   // Wall-clock limit, then kill escalation
+    bool exited;                // Reaped, set under engine lock
+    bool eof;
+    bool term;                  // SIGTERM sent, SIGKILL is next
+    bool arm;                   // Kill escalation timer to be armed
+    const procOptions *opt;
+    procResult *res;
+    uint64_t start;
+    // Completion, waited by submitting thread
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+} procWait;
+
+typedef struct procEngineS {
+    pthread_mutex_t lock;
+    procWait *pending;          // Spawned, not yet watched by loop
+    procWait *active;           // Watched by loop thread
+    bool stop;
+    int cgFd;                   // Delegated cgroup, -1 when rlimits are used
+    atomic_uint cgSeq;
+    metric *spawnUs;
+} procEngine;
+
+// Local variables
+static procEngine engine = { .lock = PTHREAD_MUTEX_INITIALIZER, .cgFd = -1 };
+
+static uint64_t proc_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void proc_unlink(procWait **list, procWait *pw) {
+    for(; *list; list = &(*list)->next) {
+        if(*list == pw) {
+            *list = pw->next;
+            return;
+        }
+    }
+}
+
+static int proc_cg_write(int dirFd, const char *file, const char *fmt, ...) {
+    char buf[64];
+    int fd, n, r = 0;
+    va_list ap;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    fd = openat(dirFd, file, O_WRONLY | O_CLOEXEC);
+    if(fd < 0) return -errno;
+    if(write(fd, buf, n) < 0) r = -errno;
+    close(fd);
+    return r;
+}
+
+/**
+ * @brief Reads "key value" line of cgroup file, or its only value when
+ *        key is NULL
+ * @return value, 0 when missing
+ */
+static uint64_t proc_cg_read(int dirFd, const char *file, const char *key) {
+    char buf[1024], *p;
+    int fd;
+    ssize_t n;
+    size_t len;
+
+    fd = openat(dirFd, file, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return 0;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(n <= 0) return 0;
+    buf[n] = 0;
+
+    if(!key) return strtoull(buf, NULL, 10);
+    len = strlen(key);
+    for(p = buf; p && *p; p = strchr(p, '\n') ? strchr(p, '\n') + 1 : NULL) {
+        if(strncmp(p, key, len) == 0 && p[len] == ' ')
+            return strtoull(p + len + 1, NULL, 10);
+    }
+    return 0;
+}
+
+/**
+ * @brief Takes over cgroup delegated by systemd (Delegate=). Daemon moves
+ *        into "main" leaf, as controllers may only be enabled for
+ *        children of a cgroup without processes.
+ */
+static void proc_cg_init() {
+    char line[PROC_PATH_SZ], path[PROC_PATH_SZ + sizeof(CGROUP_ROOT)] = {0};
+    struct statfs fs;
+    FILE *f;
+    int r;
+
+    if(statfs(CGROUP_ROOT, &fs) < 0 || fs.f_type != CGROUP2_SUPER_MAGIC) {
+        logWrn("No cgroup v2 at %s, jobs limited by rlimits", CGROUP_ROOT);
+        return;
+    }
+    f = fopen("/proc/self/cgroup", "re");
+    if(!f) return;
+    while(fgets(line, sizeof(line), f)) {
+        if(strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = 0;
+            snprintf(path, sizeof(path), "%s%s", CGROUP_ROOT, strcmp(line + 3, "/") ? line + 3 : "");
+            break;
+        }
+    }
+    fclose(f);
+    if(!path[0]) return;
+
+    engine.cgFd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(engine.cgFd < 0) {
+        r = -errno;
+    } else if(mkdirat(engine.cgFd, "main", 0755) < 0 && errno != EEXIST) {
+        r = -errno;
+    } else if((r = proc_cg_write(engine.cgFd, "main/cgroup.procs", "%d", getpid())) == 0) {
+        r = proc_cg_write(engine.cgFd, "cgroup.subtree_control", "+memory");
+    }
+    if(r < 0) {
+        logWrn("Cgroup %s not delegated(%d): %s, jobs limited by rlimits", path, r, strerror(-r));
+        if(engine.cgFd >= 0) close(engine.cgFd);
+        engine.cgFd = -1;
+        return;
+    }
+    if((r = proc_cg_write(engine.cgFd, "cgroup.subtree_control", "+cpu")) < 0)
+        logWrn("Cgroup cpu controller unavailable(%d): %s", r, strerror(-r));
+    logInf("Jobs run in %s", path);
+}
+
+/**
+ * @brief Creates leaf cgroup for one job with configured limits
+ * @return directory fd, -1 when cgroups are not used
+ */
+static int proc_cg_create(char *name, size_t sz) {
+    int fd;
+
+    if(engine.cgFd < 0) return -1;
+    snprintf(name, sz, "job-%u", atomic_fetch_add(&engine.cgSeq, 1) + 1);
+    if(mkdirat(engine.cgFd, name, 0755) < 0 && errno != EEXIST) {
+        logWrn("Cgroup %s create error(%d): %m", name, errno);
+        return -1;
+    }
+    fd = openat(engine.cgFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0) {
+        logWrn("Cgroup %s open error(%d): %m", name, errno);
+        unlinkat(engine.cgFd, name, AT_REMOVEDIR);
+        return -1;
+    }
+    if(JOB_MEMORY_MB)
+        proc_cg_write(fd, "memory.max", "%llu", (unsigned long long)JOB_MEMORY_MB << 20);
+    proc_cg_write(fd, "cpu.weight", "%d", JOB_CPU_WEIGHT);
+    return fd;
+}
+
+/**
+ * @brief Collects cgroup wide usage, kills what job left behind and
+ *        removes its cgroup
+ */
+static void proc_cg_release(int fd, const char *name, procResult *res) {
+    int i;
+    uint64_t v;
+
+    if(res->cgroup) {
+        if((v = proc_cg_read(fd, "memory.peak", NULL))) res->memPeak = v;
+        res->cpuUserUs = proc_cg_read(fd, "cpu.stat", "user_usec");
+        res->cpuSysUs = proc_cg_read(fd, "cpu.stat", "system_usec");
+    }
+    proc_cg_write(fd, "cgroup.kill", "1");
+    close(fd);
+
+    for(i = 0; unlinkat(engine.cgFd, name, AT_REMOVEDIR) < 0; i++) {
+        if(errno != EBUSY || i == CGROUP_RMDIR_TRIES) {
+            logWrn("Cgroup %s remove error(%d): %m", name, errno);
+            break;
+        }
+        usleep(10000);
+    }
+}
+
+/**
+ * @brief Fallback without cgroup, applied right after exec: address space
+ *        limit, and niceness from cpu weight (each step ~1.25x share)
+ */
+static void proc_rlimit(pid_t pid) {
+    int nice = 0, w = 100;
+    struct rlimit rl;
+
+    if(JOB_MEMORY_MB) {
+        rl.rlim_cur = rl.rlim_max = (rlim_t)JOB_MEMORY_MB << 20;
+        if(prlimit(pid, RLIMIT_AS, &rl, NULL) < 0)
+            logWrn("Process %d memory limit error(%d): %m", pid, errno);
+    }
+    while(nice < 19 && w * 4 / 5 >= JOB_CPU_WEIGHT) {
+        w = w * 4 / 5;
+        nice++;
+    }
+    if(nice && setpriority(PRIO_PROCESS, pid, nice) < 0)
+        logWrn("Process %d nice error(%d): %m", pid, errno);
+}
+
+/**
+ * @brief Releases loop resources of wait and wakes its submitter
+ */
+static void proc_complete(procWait *pw, int error) {
+    pthread_mutex_lock(&engine.lock);
+    proc_unlink(&engine.active, pw);
+    pthread_mutex_unlock(&engine.lock);
+
+    pw->pidSrc = sd_event_source_disable_unref(pw->pidSrc);
+    pw->outSrc = sd_event_source_disable_unref(pw->outSrc);
+    pw->timeSrc = sd_event_source_disable_unref(pw->timeSrc);
+    if(pw->outFd >= 0) close(pw->outFd);
+    close(pw->pidfd);
+    pw->outFd = -1;
+
+    if(error) pw->res->error = error;
+
+    pthread_mutex_lock(&pw->lock);
+    pw->done = true;
+    pthread_cond_signal(&pw->cond);
+    pthread_mutex_unlock(&pw->lock);
+}
+
+static void proc_check_done(procWait *pw) {
+    if(pw->exited && (pw->outFd < 0 || pw->eof))
+        proc_complete(pw, 0);
+}
+
+static int proc_exit_cb(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+    procWait *pw = userdata;
+    siginfo_t si = {0};
+    struct rusage ru = {0};
+
+    int r;
+
+    // Raw syscall also returns usage of process and its waited children.
+    // Reaped under lock, so proc_kill never signals a recycled pid.
+    pthread_mutex_lock(&engine.lock);
+    r = syscall(SYS_waitid, P_PIDFD, pw->pidfd, &si, WEXITED | WNOHANG, &ru);
+    if(r == 0 && si.si_pid) pw->exited = true;
+    pthread_mutex_unlock(&engine.lock);
+    if(r < 0) {
+        logErr("Wait %d error(%d): %m", pw->res->pid, errno);
+        proc_complete(pw, errno);
+        return 0;
+    }
+    if(si.si_pid == 0) return 0;    // Spurious wakeup
+
+    pw->res->runUs = proc_now() - pw->start;
+    pw->res->cpuUserUs = ru.ru_utime.tv_sec * 1000000ULL + ru.ru_utime.tv_usec;
+    pw->res->cpuSysUs = ru.ru_stime.tv_sec * 1000000ULL + ru.ru_stime.tv_usec;
+    pw->res->memPeak = (uint64_t)ru.ru_maxrss << 10;
+    switch(si.si_code) {
+        case CLD_EXITED:
+            pw->res->code = si.si_status;
+            break;
+        case CLD_DUMPED:
+            pw->res->core = true;
+            // fall through
+        case CLD_KILLED:
+            pw->res->signal = si.si_status;
+            pw->res->code = 128 + si.si_status;
+            break;
+        default:
+            return 0;
+    }
+    logDbg("Process %d finished, code=%d signal=%d, %lu us", pw->res->pid
+        , pw->res->code, pw->res->signal, pw->res->runUs);
+
+    pw->pidSrc = sd_event_source_disable_unref(pw->pidSrc);
+    proc_check_done(pw);
+    return 0;
+}
+
+/**
+ * @brief Appends chunk to output ring and spill file
+ */
+static void proc_output_put(procOutput *out, const char *buf, size_t n) {
+    size_t pos, part;
+
+    if(out->spillFd >= 0 && write(out->spillFd, buf, n) < 0) {
+        logWrn("Output spill error(%d): %m", errno);
+        close(out->spillFd);
+        out->spillFd = -1;
+    }
+    if(n > out->ringSz) {
+        out->bytes += n - out->ringSz;
+        buf += n - out->ringSz;
+        n = out->ringSz;
+    }
+    pos = out->bytes % out->ringSz;
+    part = out->ringSz - pos < n ? out->ringSz - pos : n;
+    memcpy(out->ring + pos, buf, part);
+    memcpy(out->ring, buf + part, n - part);
+    out->bytes += n;
+}
+
+static void proc_output_progress(procOutput *out) {
+    uint64_t now;
+
+    if(out->progress) {
+        now = proc_now();
+        if(now - out->lastProgress >= out->progressUs) {
+            out->lastProgress = now;
+            out->progress(out, out->userdata);
+        }
+    }
+}
+
+/**
+ * @brief Feeds output produced outside of proc_run (other backends)
+ */
+void proc_output_write(procOutput *out, const char *buf, size_t n) {
+    proc_output_put(out, buf, n);
+    proc_output_progress(out);
+}
+
+static int proc_output_cb(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+    procWait *pw = userdata;
+    procOutput *out = pw->opt->output;
+    char buf[PROC_READ_SZ];
+    ssize_t n;
+
+    while((n = read(fd, buf, PROC_READ_SZ)) > 0) {
+        pw->res->bytes += n;
+        proc_output_put(out, buf, n);
+    }
+    proc_output_progress(out);
+
+    if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        pw->eof = true;
+        pw->outSrc = sd_event_source_disable_unref(pw->outSrc);
+        proc_check_done(pw);
+    }
+    return 0;
+}
+
+/**
+ * @brief Prepares output stream: ring keeps last ringSz bytes for reports,
+ *        spill file (when given) receives whole output
+ */
+int proc_output_init(procOutput *out, size_t ringSz, const char *spill) {
+    memset(out, 0, sizeof(procOutput));
+    out->spillFd = -1;
+    out->ring = malloc(ringSz);
+    if(!out->ring) return -ENOMEM;
+    out->ringSz = ringSz;
+    if(spill) {
+        out->spillFd = open(spill, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664);
+        if(out->spillFd < 0) {
+            logWrn("Output spill %s open error(%d): %m", spill, errno);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Copies latest output into buf, starting from line boundary when
+ *        older output was cut off
+ * @return copied length, buf is NUL terminated
+ */
+size_t proc_output_tail(const procOutput *out, char *buf, size_t sz) {
+    size_t n, start, part, i;
+
+    if(!sz) return 0;
+    n = out->bytes < out->ringSz ? out->bytes : out->ringSz;
+    if(n > sz - 1) n = sz - 1;
+    start = (out->bytes - n) % out->ringSz;
+    part = out->ringSz - start < n ? out->ringSz - start : n;
+    memcpy(buf, out->ring + start, part);
+    memcpy(buf + part, out->ring, n - part);
+    buf[n] = 0;
+
+    if(n < out->bytes) {
+        for(i = 0; i < n && buf[i] != '\n'; i++);
+        if(i < n) {
+            memmove(buf, buf + i + 1, n - i);
+            n -= i + 1;
+        }
+    }
+    return n;
+}
+
+void proc_output_free(procOutput *out) {
+    if(out->spillFd >= 0) close(out->spillFd);
+    free(out->ring);
+    out->ring = NULL;
+    out->spillFd = -1;
+}
+
+/**
+ * @brief Wall-clock limit of job in seconds
+ */
+unsigned proc_timeout(const procOptions *opt) {
+    unsigned t;
+    const confStruct *c;
+
+    if(opt && opt->timeoutS) return opt->timeoutS;
+    c = conf_get();
+    t = c->jobTimeoutS;
+    conf_put(c);
+    return t;
+}
+
+/**
+ * @brief Wall-clock limit: SIGTERM to process group, SIGKILL to whole
+ *        cgroup (or group) after grace, then stops waiting for output
+ *        held open by leftovers
+ */
+static int proc_timeout_cb(sd_event_source *s, uint64_t usec, void *userdata) {
+    procWait *pw = userdata;
+    pid_t pid = pw->res->pid;
+
+    if(pw->exited) {
+        logWrn("Process %d exited, output still open, dropping it", pid);
+        if(pw->cgFd >= 0) proc_cg_write(pw->cgFd, "cgroup.kill", "1");
+        pw->eof = true;
+        pw->outSrc = sd_event_source_disable_unref(pw->outSrc);
+        proc_check_done(pw);
+        return 0;
+    }
+
+    if(!pw->term) {
+        logWrn("Process %d timed out after %us, terminating", pid, proc_timeout(pw->opt));
+        pw->res->timedOut = true;
+        pw->term = true;
+        kill(-pid, SIGTERM);
+    } else {
+        logWrn("Process %d ignored SIGTERM for %ds, killing", pid, JOB_KILL_GRACE_S);
+        if(pw->cgFd >= 0) proc_cg_write(pw->cgFd, "cgroup.kill", "1");
+        kill(-pid, SIGKILL);
+    }
+    sd_event_source_set_time(s, usec + JOB_KILL_GRACE_S * 1000000ULL);
+    sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
+    return 0;
+}
+
+/**
+ * @brief Registers processes spawned by worker threads in event loop
+ */
+static void proc_wake(void *userdata) {
+    int r;
+    procWait *pw, *next, *old;
+
+    // Whole pending list joins active at once, so proc_kill sees it
+    pthread_mutex_lock(&engine.lock);
+    pw = engine.pending;
+    old = engine.active;
+    if(pw) {
+        for(next = pw; next->next; next = next->next);
+        next->next = engine.active;
+        engine.active = pw;
+        engine.pending = NULL;
+    }
+    pthread_mutex_unlock(&engine.lock);
+
+    // Woken only to arm kill escalation when nothing was pending
+    for(; pw && pw != old; pw = next) {
+        next = pw->next;
+        r = sd_event_add_io(loop_event(), &pw->pidSrc, pw->pidfd, EPOLLIN, proc_exit_cb, pw);
+        if(r >= 0 && pw->outFd >= 0)
+            r = sd_event_add_io(loop_event(), &pw->outSrc, pw->outFd, EPOLLIN, proc_output_cb, pw);
+        if(r >= 0 && proc_timeout(pw->opt))
+            r = sd_event_add_time_relative(loop_event(), &pw->timeSrc, CLOCK_MONOTONIC
+                    , proc_timeout(pw->opt) * 1000000ULL, 1000000, proc_timeout_cb, pw);
+        if(r < 0) {
+            logErr("Process %d watch error(%d): %s", pw->res->pid, r, strerror(-r));
+            proc_complete(pw, -r);
+        }
+    }
+
+    // Kill escalation for processes terminated by proc_kill
+    pthread_mutex_lock(&engine.lock);
+    for(pw = engine.active; pw; pw = pw->next) {
+        if(!pw->arm) continue;
+        pw->arm = false;
+        if(pw->timeSrc) {
+            sd_event_source_set_time(pw->timeSrc, proc_now() + JOB_KILL_GRACE_S * 1000000ULL);
+            sd_event_source_set_enabled(pw->timeSrc, SD_EVENT_ONESHOT);
+        } else {
+            sd_event_add_time_relative(loop_event(), &pw->timeSrc, CLOCK_MONOTONIC
+                , JOB_KILL_GRACE_S * 1000000ULL, 1000000, proc_timeout_cb, pw);
+        }
+    }
+    pthread_mutex_unlock(&engine.lock);
+}
+
+/**
+ * @brief Terminates process spawned by proc_run and its group, SIGKILL
+ *        follows after JOB_KILL_GRACE_S. Safe from any thread.
+ * @return 0, -ESRCH when process is not running
+ */
+int proc_kill(pid_t pid) {
+    int r = -ESRCH;
+    procWait *pw = NULL, *lists[2];
+    int i;
+
+    pthread_mutex_lock(&engine.lock);
+    lists[0] = engine.pending;
+    lists[1] = engine.active;
+    for(i = 0; i < 2 && !pw; i++) {
+        for(pw = lists[i]; pw && (pw->res->pid != pid || pw->exited); pw = pw->next);
+    }
+    if(pw) {
+        r = 0;
+        if(!pw->term) {
+            logInf("Process %d cancelled, terminating", pid);
+            pw->term = true;
+            pw->arm = true;
+            pw->res->cancelled = true;
+            kill(-pid, SIGTERM);
+        }
+    }
+    pthread_mutex_unlock(&engine.lock);
+    if(r == 0) loop_call(proc_wake, NULL, NULL);
+    return r;
+}
+
+int proc_init() {
+    engine.spawnUs = metrics_get(MetricHistogram, "executor_spawn_seconds", "Process start latency", "backend=\"exec\"");
+
+    proc_cg_init();
+    return 0;
+}
+
+#ifndef POSIX_SPAWN_SETCGROUP
+/**
+ * @brief Forks child directly into cgroup with clone3(CLONE_INTO_CGROUP)
+ *        and sets it up like posix_spawn would. Only async-signal-safe
+ *        calls in child, exec error comes back over close-on-exec pipe.
+ * @return 0 or negative errno
+ */
+static int proc_clone_cg(pid_t *pid, char *const argv[], const procChild *ch, int cgFd) {
+    int e = 0, fd, errPipe[2];
+    long p;
+    ssize_t n;
+    sigset_t mask;
+    struct sigaction sa = { .sa_handler = SIG_DFL };
+    procCloneArgs ca = { .flags = CLONE_INTO_CGROUP, .exitSignal = SIGCHLD, .cgroup = cgFd };
+
+    if(pipe2(errPipe, O_CLOEXEC) < 0) return -errno;
+    p = syscall(SYS_clone3, &ca, sizeof(ca));
+    if(p == 0) {
+        setsid();
+        sigaction(SIGPIPE, &sa, NULL);
+        if((fd = open("/dev/null", O_RDONLY)) < 0 || dup2(fd, STDIN_FILENO) < 0) goto fail;
+        if(fd > STDERR_FILENO) close(fd);
+        if(ch->outFd < 0 && ch->outFile) {
+            fd = open(ch->outFile, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+            if(fd < 0) goto fail;
+        } else {
+            fd = ch->outFd;
+        }
+        if(fd >= 0 && (dup2(fd, STDOUT_FILENO) < 0 || dup2(fd, STDERR_FILENO) < 0)) goto fail;
+        if(fd > STDERR_FILENO) close(fd);  // Only std descriptors reach the job
+        if(ch->cwd && chdir(ch->cwd) < 0) goto fail;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        execve(argv[0], argv, environ);
+fail:
+        e = errno;
+        n = write(errPipe[1], &e, sizeof(e));
+        _exit(127);
+    }
+    if(p < 0) e = errno;
+    close(errPipe[1]);
+    if(p > 0) {
+        while((n = read(errPipe[0], &e, sizeof(e))) < 0 && errno == EINTR);
+        if(n == sizeof(e)) waitpid(p, NULL, 0);
+        else e = 0;
+    }
+    close(errPipe[0]);
+    if(e) return -e;
+    *pid = p;
+    return 0;
+}
+#endif
+
+/**
+ * @brief Starts child already inside job cgroup, so nothing it forks can
+ *        escape limits: by posix_spawn where libc supports cgroups, else
+ *        by clone3. Moving it after start is left for kernels before 5.7.
+ * @return 0 or negative errno
+ */
+static int proc_spawn(procResult *res, char *const argv[], const posix_spawn_file_actions_t *fa
+        , const posix_spawnattr_t *attr, const procChild *ch, int cgFd) {
+    int r;
+
+#ifdef POSIX_SPAWN_SETCGROUP
+    r = -posix_spawn(&res->pid, argv[0], fa, attr, argv, environ);
+    if(r == 0 && cgFd >= 0) res->cgroup = true;
+    return r;
+#else
+    if(cgFd >= 0) {
+        r = proc_clone_cg(&res->pid, argv, ch, cgFd);
+        if(r == 0) res->cgroup = true;
+        if(r != -ENOSYS && r != -E2BIG) return r;
+    }
+    r = -posix_spawn(&res->pid, argv[0], fa, attr, argv, environ);
+    if(r < 0 || cgFd < 0) return r;
+    // Children forked before the move stay outside
+    if((r = proc_cg_write(cgFd, "cgroup.procs", "%d", res->pid)) == 0) res->cgroup = true;
+    else logWrn("Process %d cgroup move error(%d): %s", res->pid, r, strerror(-r));
+    return 0;
+#endif
+}
+
+/**
+ * @brief Spawns argv[0] (no shell) and blocks calling thread until it
+ *        exits. Exit is observed through pidfd by event loop, so the
+ *        process is always reaped and no SIGCHLD handling is involved.
+ *        Must not be called from event loop thread.
+ * @return 0 when process ran (see res->code / res->signal),
+ *         negative errno when it could not be spawned
+ */
+int proc_run(char *const argv[], const procOptions *opt, procResult *res) {
+    int r, fd = -1, cgFd = -1, pipeFd[2] = { -1, -1 };
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSID;
+    procChild ch = { .outFd = -1, .outFile = opt ? opt->outFile : NULL, .cwd = opt ? opt->cwd : NULL };
+    char cgName[32], status[64], use[64];
+    uint64_t t0;
+    sigset_t mask;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t fa;
+    procWait *pw;
+    static const procOptions noOpt = {0};
+
+    if(!opt) opt = &noOpt;
+    memset(res, 0, sizeof(procResult));
+    if(engine.stop) return res->error = ESHUTDOWN, -ESHUTDOWN;
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawnattr_init(&attr);
+
+    // Children start with clean signal state, daemon blocks some signals
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if(opt->output && opt->output->ring) {
+        if(pipe2(pipeFd, O_CLOEXEC) < 0) {
+            r = -errno;
+            goto out;
+        }
+        fcntl(pipeFd[0], F_SETFL, O_NONBLOCK);
+        posix_spawn_file_actions_adddup2(&fa, pipeFd[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&fa, pipeFd[1], STDERR_FILENO);
+        ch.outFd = pipeFd[1];
+    } else if(opt->outFile) {
+        posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, opt->outFile, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+        posix_spawn_file_actions_adddup2(&fa, STDOUT_FILENO, STDERR_FILENO);
+    }
+    if(opt->cwd)
+        posix_spawn_file_actions_addchdir_np(&fa, opt->cwd);
+
+    cgFd = proc_cg_create(cgName, sizeof(cgName));
+#ifdef POSIX_SPAWN_SETCGROUP
+    if(cgFd >= 0) {
+        posix_spawnattr_setcgroup_np(&attr, cgFd);
+        flags |= POSIX_SPAWN_SETCGROUP;
+    }
+#endif
+    posix_spawnattr_setflags(&attr, flags);
+
+    t0 = proc_now();
+    r = proc_spawn(res, argv, &fa, &attr, &ch, cgFd);
+    res->spawnUs = proc_now() - t0;
+    if(r < 0) goto out;
+    metrics_observe(engine.spawnUs, res->spawnUs);
+    if(!res->cgroup) proc_rlimit(res->pid);
+
+    fd = syscall(SYS_pidfd_open, res->pid, 0);
+    if(fd < 0) {
+        // Cannot watch it, reap synchronously rather than leak zombie
+        int st;
+        r = -errno;
+        logErr("pidfd_open(%d) error(%d): %m", res->pid, errno);
+        waitpid(res->pid, &st, 0);
+        res->code = WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+        res->signal = WIFSIGNALED(st) ? WTERMSIG(st) : 0;
+        r = 0;
+        goto out;
+    }
+
+    logDbg("Spawned %s pid=%d in %lu us", argv[0], res->pid, res->spawnUs);
+
+    pw = calloc(1, sizeof(procWait));
+    pw->pidfd = fd;
+    pw->outFd = pipeFd[0];
+    pw->cgFd = cgFd;
+    pw->opt = opt;
+    pw->res = res;
+    pw->start = t0;
+    pthread_mutex_init(&pw->lock, NULL);
+    pthread_cond_init(&pw->cond, NULL);
+    pipeFd[0] = -1;
+    if(pipeFd[1] >= 0) {
+        close(pipeFd[1]);
+        pipeFd[1] = -1;
+    }
+
+    pthread_mutex_lock(&engine.lock);
+    if(engine.stop) {
+        pthread_mutex_unlock(&engine.lock);
+        close(pw->pidfd);
+        if(pw->outFd >= 0) close(pw->outFd);
+        pw->done = true;
+        res->error = ECANCELED;
+    } else {
+        pw->next = engine.pending;
+        engine.pending = pw;
+        pthread_mutex_unlock(&engine.lock);
+        loop_call(proc_wake, NULL, NULL);
+        if(opt->spawned) opt->spawned(res->pid, true, opt->userdata);
+    }
+
+    pthread_mutex_lock(&pw->lock);
+    while(!pw->done)
+        pthread_cond_wait(&pw->cond, &pw->lock);
+    pthread_mutex_unlock(&pw->lock);
+    if(opt->spawned && res->error != ECANCELED) opt->spawned(res->pid, false, opt->userdata);
+
+    pthread_mutex_destroy(&pw->lock);
+    pthread_cond_destroy(&pw->cond);
+    free(pw);
+    r = res->error ? -res->error : 0;
+    if(!r) logInf("Process %d %s: %s", res->pid, proc_status(res, status, sizeof(status)), proc_usage(res, use, sizeof(use)));
+
+out:
+    if(cgFd >= 0) {
+        // On shutdown job keeps running in its cgroup
+        if(res->error == ECANCELED) close(cgFd);
+        else proc_cg_release(cgFd, cgName, res);
+    }
+    if(pipeFd[0] >= 0) close(pipeFd[0]);
+    if(pipeFd[1] >= 0) close(pipeFd[1]);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    if(r < 0 && !res->error) res->error = -r;
+    return r;
+}
+
+static const char *proc_reason(const procResult *res) {
+    return res->cancelled ? "cancelled, " : res->timedOut ? "timeout, " : "";
+}
+
+/**
+ * @brief Human readable termination: "exit 0", "signal 9 (Killed)"
+ */
+const char *proc_status(const procResult *res, char *buf, size_t sz) {
+    if(res->error) {
+        snprintf(buf, sz, "error %d (%s)", res->error, strerror(res->error));
+    } else if(res->signal) {
+        snprintf(buf, sz, "%ssignal %d (%s)%s", proc_reason(res), res->signal
+            , strsignal(res->signal), res->core ? ", core dumped" : "");
+    } else {
+        snprintf(buf, sz, "%sexit %d", proc_reason(res), res->code);
+    }
+    return buf;
+}
+
+/**
+ * @brief Resource usage: "12.5s, cpu 3.2s, 120 MiB"
+ */
+const char *proc_usage(const procResult *res, char *buf, size_t sz) {
+    snprintf(buf, sz, "%.1fs, cpu %.1fs, %lu MiB", res->runUs / 1e6
+        , (res->cpuUserUs + res->cpuSysUs) / 1e6, (unsigned long)(res->memPeak >> 20));
+    return buf;
+}
+
+/**
+ * @brief Stops watching: waiting threads are released with ECANCELED,
+ *        children keep running (service uses KillMode=process)
+ */
+void proc_deinit() {
+    procWait *pw;
+
+    pthread_mutex_lock(&engine.lock);
+    engine.stop = true;
+    pw = engine.pending;
+    engine.pending = NULL;
+    pthread_mutex_unlock(&engine.lock);
+
+    // Move unwatched ones to active list, so both are completed alike
+    while(pw) {
+        procWait *next = pw->next;
+        pthread_mutex_lock(&engine.lock);
+        pw->next = engine.active;
+        engine.active = pw;
+        pthread_mutex_unlock(&engine.lock);
+        pw = next;
+    }
+    while(true) {
+        pthread_mutex_lock(&engine.lock);
+        pw = engine.active;
+        pthread_mutex_unlock(&engine.lock);
+        if(!pw) break;
+        proc_complete(pw, ECANCELED);
+    }
+
+    if(engine.cgFd >= 0) close(engine.cgFd);
+    engine.cgFd = -1;
+}
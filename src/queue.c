@@ -0,0 +1,247 @@
+#define LOG_MODULE  LOG_MOD_STORAGE
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "main.h"
+#include "job.h"
+#include "metrics.h"
+#include "storage.h"
+#include "sys.h"
+#include "queue.h"
+#include "debug.h"
+
+#define QUEUE_BATCH_MAX     32
+#define QUEUE_ORDERS_MAX    256
+
+// adm_cmd.cmd values
+enum {
+    QueueRun = 1,               // obj: command name
+    QueueTail,                  // obj: line count
+    QueuePull,
+    QueueExport,                // obj: comma separated order ids
+    QueueClear                  // obj: comma separated order ids
+};
+
+// Command claimed by this node
+typedef struct queueItemS {
+    int id;
+    uint64_t jobId;             // 0 while not started
+    uint64_t leaseEnd;          // us, CLOCK_MONOTONIC, as known locally
+} queueItem;
+
+typedef struct queueS {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+    bool started;
+    char node[64];              // host:pid, lease owner
+    queueItem items[QUEUE_BATCH_MAX];
+    int count;
+    metric *claimed;
+    metric *lost;
+} queueStruct;
+
+// Local variables
+static queueStruct queue = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static uint64_t queue_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int queue_orders(const char *obj, uint32_t *orders) {
+    int n = 0;
+    char *end;
+    unsigned long v;
+
+    while(*obj && n < QUEUE_ORDERS_MAX) {
+        v = strtoul(obj, &end, 10);
+        if(end == obj) {
+            obj++;
+            continue;
+        }
+        if(v) orders[n++] = v;
+        obj = end;
+    }
+    return n;
+}
+
+/**
+ * @brief Starts claimed command as local job
+ * @return job id, 0 when it was rejected
+ */
+static uint64_t queue_dispatch(const adminCommand *c) {
+    uint32_t orders[QUEUE_ORDERS_MAX];
+    int n;
+
+    switch(c->cmd) {
+    case QueueRun:
+        return sys_run_command(c->obj, QUEUE_CHAT);
+    case QueueTail:
+        return sys_tail(atoi(c->obj), QUEUE_CHAT);
+    case QueuePull:
+        return sys_pull(QUEUE_CHAT);
+    case QueueExport:
+    case QueueClear:
+        n = queue_orders(c->obj, orders);
+        if(!n) return 0;
+        return c->cmd == QueueExport ? sys_export(QUEUE_CHAT, orders, n) : sys_clear(QUEUE_CHAT, orders, n);
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Finished jobs are recorded, leases of running ones renewed.
+ *        Job whose lease could not be kept is cancelled: another node may
+ *        already run it.
+ */
+static void queue_check(uint64_t now, bool renew) {
+    int i, r, code;
+    jobInfo info;
+    queueItem *it;
+
+    for(i = 0; i < queue.count; i++) {
+        it = &queue.items[i];
+        r = job_get(it->jobId, &info);
+        if(r < 0 || info.state >= JobDone) {
+            code = r < 0 ? r : info.state == JobCancelled && !info.code ? -ECANCELED : info.code;
+            r = storage_finish(queue.node, it->id, code);
+            if(r == 0) {
+                logWrn("Command %d finished after its lease was taken over", it->id);
+                metrics_add(queue.lost, 1);
+            }
+            if(r < 0 && now < it->leaseEnd) continue;  // Retried next tick
+            if(r < 0) logErr("Command %d result lost, lease expires", it->id);
+            else logDbg("Command %d done (%d)", it->id, code);
+            queue.items[i--] = queue.items[--queue.count];
+            continue;
+        }
+        if(!renew) continue;
+        r = storage_renew(queue.node, it->id, QUEUE_LEASE_S);
+        if(r > 0) {
+            it->leaseEnd = now + QUEUE_LEASE_S * 1000000ULL;
+        } else if(r == 0 || now + QUEUE_POLL_MS * 2000ULL >= it->leaseEnd) {
+            logErr("Command %d lease lost, job %lu cancelled", it->id, it->jobId);
+            metrics_add(queue.lost, 1);
+            job_cancel(it->jobId);
+            queue.items[i--] = queue.items[--queue.count];
+        }
+    }
+}
+
+static void queue_claim(uint64_t now) {
+    adminCommand cmds[QUEUE_BATCH_MAX];
+    int n, i, r, slots = QUEUE_BATCH - queue.count;
+    uint64_t id;
+
+    if(slots <= 0) return;
+    memset(cmds, 0, sizeof(cmds));
+    n = storage_claim(queue.node, QUEUE_LEASE_S, cmds, slots);
+    if(n <= 0) return;
+    logInf("Claimed %d commands", n);
+    metrics_add(queue.claimed, n);
+
+    for(i = 0; i < n; i++) {
+        id = queue_dispatch(&cmds[i]);
+        if(!id) {
+            // Unknown command is done with, rejected one goes back to queue
+            r = cmds[i].cmd >= QueueRun && cmds[i].cmd <= QueueClear ? -EAGAIN : -EINVAL;
+            logWrn("Command %d (cmd %d, %s) %s", cmds[i].id, cmds[i].cmd, cmds[i].obj
+                , r == -EAGAIN ? "rejected, released" : "unknown");
+            storage_finish(queue.node, cmds[i].id, r);
+        } else {
+            logDbg("Command %d (cmd %d, %s) is job %lu", cmds[i].id, cmds[i].cmd, cmds[i].obj, id);
+            queue.items[queue.count++] = (queueItem){
+                .id = cmds[i].id,
+                .jobId = id,
+                .leaseEnd = now + QUEUE_LEASE_S * 1000000ULL
+            };
+        }
+        free(cmds[i].obj);
+    }
+}
+
+static void *queue_thread(void *arg) {
+    struct timespec ts;
+    uint64_t now, renewed = 0;
+
+    while(1) {
+        now = queue_now();
+        // Lease is renewed three times per period, one failed renewal is survived
+        queue_check(now, now - renewed >= QUEUE_LEASE_S * 1000000ULL / 3);
+        if(now - renewed >= QUEUE_LEASE_S * 1000000ULL / 3) renewed = now;
+        queue_claim(now);
+
+        pthread_mutex_lock(&queue.lock);
+        if(queue.stop) {
+            pthread_mutex_unlock(&queue.lock);
+            break;
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += QUEUE_POLL_MS / 1000;
+        ts.tv_nsec += (QUEUE_POLL_MS % 1000) * 1000000L;
+        if(ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        if(!queue.stop) pthread_cond_timedwait(&queue.cond, &queue.lock, &ts);
+        pthread_mutex_unlock(&queue.lock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts taking commands from adm_cmd, shared with other nodes
+ */
+int queue_init() {
+    int r;
+    char host[48];
+
+    if(QUEUE_BATCH <= 0) return 0;
+    if(gethostname(host, sizeof(host)) < 0) strcpy(host, "localhost");
+    host[sizeof(host) - 1] = 0;
+    snprintf(queue.node, sizeof(queue.node), "%s:%d", host, getpid());
+
+    r = storage_queue_prepare();
+    if(r < 0) {
+        logErr("Queue table prepare error(%d)", r);
+        return r;
+    }
+    queue.claimed = metrics_get(MetricCounter, "executor_queue_claimed_total", "Commands claimed from shared queue", NULL);
+    queue.lost = metrics_get(MetricCounter, "executor_queue_lease_lost_total", "Commands whose lease was lost", NULL);
+
+    r = pthread_create(&queue.thread, NULL, queue_thread, NULL);
+    if(r != 0) {
+        logErr("Queue thread error(%d): %s", r, strerror(r));
+        return -r;
+    }
+    queue.started = true;
+    logInf("Queue node %s, batch %d, lease %ds", queue.node, QUEUE_BATCH, QUEUE_LEASE_S);
+    return 0;
+}
+
+/**
+ * @brief Stops claiming. Commands still running keep their rows, leases
+ *        expire and another node runs them again.
+ */
+void queue_deinit() {
+    if(!queue.started) return;
+    pthread_mutex_lock(&queue.lock);
+    queue.stop = true;
+    pthread_cond_signal(&queue.cond);
+    pthread_mutex_unlock(&queue.lock);
+    pthread_join(queue.thread, NULL);
+    queue.started = false;
+    if(queue.count) logWrn("%d claimed commands left to lease expiry", queue.count);
+}
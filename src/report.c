@@ -1,207 +1,871 @@
+#define LOG_MODULE  LOG_MOD_REPORT
 #include <curl/curl.h>
 #include <jansson.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "report.h"
+#include "metrics.h"
+#include "spool.h"
+#include "conf.h"
 #include "debug.h"
 #include "config.h"
 
-#define URL_SIZE    256
+#define URL_SIZE    512
 #define PATH_SIZE   512
-#define BUF_SIZE    2560
+#define BUF_SIZE    2560        // Reply buffer to start with
+#define BUF_MAX     (256 * 1024) // Reply is cut above, transfer goes on
+#define MSG_SIZE    4096        // Telegram message text limit
 #define API_URL     "https://api.telegram.org/bot"
 
+#define SENDER_CONNECTIONS  4       // Warm connections kept to API host
+#define SENDER_POLL_MS      1000
+#define SENDER_TIMEOUT_S    60
+#define SENDER_RETRIES      5
+#define SENDER_SPOOL_RETRIES 1500   // ~1 day at SENDER_BACKOFF_MAX
+#define SENDER_BACKOFF_MS   1000
+#define SENDER_BACKOFF_MAX  60000
+#define CHAT_HASH_SZ        64
+#define RESULT_METRICS_MAX  32      // Distinct curl code and http pairs cached
+
 typedef enum ReportModeE {
     Markdown,
     MarkdownV2,
     Html,
-    Document
+    Plain,
+    Document,
+    TempDocument            // File is removed once report is final
 } ReportMode;
 
+#define REPORT_DOC(m)   ((m) >= Document)
+
 typedef struct ResponseDataS {
     uint32_t cnt;
     size_t size;
-    char buf[BUF_SIZE];
+    size_t cap;
+    char *buf;
 } ResponseData;
 
+// Message kept up to date with editMessageText
+struct ReportLiveS {
+    pthread_mutex_t lock;
+    atomic_int refs;
+    char text[MSG_SIZE + 1];    // Latest text, under lock
+    ReportMode mode;
+    uint32_t chatId;
+    uint32_t responseTo;
+    uint32_t messageId;         // Sender thread only
+    uint64_t lastEdit;          // Sender thread only, ms
+};
+
 typedef struct ReportDataS {
-    char msg[BUF_SIZE];
+    struct ReportDataS *next;
+    char msg[MSG_SIZE + 1];
     char doc[PATH_SIZE];
     ReportMode mode;
     uint32_t chatId;
     uint32_t responseTo;
+    ReportLive *live;           // Creates (or edits when edit) live message
+    bool edit;
+    int64_t spoolId;            // Durable copy, 0 when not spooled
+    // Scheduling state, owned by sender thread
+    uint64_t ready;         // Not sent before, ms
+    int attempts;
+    size_t len;
+    // Transfer state, owned by sender thread
+    CURL *curl;
+    curl_mime *form;
+    struct curl_slist *slist;
+    char *post;
+    ResponseData cd;
 } ReportData;
 
+typedef struct TokenBucketS {
+    double tokens;
+    uint64_t stamp;         // Last refill, ms
+} TokenBucket;
+
+typedef struct ChatStateS {
+    struct ChatStateS *next;
+    uint32_t chatId;
+    TokenBucket bucket;
+    uint64_t blocked;       // Paused by 429 retry_after until, ms
+    bool busy;              // Transfer in flight, keeps chat order
+    ReportData *head;
+    ReportData *tail;
+} ChatState;
+
+// Request counter of one result
+typedef struct ResultMetricS {
+    CURLcode ret;
+    long http;
+    metric *m;
+} ResultMetric;
+
+typedef enum {
+    ApiSend,
+    ApiEdit,
+    ApiDocument,
+    ApiMethods
+} ApiMethod;
+
+typedef struct SenderS {
+    pthread_t thread;
+    CURLM *multi;
+    CURLSH *share;
+    _Atomic(ReportData *) queue;    // Lock-free LIFO of submitted reports
+    atomic_bool stop;
+    bool started;
+    bool spool;                     // Reports are kept in spool until delivered
+    // Owned by sender thread
+    TokenBucket bucket;             // Bot-wide limit
+    ChatState *chats[CHAT_HASH_SZ];
+    metric *seconds[ApiMethods];    // Found on first use
+    ResultMetric results[RESULT_METRICS_MAX];
+    int resultCount;
+} Sender;
+
+// Bot API base, overridden from command line, then by config file
+const char *gApiUrl = API_URL;
+const char *gSpoolPath = TG_SPOOL;
+
+// Local variables
+static Sender sender = {0};
 
 const char *codename(CURLcode code);
 
+/**
+ * @brief Collects API reply. Reply echoes message text, so it grows with
+ *        it; whatever does not fit into BUF_MAX is dropped, not failed,
+ *        as message is already delivered by then.
+ */
 static size_t report_write_chunk (unsigned char *ptr, size_t size, size_t nmemb, void *data) {
     ResponseData *cd = (ResponseData *) (data);
-    size_t ret = 0;
-    size_t got = size * nmemb;
-    if((cd->size + got) < BUF_SIZE) {
-        memcpy(&(cd->buf[cd->size]), ptr, got);
-        cd->cnt++;
-        cd->size += got;
-        logTrc("Chunk: %lu, total: %lu", got, cd->size);
-        ret = got;
+    size_t got = size * nmemb, cap = cd->cap ? cd->cap : BUF_SIZE, n;
+    char *buf;
+
+    while(cap < cd->size + got + 1 && cap < BUF_MAX) cap *= 2;
+    if(cap > BUF_MAX) cap = BUF_MAX;
+    if(cap != cd->cap && (buf = realloc(cd->buf, cap))) {
+        cd->buf = buf;
+        cd->cap = cap;
     }
-    return ret;
+    n = cd->cap > cd->size + 1 ? cd->cap - cd->size - 1 : 0;
+    if(n > got) n = got;
+    if(n < got && cd->size + 1 < cd->cap) logWrn("Reply over %d bytes, cut", BUF_MAX);
+    if(n) memcpy(&(cd->buf[cd->size]), ptr, n);
+    cd->cnt++;
+    cd->size += n;
+    logTrc("Chunk: %lu, total: %lu", got, cd->size);
+    return got;
 }
 
-static void * report_query (void *ptr) {
-    CURL *curl;
-    CURLM *multi_handle;
-    curl_mime *form = NULL;
-    curl_mimepart *field = NULL;
-    int still_running = 0;
+static uint64_t report_now () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void report_reset (ReportData *rd) {
+    if(rd->curl) {
+        curl_multi_remove_handle(sender.multi, rd->curl);
+        curl_easy_cleanup(rd->curl);
+    }
+    curl_mime_free(rd->form);
+    curl_slist_free_all(rd->slist);
+    free(rd->post);
+    rd->curl = NULL;
+    rd->form = NULL;
+    rd->slist = NULL;
+    rd->post = NULL;
+    free(rd->cd.buf);
+    memset(&rd->cd, 0, sizeof(ResponseData));
+}
+
+static void live_release (ReportLive *live) {
+    if(live && atomic_fetch_sub(&live->refs, 1) == 1) {
+        pthread_mutex_destroy(&live->lock);
+        free(live);
+    }
+}
+
+static void report_free (ReportData *rd) {
+    report_reset(rd);
+    live_release(rd->live);
+    free(rd);
+}
+
+/**
+ * @brief Keeps report in spool until delivered, so it survives outages
+ *        and restarts. Without spool report is kept in memory only.
+ */
+static void report_spool (ReportData *rd, const char *msg, uint32_t responseTo) {
+    int64_t id;
+    spoolEntry e = { rd->chatId, responseTo, rd->edit ? Markdown : rd->mode, msg, rd->doc };
+
+    if(!sender.spool) return;
+    id = spool_append(&e);
+    if(id < 0) logWrn("Report to %u not spooled(%ld): %s", rd->chatId, id, strerror(-id));
+    else rd->spoolId = id;
+}
+
+/**
+ * @brief Report reached final state (delivered or rejected for good)
+ */
+static void report_ack (ReportData *rd) {
+    if(rd->spoolId) spool_ack(rd->spoolId);
+    rd->spoolId = 0;
+    if(rd->mode == TempDocument && unlink(rd->doc) < 0 && errno != ENOENT)
+        logWrn("Report document %s remove error(%d): %s", rd->doc, errno, strerror(errno));
+}
+
+/**
+ * @brief Round-trip histogram of method. Sender thread only.
+ */
+static metric *report_seconds (ApiMethod method) {
+    static const char *names[ApiMethods] = { "sendMessage", "editMessageText", "sendDocument" };
+
+    if(!sender.seconds[method])
+        sender.seconds[method] = metrics_get(MetricHistogram, "executor_telegram_request_seconds"
+            , "Bot API round-trip", "method=\"%s\"", names[method]);
+    return sender.seconds[method];
+}
+
+/**
+ * @brief Request counter of result, table is filled on first use of
+ *        each pair, unusual ones past it are looked up. Sender thread only.
+ */
+static metric *report_result (CURLcode ret, long http) {
+    int i;
+    metric *m;
+
+    for(i = 0; i < sender.resultCount; i++) {
+        if(sender.results[i].ret == ret && sender.results[i].http == http) return sender.results[i].m;
+    }
+    m = metrics_get(MetricCounter, "executor_telegram_requests_total", "Bot API requests by result"
+        , "code=\"%s\",http=\"%ld\"", codename(ret), http);
+    if(sender.resultCount < RESULT_METRICS_MAX)
+        sender.results[sender.resultCount++] = (ResultMetric){ ret, http, m };
+    return m;
+}
+
+/**
+ * @brief Refills bucket for elapsed time
+ * @return ms until one token is available, 0 if available now
+ */
+static uint64_t bucket_wait (TokenBucket *b, double rate, uint64_t now) {
+    double burst = rate < 1.0 ? 1.0 : rate;
+    if(!b->stamp) b->tokens = burst;
+    b->tokens += (double)(now - b->stamp) * rate / 1000.0;
+    if(b->tokens > burst) b->tokens = burst;
+    b->stamp = now;
+    if(b->tokens >= 1.0) return 0;
+    return (uint64_t)((1.0 - b->tokens) * 1000.0 / rate) + 1;
+}
+
+static ChatState *chat_get (uint32_t chatId) {
+    ChatState **pc = &sender.chats[chatId % CHAT_HASH_SZ];
+    for(; *pc; pc = &(*pc)->next) {
+        if((*pc)->chatId == chatId) return *pc;
+    }
+    *pc = calloc(1, sizeof(ChatState));
+    (*pc)->chatId = chatId;
+    return *pc;
+}
+
+/**
+ * @brief Queues report to its chat. Text following queued text for the
+ *        same chat and reply target is merged into it while it still fits
+ *        into one message, so bursts go out as few messages.
+ */
+static void chat_push (ReportData *rd, uint64_t now) {
+    ChatState *cs = chat_get(rd->chatId);
+    ReportData *tail = cs->tail, *it;
+    const confStruct *c = conf_get();
+    uint64_t coalesce = c->tgCoalesceMs, progress = c->tgProgressMs;
+
+    conf_put(c);
+
+    if(rd->edit) {
+        // Edit sends latest live text when started, one queued is enough
+        for(it = cs->head; it; it = it->next) {
+            if(it->edit && it->live == rd->live) {
+                // Final text is spooled, queued edit delivers it
+                if(rd->spoolId) {
+                    report_ack(it);
+                    it->spoolId = rd->spoolId;
+                }
+                report_free(rd);
+                return;
+            }
+        }
+        rd->next = NULL;
+        rd->ready = now + coalesce;
+        if(rd->live->lastEdit && rd->ready < rd->live->lastEdit + progress)
+            rd->ready = rd->live->lastEdit + progress;
+        if(tail) tail->next = rd;
+        else cs->head = rd;
+        cs->tail = rd;
+        return;
+    }
+
+    rd->len = strlen(rd->msg);
+    if(tail && !REPORT_DOC(tail->mode) && tail->mode == rd->mode
+            && !tail->live && !rd->live
+            && tail->responseTo == rd->responseTo && !tail->attempts
+            && tail->len + 1 + rd->len <= MSG_SIZE) {
+        tail->msg[tail->len++] = '\n';
+        memcpy(tail->msg + tail->len, rd->msg, rd->len + 1);
+        tail->len += rd->len;
+        logTrc("Report to %u merged, %lu bytes", rd->chatId, tail->len);
+        // Merged text replaces both spooled parts
+        if(tail->spoolId || rd->spoolId) {
+            int64_t old = tail->spoolId;
+            report_spool(tail, tail->msg, tail->responseTo);
+            if(old && tail->spoolId != old) spool_ack(old);
+            report_ack(rd);
+        }
+        free(rd);
+        return;
+    }
+
+    rd->next = NULL;
+    rd->ready = now + coalesce;
+    if(tail) tail->next = rd;
+    else cs->head = rd;
+    cs->tail = rd;
+}
+
+static void chat_requeue (ChatState *cs, ReportData *rd) {
+    rd->next = cs->head;
+    cs->head = rd;
+    if(!cs->tail) cs->tail = rd;
+}
+
+/**
+ * @brief Builds transfer for report and adds it to sender multi handle
+ */
+static int report_start (ReportData *rd) {
     CURLcode ret;
-    ReportData *rd = (ReportData *) (ptr);
-    ResponseData cd = {0};
+    curl_mimepart *field = NULL;
     char url[URL_SIZE + 1] = {0};
-    json_t *data = json_object(), *mode;
-    switch(rd->mode) {
-        case Markdown: mode = json_string("Markdown"); break;
-        case MarkdownV2: mode = json_string("MarkdownV2"); break;
-        case Html: mode = json_string("HTML"); break;
-        default: mode = json_string("Markdown"); break;
-    }
-    json_object_set_new(data, "chat_id", json_integer(rd->chatId));
-    json_object_set_new(data, "text", json_string(rd->msg));
-    json_object_set_new(data, "parse_mode", mode);
-
-    if(rd->responseTo) {
-        json_t *reply = json_object();
-        json_object_set_new(reply, "message_id", json_integer(rd->responseTo));
-        json_object_set_new(data, "reply_parameters", reply);
+    const confStruct *c;
+
+    rd->curl = curl_easy_init();
+    if(!rd->curl) {
+        logErr("Report handle creation failed");
+        return -1;
     }
-    const char *post = json_dumps(data, JSON_COMPACT);
-    int sz = strlen(post);
 
-    struct curl_slist *slist = NULL;
-    slist = curl_slist_append(slist, "Content-type: application/json; charset=utf8");
+    if(rd->live) {
+        pthread_mutex_lock(&rd->live->lock);
+        if(rd->edit) {
+            snprintf(rd->msg, sizeof(rd->msg), "%s", rd->live->text);
+            rd->mode = rd->live->mode;
+        }
+        pthread_mutex_unlock(&rd->live->lock);
+        if(rd->edit && !rd->live->messageId) {
+            // Live message was never delivered, post text as new one
+            rd->edit = false;
+            rd->responseTo = rd->live->responseTo;
+        }
+        if(rd->edit)
+            rd->live->lastEdit = report_now();
+    }
 
-    if (rd->mode == Document) {
-        snprintf(url, URL_SIZE, "%s%s/sendDocument?chat_id=%u", API_URL, API_KEY, rd->chatId);
+    if (REPORT_DOC(rd->mode)) {
+        if(access(rd->doc, R_OK) < 0) {
+            logErr("Report to %u document %s lost: %m", rd->chatId, rd->doc);
+            report_ack(rd);
+            return -1;
+        }
+        c = conf_get();
+        snprintf(url, URL_SIZE, "%s%s/sendDocument?chat_id=%u", c->apiUrl, c->apiKey, rd->chatId);
+        conf_put(c);
         logTrc("TG_DOC: %s", url);
 
-        curl = curl_easy_init();
-        multi_handle = curl_multi_init();
-        if (curl && multi_handle) {
-            form = curl_mime_init(curl);
-
-            field = curl_mime_addpart(form);
-            ret = curl_mime_name(field, "document");
-            logTrc("document %s %s", codename(ret), curl_easy_strerror(ret));
-            ret = curl_mime_filedata(field, rd->doc);
-            logTrc("filedata %s %s", codename(ret), curl_easy_strerror(ret));
-
-            field = curl_mime_addpart(form);
-            ret = curl_mime_name(field, "caption");
-            logTrc("caption %s %s", codename(ret), curl_easy_strerror(ret));
-            ret = curl_mime_data(field, rd->msg, CURL_ZERO_TERMINATED);
-            logTrc("data %s %s", codename(ret), curl_easy_strerror(ret));
-
-            if(rd->responseTo) {
-                char par[64];
-                sprintf(par, "{\"message_id\":%u}", rd->responseTo);
-                curl_mime_name(field, "reply_parameters");
-                curl_mime_data(field, par, CURL_ZERO_TERMINATED);
-            }
+        rd->form = curl_mime_init(rd->curl);
 
-            curl_easy_setopt(curl, CURLOPT_URL, url);
-            curl_easy_setopt(curl, CURLOPT_HEADER, 0);
-            curl_easy_setopt(curl, CURLOPT_MIMEPOST, form);
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist);
-            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &cd);
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, report_write_chunk);
+        field = curl_mime_addpart(rd->form);
+        ret = curl_mime_name(field, "document");
+        logTrc("document %s %s", codename(ret), curl_easy_strerror(ret));
+        ret = curl_mime_filedata(field, rd->doc);
+        logTrc("filedata %s %s", codename(ret), curl_easy_strerror(ret));
 
-            curl_multi_add_handle(multi_handle, curl);
+        field = curl_mime_addpart(rd->form);
+        ret = curl_mime_name(field, "caption");
+        logTrc("caption %s %s", codename(ret), curl_easy_strerror(ret));
+        ret = curl_mime_data(field, rd->msg, CURL_ZERO_TERMINATED);
+        logTrc("data %s %s", codename(ret), curl_easy_strerror(ret));
 
-            do {
-                CURLMcode mc = curl_multi_perform(multi_handle, &still_running);
+        if(rd->responseTo) {
+            char par[64];
+            sprintf(par, "{\"message_id\":%u}", rd->responseTo);
+            field = curl_mime_addpart(rd->form);
+            curl_mime_name(field, "reply_parameters");
+            curl_mime_data(field, par, CURL_ZERO_TERMINATED);
+        }
 
-                if(still_running)
-                    /* wait for activity, timeout or "nothing" */
-                    mc = curl_multi_poll(multi_handle, NULL, 0, 1000, NULL);
-                if(mc)
-                    break;
-            } while(still_running);
+        curl_easy_setopt(rd->curl, CURLOPT_MIMEPOST, rd->form);
+    } else {
+        json_t *data = json_object(), *mode;
+        switch(rd->mode) {
+            case Markdown: mode = json_string("Markdown"); break;
+            case MarkdownV2: mode = json_string("MarkdownV2"); break;
+            case Html: mode = json_string("HTML"); break;
+            case Plain: mode = NULL; break;
+            default: mode = json_string("Markdown"); break;
+        }
+        json_object_set_new(data, "chat_id", json_integer(rd->chatId));
+        json_object_set_new(data, "text", json_string(rd->msg));
+        if(mode)
+            json_object_set_new(data, "parse_mode", mode);
 
-            curl_multi_cleanup(multi_handle);
+        if(rd->edit) {
+            json_object_set_new(data, "message_id", json_integer(rd->live->messageId));
+        } else if(rd->responseTo) {
+            json_t *reply = json_object();
+            json_object_set_new(reply, "message_id", json_integer(rd->responseTo));
+            json_object_set_new(data, "reply_parameters", reply);
+        }
+        rd->post = json_dumps(data, JSON_COMPACT);
+        json_decref(data);
+        logTrc("TG: %s", rd->post);
 
-            /* always cleanup */
-            curl_easy_cleanup(curl);
+        c = conf_get();
+        snprintf(url, URL_SIZE, "%s%s/%s", c->apiUrl, c->apiKey, rd->edit ? "editMessageText" : "sendMessage");
+        conf_put(c);
+        rd->slist = curl_slist_append(rd->slist, "Content-type: application/json; charset=utf8");
+        curl_easy_setopt(rd->curl, CURLOPT_POST, 1L);
+        curl_easy_setopt(rd->curl, CURLOPT_POSTFIELDS, rd->post);
+        curl_easy_setopt(rd->curl, CURLOPT_POSTFIELDSIZE, (long)(rd->post ? strlen(rd->post) : 0));
+        curl_easy_setopt(rd->curl, CURLOPT_HTTPHEADER, rd->slist);
+    }
 
-            /* then cleanup the form */
-            curl_mime_free(form);
+    curl_easy_setopt(rd->curl, CURLOPT_URL, url);
+    curl_easy_setopt(rd->curl, CURLOPT_HEADER, 0L);
+    curl_easy_setopt(rd->curl, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(rd->curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(rd->curl, CURLOPT_TIMEOUT, (long)SENDER_TIMEOUT_S);
+    curl_easy_setopt(rd->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(rd->curl, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(rd->curl, CURLOPT_SHARE, sender.share);
+    curl_easy_setopt(rd->curl, CURLOPT_PRIVATE, rd);
+    curl_easy_setopt(rd->curl, CURLOPT_WRITEDATA, &rd->cd);
+    curl_easy_setopt(rd->curl, CURLOPT_WRITEFUNCTION, report_write_chunk);
 
-            logTrc ("CURL FIN [chunks=%d, size=%ld]", cd.cnt, cd.size);
-            logTrc (cd.buf);
+    if(curl_multi_add_handle(sender.multi, rd->curl) != CURLM_OK) {
+        logErr("Report handle add failed");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Transfer errors worth retrying, others fail same way again
+ */
+static bool report_transient (CURLcode ret) {
+    switch(ret) {
+        case CURLE_OK:
+        case CURLE_COULDNT_RESOLVE_PROXY:
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_HTTP2:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SSL_CONNECT_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_HTTP2_STREAM:
+        case CURLE_AGAIN:
+            return true;
+        default:
+            return false;
+    }
+}
 
-            /* always cleanup */
-            curl_easy_cleanup(curl);
-            //
+/**
+ * @brief Checks API reply: delivered reports are freed, throttled (429)
+ *        ones pause their chat for retry_after, transient failures are
+ *        retried with exponential backoff
+ */
+static void report_done (CURL *curl, CURLcode ret) {
+    long http = 0, retryAfter = 0;
+    curl_off_t total = 0;
+    uint64_t now = report_now(), delay = 0;
+    const char *desc = NULL;
+    bool throttled = false;
+    ReportData *rd = NULL;
+    ChatState *cs;
+    json_t *resp = NULL, *par;
+
+    curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&rd);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+    log_set_chat(rd->chatId);
+    metrics_observe(report_seconds(REPORT_DOC(rd->mode) ? ApiDocument : rd->edit ? ApiEdit : ApiSend), total);
+    metrics_add(report_result(ret, http), 1);
+    if(rd->cd.buf) rd->cd.buf[rd->cd.size] = 0;
+    logTrc("CURL ret = %d (%s) http=%ld [chunks=%d, size=%ld]", ret, codename(ret), http, rd->cd.cnt, rd->cd.size);
+    logTrc("%s", rd->cd.buf ? rd->cd.buf : "");
+
+    cs = chat_get(rd->chatId);
+    cs->busy = false;
+
+    if(ret == CURLE_OK && rd->cd.size) {
+        resp = json_loadb(rd->cd.buf, rd->cd.size, 0, NULL);
+        if(resp) {
+            desc = json_string_value(json_object_get(resp, "description"));
+            par = json_object_get(resp, "parameters");
+            if(par) retryAfter = json_integer_value(json_object_get(par, "retry_after"));
+        }
+    }
+
+    if(ret == CURLE_OK && http >= 200 && http < 300) {
+        if(rd->live && !rd->edit && resp) {
+            par = json_object_get(resp, "result");
+            rd->live->messageId = json_integer_value(json_object_get(par, "message_id"));
+        }
+        report_ack(rd);
+        report_free(rd);
+    } else if(http == 400 && rd->edit && desc && strstr(desc, "not modified")) {
+        report_ack(rd);
+        report_free(rd);
+    } else if(http == 429) {
+        if(retryAfter < 1) retryAfter = 1;
+        logWrn("Chat %u throttled for %lds", rd->chatId, retryAfter);
+        cs->blocked = now + retryAfter * 1000;
+        throttled = true;
+        delay = 1;
+    } else if(http == 400 && rd->mode != Plain && !REPORT_DOC(rd->mode)
+            && desc && strstr(desc, "parse entities")) {
+        logWrn("Chat %u markup rejected, resend as plain text", rd->chatId);
+        rd->mode = Plain;
+        if(rd->edit) {
+            pthread_mutex_lock(&rd->live->lock);
+            rd->live->mode = Plain;
+            pthread_mutex_unlock(&rd->live->lock);
         }
+        delay = 1;
+    } else if(!report_transient(ret)) {
+        logErr("Report to %u failed for good: %s", rd->chatId, curl_easy_strerror(ret));
+        report_ack(rd);
+        report_free(rd);
+    } else if(ret != CURLE_OK || http >= 500 || http == 0) {
+        delay = (uint64_t)SENDER_BACKOFF_MS << (rd->attempts < 6 ? rd->attempts : 6);
+        if(delay > SENDER_BACKOFF_MAX) delay = SENDER_BACKOFF_MAX;
+        logWrn("Report to %u failed(%s, http=%ld), retry in %lums", rd->chatId
+            , ret == CURLE_OK ? "API" : curl_easy_strerror(ret), http, delay);
+    } else if(rd->edit && rd->spoolId) {
+        // Final text of live message must not be lost, post it as new one
+        logWrn("Chat %u edit rejected(%ld): %s, resend as message", rd->chatId, http, desc ? desc : "-");
+        rd->edit = false;
+        rd->responseTo = rd->live->responseTo;
+        live_release(rd->live);
+        rd->live = NULL;
+        delay = 1;
     } else {
-        logTrc("TG: %s", post);
-        snprintf(url, URL_SIZE, "%s%s/sendMessage", API_URL, API_KEY);
-        curl = curl_easy_init();
-        if(curl) {
-            curl_easy_setopt(curl, CURLOPT_URL, url);
-            curl_easy_setopt(curl, CURLOPT_HEADER, 0);
-            curl_easy_setopt(curl, CURLOPT_POST, 1);
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post);
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, sz);
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist);
-            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &cd);
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, report_write_chunk);
-
-            ret = curl_easy_perform(curl);
-            logTrc ("CURL ret = %d (%s) [chunks=%d, size=%ld]", ret, codename(ret), cd.cnt, cd.size);
-            logTrc (cd.buf);
-
-            /* always cleanup */
-            curl_easy_cleanup(curl);
+        logErr("Report to %u rejected(%ld): %s", rd->chatId, http, desc ? desc : "-");
+        report_ack(rd);
+        report_free(rd);
+    }
+
+    if(delay) {
+        // Spooled report waits out outage of about a day, retries stay on this thread
+        // Throttling says when to come back, it is not a failed attempt
+        if(!throttled && ++rd->attempts > (rd->spoolId ? SENDER_SPOOL_RETRIES : SENDER_RETRIES)) {
+            logErr("Report to %u dropped after %d attempts", rd->chatId, rd->attempts);
+            report_ack(rd);
+            report_free(rd);
+        } else {
+            report_reset(rd);
+            rd->ready = now + delay;
+            chat_requeue(cs, rd);
+        }
+    }
+
+    if(resp) json_decref(resp);
+    log_set_chat(0);
+}
+
+/**
+ * @brief Starts every queued report allowed by per-chat and bot-wide
+ *        token buckets
+ * @return ms until next report may become ready
+ */
+static uint64_t report_schedule (uint64_t now) {
+    int i;
+    uint64_t wait = SENDER_POLL_MS, w;
+    ChatState *cs;
+    ReportData *rd;
+    const confStruct *c = conf_get();
+    double chatRate = c->tgChatRate, globalRate = c->tgGlobalRate;
+
+    conf_put(c);
+
+    for(i = 0; i < CHAT_HASH_SZ; i++) {
+        for(cs = sender.chats[i]; cs; cs = cs->next) {
+            if(cs->busy || !(rd = cs->head)) continue;
+
+            if(cs->blocked > now) w = cs->blocked - now;
+            else if(rd->ready > now) w = rd->ready - now;
+            else if((w = bucket_wait(&cs->bucket, chatRate, now)) == 0)
+                w = bucket_wait(&sender.bucket, globalRate, now);
+            if(w) {
+                if(w < wait) wait = w;
+                continue;
+            }
+
+            cs->head = rd->next;
+            if(!cs->head) cs->tail = NULL;
+            rd->next = NULL;
+            cs->bucket.tokens -= 1.0;
+            sender.bucket.tokens -= 1.0;
+
+            if(report_start(rd) < 0) {
+                report_free(rd);
+            } else {
+                cs->busy = true;
+            }
         }
+    }
+    return wait;
+}
 
+/**
+ * @brief Takes everything submitted so far, restoring FIFO order
+ */
+static ReportData *report_take () {
+    ReportData *head = atomic_exchange(&sender.queue, NULL), *fifo = NULL, *next;
+    while(head) {
+        next = head->next;
+        head->next = fifo;
+        fifo = head;
+        head = next;
     }
+    return fifo;
+}
 
-    curl_slist_free_all(slist);
-    json_decref(data);
-    free(ptr);
+static void* report_sender (void *pData) {
+    int i, running = 0, left;
+    uint64_t now, wait;
+    CURLMsg *msg;
+    ChatState *cs;
+    ReportData *rd, *next;
 
+    while(!atomic_load(&sender.stop) || running) {
+        now = report_now();
+        for(rd = report_take(); rd; rd = next) {
+            next = rd->next;
+            chat_push(rd, now);
+        }
+
+        wait = report_schedule(now);
+
+        curl_multi_perform(sender.multi, &running);
+        while((msg = curl_multi_info_read(sender.multi, &left))) {
+            if(msg->msg == CURLMSG_DONE) {
+                report_done(msg->easy_handle, msg->data.result);
+                wait = 0;
+            }
+        }
+
+        if(wait)
+            curl_multi_poll(sender.multi, NULL, 0, (int)wait, NULL);
+    }
+
+    for(i = 0; i < CHAT_HASH_SZ; i++) {
+        while((cs = sender.chats[i])) {
+            for(rd = cs->head; rd; rd = next) {
+                next = rd->next;
+                report_free(rd);
+            }
+            sender.chats[i] = cs->next;
+            free(cs);
+        }
+    }
+    for(rd = report_take(); rd; rd = next) {
+        next = rd->next;
+        report_free(rd);
+    }
     return NULL;
 }
 
+static int report_submit (ReportData *rd) {
+    if(!sender.started) {
+        report_free(rd);
+        return -1;
+    }
+    rd->next = atomic_load(&sender.queue);
+    while(!atomic_compare_exchange_weak(&sender.queue, &rd->next, rd));
+    curl_multi_wakeup(sender.multi);
+    return 0;
+}
+
+static void report_replay (int64_t id, const spoolEntry *e, void *userdata) {
+    ReportData *rd = calloc(1, sizeof(ReportData));
+
+    snprintf(rd->msg, sizeof(rd->msg), "%s", e->msg);
+    snprintf(rd->doc, sizeof(rd->doc), "%s", e->doc);
+    rd->chatId = e->chat;
+    rd->responseTo = e->responseTo;
+    rd->mode = e->mode;
+    rd->spoolId = id;
+    report_submit(rd);
+}
+
+/**
+ * @brief Starts single sender thread owning shared multi handle, so all
+ *        reports go over few kept-alive connections with cached TLS
+ *        sessions and DNS entries
+ */
+int report_init() {
+    int r;
+
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    sender.share = curl_share_init();
+    curl_share_setopt(sender.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(sender.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    sender.multi = curl_multi_init();
+    if(!sender.share || !sender.multi) {
+        logErr("Sender handles creation failed");
+        return -1;
+    }
+    curl_multi_setopt(sender.multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)SENDER_CONNECTIONS);
+    curl_multi_setopt(sender.multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)SENDER_CONNECTIONS);
+    curl_multi_setopt(sender.multi, CURLMOPT_MAXCONNECTS, (long)SENDER_CONNECTIONS);
+    curl_multi_setopt(sender.multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    r = pthread_create(&sender.thread, NULL, report_sender, NULL);
+    if(r != 0) {
+        logErr("Sender thread creation failed(%d): %s", r, strerror(r));
+        return -r;
+    }
+    sender.started = true;
+
+    // Reports left from previous run go out first
+    if(gSpoolPath[0] && (r = spool_open(gSpoolPath)) >= 0) {
+        sender.spool = true;
+        if(r > 0) logInf("Spool replayed %d reports", spool_replay(report_replay, NULL));
+    }
+    return 0;
+}
+
+void report_deinit() {
+    if(!sender.started) return;
+    atomic_store(&sender.stop, true);
+    curl_multi_wakeup(sender.multi);
+    pthread_join(sender.thread, NULL);
+    sender.started = false;
+    sender.spool = false;
+    spool_close();
+
+    curl_multi_cleanup(sender.multi);
+    curl_share_cleanup(sender.share);
+    curl_global_cleanup();
+}
+
 int send_report(uint32_t chat, char *msg, uint32_t responseTo) {
     if(!chat) return -1;
     if(!msg) return -2;
-    pthread_t pid;
-    ReportData *rep = malloc(sizeof(ReportData));
-    strcpy(rep->msg, msg);
+    ReportData *rep = calloc(1, sizeof(ReportData));
+    snprintf(rep->msg, sizeof(rep->msg), "%s", msg);
     rep->chatId = chat;
     rep->responseTo = responseTo;
     rep->mode = Markdown;
-    return pthread_create(&pid, NULL, report_query, rep);
+    report_spool(rep, rep->msg, responseTo);
+    return report_submit(rep);
 }
 
-int send_document(uint32_t chat, char *path, char *caption, uint32_t responseTo) {
+/**
+ * @brief Posts message that can be updated later with report_live_update.
+ *        Returned handle is released by report_live_close.
+ */
+ReportLive *report_live_open(uint32_t chat, const char *text, uint32_t responseTo) {
+    ReportLive *live;
+    ReportData *rep;
+
+    if(!chat || !text) return NULL;
+    live = calloc(1, sizeof(ReportLive));
+    pthread_mutex_init(&live->lock, NULL);
+    atomic_init(&live->refs, 2);    // Owner and initial message
+    live->mode = Plain;
+    live->chatId = chat;
+    live->responseTo = responseTo;
+    snprintf(live->text, sizeof(live->text), "%s", text);
+
+    rep = calloc(1, sizeof(ReportData));
+    snprintf(rep->msg, sizeof(rep->msg), "%s", text);
+    rep->chatId = chat;
+    rep->responseTo = responseTo;
+    rep->mode = Plain;
+    rep->live = live;
+    if(report_submit(rep) < 0) {
+        live_release(live);
+        return NULL;
+    }
+    return live;
+}
+
+static void live_edit(ReportLive *live, const char *text, ReportMode mode, bool final) {
+    ReportData *rep;
+
+    pthread_mutex_lock(&live->lock);
+    snprintf(live->text, sizeof(live->text), "%s", text);
+    live->mode = mode;
+    pthread_mutex_unlock(&live->lock);
+
+    rep = calloc(1, sizeof(ReportData));
+    rep->chatId = live->chatId;
+    rep->mode = mode;
+    rep->edit = true;
+    rep->live = live;
+    atomic_fetch_add(&live->refs, 1);
+    if(final) report_spool(rep, text, live->responseTo);
+    report_submit(rep);
+}
+
+/**
+ * @brief Replaces live message text (plain). Edits are throttled to one
+ *        per tg_progress ms and only the latest text is sent.
+ */
+void report_live_update(ReportLive *live, const char *text) {
+    if(!live || !text) return;
+    live_edit(live, text, Plain, false);
+}
+
+/**
+ * @brief Sets final (Markdown) text and releases handle
+ */
+void report_live_close(ReportLive *live, const char *text) {
+    if(!live) return;
+    if(text)
+        live_edit(live, text, Markdown, true);
+    live_release(live);
+}
+
+static int report_document(uint32_t chat, char *path, char *caption, uint32_t responseTo, ReportMode mode) {
     if(!chat) return -1;
     if(!path) return -2;
     if(!caption) return -3;
-    pthread_t pid;
-    ReportData *rep = malloc(sizeof(ReportData));
-    strcpy(rep->msg, caption);
-    strcpy(rep->doc, path);
+    ReportData *rep = calloc(1, sizeof(ReportData));
+    snprintf(rep->msg, sizeof(rep->msg), "%s", caption);
+    snprintf(rep->doc, PATH_SIZE, "%s", path);
     rep->chatId = chat;
     rep->responseTo = responseTo;
-    rep->mode = Document;
-    return pthread_create(&pid, NULL, report_query, rep);
+    rep->mode = mode;
+    report_spool(rep, rep->msg, responseTo);
+    return report_submit(rep);
 /*
     private static function postFile($chat_id, $filepath, $filename, $caption = '') {
         $strUrl = self::API_URL . TELEGRAM_KEY . "/sendDocument?chat_id={$chat_id}" ;
@@ -250,6 +914,18 @@ int send_document(uint32_t chat, char *path, char *caption, uint32_t responseTo)
 */
 }
 
+int send_document(uint32_t chat, char *path, char *caption, uint32_t responseTo) {
+    return report_document(chat, path, caption, responseTo, Document);
+}
+
+/**
+ * @brief Sends document and removes its file once delivered or dropped,
+ *        path must be private to this report
+ */
+int send_temp_document(uint32_t chat, char *path, char *caption, uint32_t responseTo) {
+    return report_document(chat, path, caption, responseTo, TempDocument);
+}
+
 const char *codename(CURLcode code) {
     switch(code) {
         case CURLE_OK: return "CURLE_OK"; break;
@@ -0,0 +1,362 @@
+#define LOG_MODULE  LOG_MOD_REPORT
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "spool.h"
+#include "metrics.h"
+#include "debug.h"
+
+#define SPOOL_MAGIC     "TGSPOOL1"
+#define SPOOL_REC_MAGIC 0x52505354u         // "TSPR"
+#define SPOOL_CHUNK     (1024 * 1024)       // File grows by
+#define SPOOL_MAX       (64 * 1024 * 1024)  // Appends fail above
+#define SPOOL_COMPACT   (4 * 1024 * 1024)   // Acked bytes that trigger compaction
+#define SPOOL_ALIGN(x)  (((x) + 7) & ~(size_t)7)
+
+enum {
+    SpoolPending,
+    SpoolAcked
+};
+
+typedef struct spoolHeaderS {
+    char magic[8];
+    _Atomic uint64_t tail;  // End of published records
+} spoolHeader;
+
+// Record is written in full before tail moves past it, so a torn append
+// is never replayed. Only state changes afterwards.
+typedef struct spoolRecS {
+    uint32_t magic;
+    uint32_t size;          // Whole record, aligned
+    uint32_t crc;           // From chat to end of data
+    _Atomic uint32_t state;
+    uint32_t chat;
+    uint32_t responseTo;
+    int32_t mode;
+    uint16_t msgLen;
+    uint16_t docLen;
+    char data[];            // msg\0doc\0
+} spoolRec;
+
+// Pending record, ids stay while records move on compaction
+typedef struct spoolIdxS {
+    int64_t id;
+    uint64_t off;
+} spoolIdx;
+
+typedef struct spoolS {
+    pthread_mutex_t lock;
+    int fd;
+    char *path;
+    char *map;
+    size_t size;            // Mapped and file size
+    spoolIdx *idx;          // Pending records in append order
+    int pending;
+    int cap;
+    int64_t nextId;
+    uint64_t acked;         // Bytes of acked records below tail
+    metric *gauge;
+} spoolStruct;
+
+// Local variables
+static spoolStruct spool = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1, .nextId = 1 };
+
+#define SPOOL_HDR       SPOOL_ALIGN(sizeof(spoolHeader))
+#define SPOOL_HEAD()    ((spoolHeader *)spool.map)
+#define SPOOL_REC(off)  ((spoolRec *)(spool.map + (off)))
+
+static uint32_t spool_crc(const spoolRec *r) {
+    return crc32(0, (const Bytef *)&r->chat, r->size - offsetof(spoolRec, chat));
+}
+
+static int spool_grow(size_t need) {
+    size_t size = spool.size;
+    char *map;
+
+    while(size < need) size += SPOOL_CHUNK;
+    if(size == spool.size) return 0;
+    if(size > SPOOL_MAX) return -ENOSPC;
+    if(ftruncate(spool.fd, size) < 0) return -errno;
+    map = spool.map ? mremap(spool.map, spool.size, size, MREMAP_MAYMOVE)
+                    : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, spool.fd, 0);
+    if(map == MAP_FAILED) return -errno;
+    spool.map = map;
+    spool.size = size;
+    return 0;
+}
+
+/**
+ * @return id of record indexed as pending or negative errno
+ */
+static int64_t spool_index(uint64_t off) {
+    spoolIdx *idx;
+
+    if(spool.pending == spool.cap) {
+        idx = realloc(spool.idx, (spool.cap ? spool.cap * 2 : 64) * sizeof(spoolIdx));
+        if(!idx) return -ENOMEM;
+        spool.idx = idx;
+        spool.cap = spool.cap ? spool.cap * 2 : 64;
+    }
+    spool.idx[spool.pending++] = (spoolIdx){ spool.nextId, off };
+    return spool.nextId++;
+}
+
+/**
+ * @return index position of pending record or -1
+ */
+static int spool_find(int64_t id) {
+    int lo = 0, hi = spool.pending - 1, mid;
+
+    while(lo <= hi) {
+        mid = (lo + hi) / 2;
+        if(spool.idx[mid].id == id) return mid;
+        if(spool.idx[mid].id < id) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return -1;
+}
+
+/**
+ * @brief Copies pending records to new file which then replaces spool,
+ *        so crash at any point leaves one complete spool.
+ *        Called with lock held.
+ */
+static int spool_compact() {
+    int i, r, fd;
+    char tmp[PATH_MAX];
+    char *map;
+    size_t size = SPOOL_HDR, len;
+    uint64_t off = SPOOL_HDR;
+
+    for(i = 0; i < spool.pending; i++) size += SPOOL_REC(spool.idx[i].off)->size;
+    size = (size + SPOOL_CHUNK - 1) / SPOOL_CHUNK * SPOOL_CHUNK;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", spool.path);
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd < 0) return -errno;
+    if(ftruncate(fd, size) < 0
+        || (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        r = -errno;
+        close(fd);
+        unlink(tmp);
+        return r;
+    }
+    memcpy(((spoolHeader *)map)->magic, SPOOL_MAGIC, sizeof(((spoolHeader *)map)->magic));
+    for(i = 0; i < spool.pending; i++) {
+        len = SPOOL_REC(spool.idx[i].off)->size;
+        memcpy(map + off, SPOOL_REC(spool.idx[i].off), len);
+        off += len;
+    }
+    atomic_store(&((spoolHeader *)map)->tail, off);
+    if(msync(map, size, MS_SYNC) < 0 || rename(tmp, spool.path) < 0) {
+        r = -errno;
+        munmap(map, size);
+        close(fd);
+        unlink(tmp);
+        return r;
+    }
+
+    logDbg("Spool compacted, %lu acked bytes dropped", spool.acked);
+    munmap(spool.map, spool.size);
+    close(spool.fd);
+    spool.fd = fd;
+    spool.map = map;
+    spool.size = size;
+    for(i = 0, off = SPOOL_HDR; i < spool.pending; i++) {
+        spool.idx[i].off = off;
+        off += SPOOL_REC(off)->size;
+    }
+    spool.acked = 0;
+    return 0;
+}
+
+/**
+ * @brief Validates records up to tail, torn or corrupt end is cut off
+ */
+static void spool_scan() {
+    uint64_t off = SPOOL_HDR, tail = atomic_load(&SPOOL_HEAD()->tail);
+    spoolRec *r;
+
+    spool.pending = 0;
+    spool.acked = 0;
+    if(tail > spool.size) tail = spool.size;
+    while(off + sizeof(spoolRec) <= tail) {
+        r = SPOOL_REC(off);
+        if(r->magic != SPOOL_REC_MAGIC || r->size < sizeof(spoolRec) || off + r->size > tail
+            || r->crc != spool_crc(r)) {
+            logWrn("Spool damaged at %lu, %lu bytes dropped", off, tail - off);
+            break;
+        }
+        if(atomic_load(&r->state) != SpoolPending) spool.acked += r->size;
+        else if(spool_index(off) < 0) break;
+        off += r->size;
+    }
+    atomic_store(&SPOOL_HEAD()->tail, off);
+}
+
+/**
+ * @brief Maps spool file, creating it when missing
+ * @return pending entries or negative errno
+ */
+int spool_open(const char *path) {
+    int r;
+    struct stat st;
+
+    spool.path = strdup(path);
+    spool.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(spool.fd < 0 || fstat(spool.fd, &st) < 0) {
+        r = -errno;
+        logErr("Spool %s open error(%d): %s", path, r, strerror(-r));
+        spool_close();
+        return r;
+    }
+    spool.size = 0;
+    r = spool_grow(st.st_size > (off_t)SPOOL_HDR ? (size_t)st.st_size : SPOOL_HDR);
+    if(r < 0) {
+        logErr("Spool %s map error(%d): %s", path, r, strerror(-r));
+        spool_close();
+        return r;
+    }
+    if(memcmp(SPOOL_HEAD()->magic, SPOOL_MAGIC, sizeof(SPOOL_HEAD()->magic))) {
+        if(st.st_size) logWrn("Spool %s has no valid header, reset", path);
+        memcpy(SPOOL_HEAD()->magic, SPOOL_MAGIC, sizeof(SPOOL_HEAD()->magic));
+        atomic_store(&SPOOL_HEAD()->tail, SPOOL_HDR);
+    }
+    spool_scan();
+    spool.gauge = metrics_get(MetricGauge, "executor_spool_pending", "Reports waiting for delivery", NULL);
+    metrics_set(spool.gauge, spool.pending);
+    logDbg("Spool %s: %d pending, %lu bytes", path, spool.pending, atomic_load(&SPOOL_HEAD()->tail));
+    return spool.pending;
+}
+
+/**
+ * @brief Stores entry before it is sent. Space of acked entries is
+ *        reclaimed when spool would grow over SPOOL_MAX.
+ * @return record id (>0) or negative errno
+ */
+int64_t spool_append(const spoolEntry *e) {
+    int r;
+    int64_t id;
+    uint64_t off;
+    size_t msgLen = strlen(e->msg), docLen = e->doc ? strlen(e->doc) : 0;
+    size_t size = SPOOL_ALIGN(sizeof(spoolRec) + msgLen + docLen + 2);
+    spoolRec *rec;
+
+    if(msgLen > UINT16_MAX || docLen > UINT16_MAX) return -E2BIG;
+
+    pthread_mutex_lock(&spool.lock);
+    if(spool.fd < 0) {
+        pthread_mutex_unlock(&spool.lock);
+        return -EBADF;
+    }
+    off = atomic_load(&SPOOL_HEAD()->tail);
+    r = spool_grow(off + size);
+    if(r == -ENOSPC && spool.acked && (r = spool_compact()) == 0) {
+        off = atomic_load(&SPOOL_HEAD()->tail);
+        r = spool_grow(off + size);
+    }
+    if(r < 0) {
+        pthread_mutex_unlock(&spool.lock);
+        return r;
+    }
+    rec = SPOOL_REC(off);
+    memset(rec, 0, size);
+    rec->magic = SPOOL_REC_MAGIC;
+    rec->size = size;
+    rec->chat = e->chat;
+    rec->responseTo = e->responseTo;
+    rec->mode = e->mode;
+    rec->msgLen = msgLen;
+    rec->docLen = docLen;
+    memcpy(rec->data, e->msg, msgLen);
+    if(docLen) memcpy(rec->data + msgLen + 1, e->doc, docLen);
+    rec->crc = spool_crc(rec);
+    id = spool_index(off);
+    if(id < 0) {
+        pthread_mutex_unlock(&spool.lock);
+        return id;
+    }
+    atomic_store_explicit(&SPOOL_HEAD()->tail, off + size, memory_order_release);
+    metrics_set(spool.gauge, spool.pending);
+    pthread_mutex_unlock(&spool.lock);
+    return id;
+}
+
+/**
+ * @brief Marks entry delivered. Once nothing is pending spool starts over,
+ *        until then it is compacted when acked entries take SPOOL_COMPACT
+ *        and most of it.
+ */
+void spool_ack(int64_t id) {
+    int i, r;
+    spoolRec *rec;
+
+    pthread_mutex_lock(&spool.lock);
+    i = spool.fd >= 0 ? spool_find(id) : -1;
+    if(i >= 0) {
+        rec = SPOOL_REC(spool.idx[i].off);
+        atomic_store(&rec->state, SpoolAcked);
+        spool.acked += rec->size;
+        spool.pending--;
+        memmove(&spool.idx[i], &spool.idx[i + 1], (spool.pending - i) * sizeof(spoolIdx));
+        if(spool.pending == 0) {
+            atomic_store(&SPOOL_HEAD()->tail, SPOOL_HDR);
+            spool.acked = 0;
+        } else if(spool.acked >= SPOOL_COMPACT && spool.acked * 2 > atomic_load(&SPOOL_HEAD()->tail)
+            && (r = spool_compact()) < 0) {
+            logWrn("Spool compaction error(%d): %s", r, strerror(-r));
+        }
+        metrics_set(spool.gauge, spool.pending);
+    }
+    pthread_mutex_unlock(&spool.lock);
+}
+
+/**
+ * @brief Calls func for every pending entry, in append order. Entries stay
+ *        pending until acknowledged.
+ * @return replayed count
+ */
+int spool_replay(spoolReplayFunc func, void *userdata) {
+    int i, n;
+    spoolRec *r;
+    spoolEntry e;
+
+    pthread_mutex_lock(&spool.lock);
+    n = spool.fd >= 0 ? spool.pending : 0;
+    for(i = 0; i < n; i++) {
+        r = SPOOL_REC(spool.idx[i].off);
+        e = (spoolEntry){ r->chat, r->responseTo, r->mode, r->data, r->data + r->msgLen + 1 };
+        func(spool.idx[i].id, &e, userdata);
+    }
+    pthread_mutex_unlock(&spool.lock);
+    return n;
+}
+
+void spool_close() {
+    pthread_mutex_lock(&spool.lock);
+    if(spool.map) {
+        msync(spool.map, spool.size, MS_SYNC);
+        munmap(spool.map, spool.size);
+    }
+    if(spool.fd >= 0) close(spool.fd);
+    free(spool.path);
+    free(spool.idx);
+    spool.path = NULL;
+    spool.idx = NULL;
+    spool.pending = spool.cap = 0;
+    spool.map = NULL;
+    spool.size = 0;
+    spool.fd = -1;
+    pthread_mutex_unlock(&spool.lock);
+}
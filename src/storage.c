@@ -1,59 +1,709 @@
+#define LOG_MODULE  LOG_MOD_STORAGE
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/epoll.h>
+#include <time.h>
 #include <mysql.h>
 #include <errno.h>
+#include <systemd/sd-event.h>
 
 #include "main.h"
+#include "storage.h"
+#include "loop.h"
+#include "conf.h"
 #include "debug.h"
 #include "config.h"
 
-MYSQL mySql = {0};
+#define STORAGE_OBJ_SZ      1024    // adm_cmd.obj, longer is cut
+#define STORAGE_TIMEOUT_S   10      // Connect, read and write
+#define STORAGE_ASYNC_MAX   256     // Lookups waiting for connection
+
+enum {
+    StmtCommand,
+    StmtClaim,
+    StmtLease,
+    StmtRenew,
+    StmtFinish,
+    StmtRelease,
+    StmtMax
+};
+
+// Prepared once per connection, on first use
+static const char *stmtSql[StmtMax] = {
+    [StmtCommand]   = "SELECT cmd, obj, flags, usr, dt, dt_exec FROM adm_cmd WHERE id=?",
+    [StmtClaim]     = "SELECT id, cmd, obj, flags, usr, dt FROM adm_cmd"
+                      " WHERE COALESCE(dt_exec, 0) = 0 AND lease < UNIX_TIMESTAMP()"
+                      " ORDER BY id LIMIT ? FOR UPDATE SKIP LOCKED",
+    [StmtLease]     = "UPDATE adm_cmd SET node=?, lease=UNIX_TIMESTAMP()+? WHERE id=?",
+    [StmtRenew]     = "UPDATE adm_cmd SET lease=UNIX_TIMESTAMP()+?"
+                      " WHERE id=? AND node=? AND COALESCE(dt_exec, 0) = 0",
+    [StmtFinish]    = "UPDATE adm_cmd SET dt_exec=UNIX_TIMESTAMP(), code=?, lease=0 WHERE id=? AND node=?",
+    [StmtRelease]   = "UPDATE adm_cmd SET node=NULL, lease=0 WHERE id=? AND node=?",
+};
+
+typedef struct storageConnS {
+    MYSQL my;
+    MYSQL_STMT *stmt[StmtMax];
+    bool up;
+    bool busy;
+    unsigned gen;               // Settings connected with, see confStruct.dbGen
+    uint64_t used;              // us, CLOCK_MONOTONIC
+} storageConn;
+
+// Row of adm_cmd as bound to statement result
+typedef struct storageRowS {
+    int val[6];
+    char obj[STORAGE_OBJ_SZ];
+    unsigned long objLen;
+    my_bool objNull;
+    MYSQL_BIND bind[6];
+} storageRow;
+
+// Blocking connections for worker threads
+typedef struct storagePoolS {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    storageConn *conns;
+    int count;
+} storagePool;
+
+// Lookup waiting for non-blocking connection
+typedef struct storageReqS {
+    struct storageReqS *next;
+    int id;
+    storageCommandFunc func;
+    void *userdata;
+} storageReq;
+
+typedef enum {
+    AsyncIdle,
+    AsyncConnect,
+    AsyncPrepare,
+    AsyncExecute,
+    AsyncStore,
+    AsyncFetch
+} storageAsyncState;
+
+// Non-blocking connection driven by event loop, MariaDB _start/_cont API
+typedef struct storageAsyncS {
+    MYSQL my;
+    MYSQL_STMT *stmt;
+    bool up;
+    unsigned gen;
+    const confStruct *conf;     // Held while connecting, library keeps pointers
+    storageAsyncState state;
+    storageReq *head, *tail;
+    int pending;
+    int fd;
+    sd_event_source *ioSrc;
+    sd_event_source *timeSrc;
+    int param;
+    MYSQL_BIND paramBind;
+    storageRow row;
+} storageAsync;
+
+// Local variables
+static storagePool pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+static storageAsync async = { .fd = -1 };
+
+static uint64_t storage_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool storage_lost(unsigned int err) {
+    return err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST;
+}
+
+static void storage_options(MYSQL *my) {
+    unsigned int timeout = STORAGE_TIMEOUT_S;
+
+    mysql_options(my, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+    mysql_options(my, MYSQL_OPT_READ_TIMEOUT, &timeout);
+    mysql_options(my, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
+}
+
+static void storage_disconnect(storageConn *c) {
+    int i;
+
+    for(i = 0; i < StmtMax; i++) {
+        if(c->stmt[i]) mysql_stmt_close(c->stmt[i]);
+        c->stmt[i] = NULL;
+    }
+    if(c->up) mysql_close(&c->my);
+    c->up = false;
+}
+
+static int storage_connect(storageConn *c) {
+    const confStruct *cf;
+
+    storage_disconnect(c);
+    if(!mysql_init(&c->my)) {
+        logErr("mysql_init error");
+        return -ENOMEM;
+    }
+    storage_options(&c->my);
+    cf = conf_get();
+    c->gen = cf->dbGen;
+    if(!mysql_real_connect(&c->my, cf->dbServ, cf->dbUser, cf->dbPass, cf->dbBase, cf->dbPort, NULL, 0)) {
+        logErr("Connect error: %s", mysql_error(&c->my));
+        mysql_close(&c->my);
+        conf_put(cf);
+        return -ECONNREFUSED;
+    }
+    conf_put(cf);
+    c->up = true;
+    c->used = storage_now();
+    return 0;
+}
+
+/**
+ * @brief Binds adm_cmd row fields: count ints, obj at objAt
+ */
+static void storage_row_bind(storageRow *row, int count, int objAt) {
+    int i, v = 0;
+
+    memset(row->bind, 0, sizeof(row->bind));
+    for(i = 0; i < count + 1; i++) {
+        if(i == objAt) {
+            row->bind[i].buffer_type = MYSQL_TYPE_STRING;
+            row->bind[i].buffer = row->obj;
+            row->bind[i].buffer_length = sizeof(row->obj) - 1;
+            row->bind[i].length = &row->objLen;
+            row->bind[i].is_null = &row->objNull;
+        } else {
+            row->bind[i].buffer_type = MYSQL_TYPE_LONG;
+            row->bind[i].buffer = &row->val[v++];
+        }
+    }
+}
+
+static char *storage_row_obj(storageRow *row) {
+    size_t len = row->objLen < sizeof(row->obj) - 1 ? row->objLen : sizeof(row->obj) - 1;
+    if(row->objNull) len = 0;
+    row->obj[len] = 0;
+    return row->obj;
+}
+
+/**
+ * @brief Takes idle connection, waiting for one when all are busy.
+ *        Connection idle over DB_PING_S is checked first, broken one or
+ *        one opened with settings since reloaded is opened again.
+ * @return connection or NULL when database is unreachable
+ */
+static storageConn *storage_acquire() {
+    int i;
+    unsigned gen;
+    storageConn *c = NULL;
+    const confStruct *cf = conf_get();
+
+    gen = cf->dbGen;
+    conf_put(cf);
+    pthread_mutex_lock(&pool.lock);
+    while(pool.count) {
+        for(i = 0; i < pool.count && pool.conns[i].busy; i++);
+        if(i < pool.count) {
+            c = &pool.conns[i];
+            c->busy = true;
+            break;
+        }
+        pthread_cond_wait(&pool.cond, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    if(!c) return NULL;
+
+    if(c->up && c->gen != gen) {
+        storage_disconnect(c);
+    } else if(c->up && storage_now() - c->used > DB_PING_S * 1000000ULL && mysql_ping(&c->my)) {
+        logWrn("Connection check failed: %s", mysql_error(&c->my));
+        storage_disconnect(c);
+    }
+    if(!c->up && storage_connect(c) < 0) {
+        pthread_mutex_lock(&pool.lock);
+        c->busy = false;
+        pthread_cond_signal(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+        return NULL;
+    }
+    return c;
+}
+
+static void storage_release(storageConn *c) {
+    c->used = storage_now();
+    pthread_mutex_lock(&pool.lock);
+    c->busy = false;
+    pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static MYSQL_STMT *storage_stmt(storageConn *c, int id) {
+    MYSQL_STMT *st = c->stmt[id];
+
+    if(st) return st;
+    st = mysql_stmt_init(&c->my);
+    if(!st) return NULL;
+    if(mysql_stmt_prepare(st, stmtSql[id], strlen(stmtSql[id]))) {
+        logErr("Prepare error(%u): %s", mysql_stmt_errno(st), mysql_stmt_error(st));
+        mysql_stmt_close(st);
+        return NULL;
+    }
+    c->stmt[id] = st;
+    return st;
+}
+
+/**
+ * @brief Executes prepared statement. When server went away outside
+ *        transaction connection is opened again and statement retried.
+ * @return statement or NULL on error
+ */
+static MYSQL_STMT *storage_exec(storageConn *c, int id, MYSQL_BIND *params, bool retry) {
+    MYSQL_STMT *st = storage_stmt(c, id);
+
+    if(st && !mysql_stmt_bind_param(st, params) && !mysql_stmt_execute(st)) return st;
+    if(retry && storage_lost(st ? mysql_stmt_errno(st) : mysql_errno(&c->my))) {
+        logWrn("Connection lost, reconnecting");
+        // Statements are closed by reconnect, whether it works or not
+        if(storage_connect(c) == 0) return storage_exec(c, id, params, false);
+        return NULL;
+    }
+    if(st) logErr("Execute error(%u): %s", mysql_stmt_errno(st), mysql_stmt_error(st));
+    return NULL;
+}
+
+static MYSQL_BIND storage_int(int *v) {
+    return (MYSQL_BIND){ .buffer_type = MYSQL_TYPE_LONG, .buffer = v };
+}
+
+static MYSQL_BIND storage_str(const char *s, unsigned long *len) {
+    *len = strlen(s);
+    return (MYSQL_BIND){ .buffer_type = MYSQL_TYPE_STRING, .buffer = (void*)s, .buffer_length = *len, .length = len };
+}
 
 int storage_init(int argc, char **argv) {
+    int r;
+
     if (mysql_library_init(argc, argv, NULL)) {
         logErr("mysql_library_init error");
         return -1;
     }
 
-    if(!mysql_init(&mySql)) {
-        logErr("mysql_init error");
-        return -2;
-    }
-
-    if(!mysql_real_connect(&mySql, SQL_SERV, SQL_USER, SQL_PASS, SQL_BASE, SQL_PORT, NULL, 0)) {
-        logErr("Connect error: %s", mysql_error(&mySql));
+    pool.conns = calloc(DB_POOL, sizeof(storageConn));
+    pool.count = DB_POOL;
+    // One connection proves settings, rest connect on first use
+    r = storage_connect(&pool.conns[0]);
+    if(r < 0) {
         return -3;
     }
-
+    logInf("Storage pool: %d connections", DB_POOL);
     return 0;
 }
 
 int storage_get_command(int id, adminCommand *pCmd) {
-    MYSQL_RES *res;
-    MYSQL_ROW row;
-    char sql[1024];
+    int r = -ENOENT;
+    storageConn *c;
+    MYSQL_STMT *st;
+    MYSQL_BIND param;
+    storageRow row;
+
     if(!id || !pCmd) return -EINVAL;
+    c = storage_acquire();
+    if(!c) return -ECONNREFUSED;
+
+    param = storage_int(&id);
+    st = storage_exec(c, StmtCommand, &param, true);
+    storage_row_bind(&row, 5, 1);
+    if(!st || mysql_stmt_bind_result(st, row.bind) || mysql_stmt_store_result(st)) {
+        storage_release(c);
+        return -EIO;
+    }
+    r = mysql_stmt_fetch(st);
+    if(r == 0 || r == MYSQL_DATA_TRUNCATED) {
+        *pCmd = (adminCommand){
+            .id = id,
+            .cmd = row.val[0],
+            .obj = strdup(storage_row_obj(&row)),
+            .flags = row.val[1],
+            .usr = row.val[2],
+            .dt = row.val[3],
+            .dt_exec = row.val[4]
+        };
+        logDbg("Command %d has cmd=%d, obj=%s", id, pCmd->cmd, pCmd->obj);
+        r = 0;
+    } else {
+        r = r == MYSQL_NO_DATA ? -ENOENT : -EIO;
+    }
+    mysql_stmt_free_result(st);
+    storage_release(c);
+    return r;
+}
 
-    snprintf(sql, 1024, "SELECT cmd, obj, flags, usr, dt, dt_exec FROM adm_cmd WHERE id=%d", id);
+/**
+ * @brief Adds lease columns to adm_cmd when missing
+ */
+int storage_queue_prepare() {
+    int r = 0;
+    storageConn *c = storage_acquire();
 
-    if(mysql_query(&mySql, sql)) {
-        logErr("Query error: %s", mysql_error(&mySql));
-        return -1;
+    if(!c) return -ECONNREFUSED;
+    if(mysql_query(&c->my, "ALTER TABLE adm_cmd"
+        " ADD COLUMN IF NOT EXISTS node VARCHAR(64) NULL,"
+        " ADD COLUMN IF NOT EXISTS lease INT NOT NULL DEFAULT 0,"
+        " ADD COLUMN IF NOT EXISTS code INT NULL,"
+        " ADD INDEX IF NOT EXISTS adm_cmd_lease (dt_exec, lease)")) {
+        logErr("Query error(%u): %s", mysql_errno(&c->my), mysql_error(&c->my));
+        r = -EIO;
+    }
+    storage_release(c);
+    return r;
+}
+
+/**
+ * @brief Takes up to max pending commands whose lease is free or expired.
+ *        Rows locked by other nodes are skipped, not waited for.
+ * @return claimed count or negative errno, obj of each is malloc'ed
+ */
+int storage_claim(const char *node, int leaseS, adminCommand *cmds, int max) {
+    int n = 0, i, r = 0, f;
+    unsigned long nodeLen;
+    storageConn *c;
+    MYSQL_STMT *st;
+    MYSQL_BIND params[3];
+    storageRow row;
+
+    c = storage_acquire();
+    if(!c) return -ECONNREFUSED;
+    if(mysql_autocommit(&c->my, 0)) {
+        storage_disconnect(c);
+        storage_release(c);
+        return -EIO;
+    }
+    params[0] = storage_int(&max);
+    st = storage_exec(c, StmtClaim, params, false);
+    storage_row_bind(&row, 5, 2);
+    if(!st || mysql_stmt_bind_result(st, row.bind) || mysql_stmt_store_result(st)) {
+        r = -EIO;
+    }
+    while(!r && n < max && ((f = mysql_stmt_fetch(st)) == 0 || f == MYSQL_DATA_TRUNCATED)) {
+        cmds[n++] = (adminCommand){
+            .id = row.val[0],
+            .cmd = row.val[1],
+            .obj = strdup(storage_row_obj(&row)),
+            .flags = row.val[2],
+            .usr = row.val[3],
+            .dt = row.val[4]
+        };
+    }
+    if(st) mysql_stmt_free_result(st);
+
+    for(i = 0; !r && i < n; i++) {
+        params[0] = storage_str(node, &nodeLen);
+        params[1] = storage_int(&leaseS);
+        params[2] = storage_int(&cmds[i].id);
+        if(!storage_exec(c, StmtLease, params, false)) r = -EIO;
+    }
+    if(!r && mysql_commit(&c->my)) r = -EIO;
+    if(r < 0) {
+        mysql_rollback(&c->my);
+        for(i = 0; i < n; i++) free(cmds[i].obj);
+        n = r;
+    }
+    if(mysql_autocommit(&c->my, 1)) storage_disconnect(c);
+    storage_release(c);
+    return n;
+}
+
+/**
+ * @brief Runs lease update
+ * @return 1 when row was changed, 0 when not, negative errno
+ */
+static int storage_update(int stmt, MYSQL_BIND *params) {
+    int r;
+    storageConn *c = storage_acquire();
+    MYSQL_STMT *st;
+
+    if(!c) return -ECONNREFUSED;
+    st = storage_exec(c, stmt, params, true);
+    r = st ? mysql_stmt_affected_rows(st) > 0 : -EIO;
+    storage_release(c);
+    return r;
+}
+
+/**
+ * @brief Extends lease held by node
+ * @return 1 when still held, 0 when lost, negative errno
+ */
+int storage_renew(const char *node, int id, int leaseS) {
+    unsigned long nodeLen;
+    MYSQL_BIND params[3] = { storage_int(&leaseS), storage_int(&id), storage_str(node, &nodeLen) };
+
+    return storage_update(StmtRenew, params);
+}
+
+/**
+ * @brief Marks command executed, or gives lease back when code is
+ *        -EAGAIN so any node may take it again
+ * @return 1 when lease was still held, 0 when lost, negative errno
+ */
+int storage_finish(const char *node, int id, int code) {
+    unsigned long nodeLen;
+    MYSQL_BIND params[3] = { storage_int(&code), storage_int(&id), storage_str(node, &nodeLen) };
+
+    if(code == -EAGAIN) return storage_update(StmtRelease, params + 1);
+    return storage_update(StmtFinish, params);
+}
+
+/* Non-blocking lookups on event loop thread */
+
+static void storage_async_run(int status);
+
+static int storage_async_io_cb(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+    int status = 0;
+
+    if(revents & (EPOLLIN | EPOLLHUP | EPOLLERR)) status |= MYSQL_WAIT_READ;
+    if(revents & EPOLLOUT) status |= MYSQL_WAIT_WRITE;
+    if(revents & EPOLLPRI) status |= MYSQL_WAIT_EXCEPT;
+    async.timeSrc = sd_event_source_disable_unref(async.timeSrc);
+    sd_event_source_set_enabled(async.ioSrc, SD_EVENT_OFF);
+    storage_async_run(status);
+    return 0;
+}
+
+static int storage_async_time_cb(sd_event_source *s, uint64_t usec, void *userdata) {
+    async.timeSrc = sd_event_source_disable_unref(async.timeSrc);
+    sd_event_source_set_enabled(async.ioSrc, SD_EVENT_OFF);
+    storage_async_run(MYSQL_WAIT_TIMEOUT);
+    return 0;
+}
+
+/**
+ * @brief Arms loop sources for what client library waits for
+ */
+static void storage_async_wait(int status) {
+    int r = 0, fd = mysql_get_socket(&async.my);
+    uint32_t events = 0;
+
+    if(status & MYSQL_WAIT_READ) events |= EPOLLIN;
+    if(status & MYSQL_WAIT_WRITE) events |= EPOLLOUT;
+    if(status & MYSQL_WAIT_EXCEPT) events |= EPOLLPRI;
+    if(fd != async.fd) {
+        async.ioSrc = sd_event_source_disable_unref(async.ioSrc);
+        async.fd = fd;
+    }
+    if(!async.ioSrc) {
+        r = sd_event_add_io(loop_event(), &async.ioSrc, fd, events, storage_async_io_cb, NULL);
+    } else {
+        r = sd_event_source_set_io_events(async.ioSrc, events);
+    }
+    if(r >= 0) r = sd_event_source_set_enabled(async.ioSrc, SD_EVENT_ON);
+    if(r >= 0 && (status & MYSQL_WAIT_TIMEOUT)) {
+        r = sd_event_add_time_relative(loop_event(), &async.timeSrc, CLOCK_MONOTONIC
+            , mysql_get_timeout_value_ms(&async.my) * 1000ULL, 0, storage_async_time_cb, NULL);
+    }
+    if(r < 0) logErr("Storage wait source error(%d): %s", r, strerror(-r));
+}
+
+/**
+ * @brief Answers first lookup and moves on to next one
+ */
+static void storage_async_done(int r) {
+    storageReq *req = async.head;
+    adminCommand cmd;
+
+    if(r < 0 && async.up && (!async.stmt || storage_lost(mysql_errno(&async.my)))) {
+        logWrn("Lookup connection lost");
+        if(async.stmt) mysql_stmt_close(async.stmt);
+        mysql_close(&async.my);
+        async.stmt = NULL;
+        async.up = false;
+    }
+    async.state = AsyncIdle;
+    if(!req) return;
+    async.head = req->next;
+    if(!async.head) async.tail = NULL;
+    async.pending--;
+
+    if(r == 0) {
+        cmd = (adminCommand){
+            .id = req->id,
+            .cmd = async.row.val[0],
+            .obj = storage_row_obj(&async.row),
+            .flags = async.row.val[1],
+            .usr = async.row.val[2],
+            .dt = async.row.val[3],
+            .dt_exec = async.row.val[4]
+        };
+        req->func(0, &cmd, req->userdata);
+    } else {
+        req->func(r, NULL, req->userdata);
     }
+    free(req);
+}
+
+/**
+ * @brief Advances lookup state machine. Each step is started once and
+ *        continued with what loop saw on socket until library is done.
+ * @param status 0 to start current step, MYSQL_WAIT_* to continue it
+ */
+static void storage_async_run(int status) {
+    int ret = 0;
+    MYSQL *my = NULL;
+    const confStruct *cf;
+
+    while(1) {
+        switch(async.state) {
+        case AsyncIdle:
+            if(!async.head) return;
+            cf = conf_get();
+            if(async.up && async.gen != cf->dbGen) {
+                mysql_stmt_close(async.stmt);
+                mysql_close(&async.my);
+                async.stmt = NULL;
+                async.up = false;
+            }
+            async.state = async.up ? AsyncExecute : AsyncConnect;
+            if(!async.up) {
+                mysql_init(&async.my);
+                storage_options(&async.my);
+                mysql_options(&async.my, MYSQL_OPT_NONBLOCK, 0);
+                async.conf = cf;
+                async.gen = cf->dbGen;
+            } else {
+                conf_put(cf);
+            }
+            status = 0;
+            continue;
+
+        case AsyncConnect:
+            status = status ? mysql_real_connect_cont(&my, &async.my, status)
+                            : mysql_real_connect_start(&my, &async.my, async.conf->dbServ, async.conf->dbUser
+                                , async.conf->dbPass, async.conf->dbBase, async.conf->dbPort, NULL, 0);
+            if(status) return storage_async_wait(status);
+            conf_put(async.conf);
+            async.conf = NULL;
+            if(!my) {
+                logErr("Lookup connect error: %s", mysql_error(&async.my));
+                mysql_close(&async.my);
+                storage_async_done(-ECONNREFUSED);
+                continue;
+            }
+            async.up = true;
+            async.stmt = mysql_stmt_init(&async.my);
+            if(!async.stmt) {
+                storage_async_done(-ENOMEM);
+                continue;
+            }
+            async.state = AsyncPrepare;
+            continue;
+
+        case AsyncPrepare:
+            status = status ? mysql_stmt_prepare_cont(&ret, async.stmt, status)
+                            : mysql_stmt_prepare_start(&ret, async.stmt, stmtSql[StmtCommand], strlen(stmtSql[StmtCommand]));
+            if(status) return storage_async_wait(status);
+            if(ret) {
+                // Connection is not usable without statement, next lookup starts over
+                logErr("Lookup prepare error(%u): %s", mysql_stmt_errno(async.stmt), mysql_stmt_error(async.stmt));
+                mysql_stmt_close(async.stmt);
+                mysql_close(&async.my);
+                async.stmt = NULL;
+                async.up = false;
+                storage_async_done(-EIO);
+                continue;
+            }
+            async.state = AsyncExecute;
+            continue;
+
+        case AsyncExecute:
+            if(!status) {
+                async.param = async.head->id;
+                async.paramBind = storage_int(&async.param);
+                storage_row_bind(&async.row, 5, 1);
+                if(mysql_stmt_bind_param(async.stmt, &async.paramBind) || mysql_stmt_bind_result(async.stmt, async.row.bind)) {
+                    storage_async_done(-EIO);
+                    continue;
+                }
+            }
+            status = status ? mysql_stmt_execute_cont(&ret, async.stmt, status)
+                            : mysql_stmt_execute_start(&ret, async.stmt);
+            if(status) return storage_async_wait(status);
+            if(ret) {
+                logErr("Lookup error(%u): %s", mysql_stmt_errno(async.stmt), mysql_stmt_error(async.stmt));
+                storage_async_done(-EIO);
+                continue;
+            }
+            async.state = AsyncStore;
+            continue;
+
+        case AsyncStore:
+            status = status ? mysql_stmt_store_result_cont(&ret, async.stmt, status)
+                            : mysql_stmt_store_result_start(&ret, async.stmt);
+            if(status) return storage_async_wait(status);
+            if(ret) {
+                storage_async_done(-EIO);
+                continue;
+            }
+            async.state = AsyncFetch;
+            continue;
 
-    if((res = mysql_store_result(&mySql))) {
-        logDbg("Result has %d fields", mysql_num_fields(res));
-        while((row = mysql_fetch_row(res))) {
-            int i = atoi(row[0]);
-            logDbg("Command %d has cmd=%d [%s], obj=%s", id, i, row[0], row[1]);
+        case AsyncFetch:
+            // Result is stored, fetch does not touch socket
+            ret = mysql_stmt_fetch(async.stmt);
+            mysql_stmt_free_result(async.stmt);
+            storage_async_done(ret == 0 || ret == MYSQL_DATA_TRUNCATED ? 0 : ret == MYSQL_NO_DATA ? -ENOENT : -EIO);
+            continue;
         }
-        mysql_free_result(res);
     }
+}
+
+/**
+ * @brief Looks command up without blocking, func is called on event loop
+ *        thread. obj passed to it is valid during call only.
+ *        Must be called on event loop thread.
+ */
+int storage_get_command_async(int id, storageCommandFunc func, void *userdata) {
+    storageReq *req;
 
+    if(!id || !func) return -EINVAL;
+    if(!pool.count) return -ENOTCONN;
+    if(async.pending >= STORAGE_ASYNC_MAX) return -EBUSY;
+    req = calloc(1, sizeof(storageReq));
+    req->id = id;
+    req->func = func;
+    req->userdata = userdata;
+    if(async.tail) async.tail->next = req;
+    else async.head = req;
+    async.tail = req;
+    async.pending++;
+    if(async.state == AsyncIdle) storage_async_run(0);
     return 0;
 }
 
 void storage_close() {
-    mysql_close(&mySql);
+    int i;
+
+    while(async.head) {
+        async.state = AsyncIdle;
+        storage_async_done(-ECANCELED);
+    }
+    async.ioSrc = sd_event_source_disable_unref(async.ioSrc);
+    async.timeSrc = sd_event_source_disable_unref(async.timeSrc);
+    conf_put(async.conf);
+    async.conf = NULL;
+    if(async.up) {
+        if(async.stmt) mysql_stmt_close(async.stmt);
+        mysql_close(&async.my);
+    }
+    async.up = false;
+
+    pthread_mutex_lock(&pool.lock);
+    for(i = 0; i < pool.count; i++) storage_disconnect(&pool.conns[i]);
+    free(pool.conns);
+    pool.conns = NULL;
+    pool.count = 0;
+    pthread_mutex_unlock(&pool.lock);
     mysql_library_end();
 }
-
@@ -1,207 +1,1186 @@
+#define LOG_MODULE  LOG_MOD_SYS
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/sendfile.h>
+#include <time.h>
 #include <unistd.h>
 
 #define EXEC_PATH_SZ    512
-#define TAIL_CMD_SZ     64
-#define CMD_OUTPUT_SZ   2000
+#define EXEC_ARGS_MAX   1024
+#define CMD_OUTPUT_SZ   2000    // Larger output is sent as document
+#define PROGRESS_SZ     512     // Output tail in progress message
 #define MSG_SZ          2048
+#define DOC_LINK_TRIES  16
+
+#define EXPORT_SHARDS_MAX   64
+
+#define PULL_REV_SZ     72
+#define PULL_PATHS_SZ   (1024 * 1024)   // Changed path list kept, larger means everything changed
+
+#define GIT_BIN         "/usr/bin/git"
+
+#include <jansson.h>
 
 #include "config.h"
 #include "main.h"
 #include "debug.h"
 #include "report.h"
+#include "pool.h"
+#include "proc.h"
+#include "fcgi.h"
+#include "job.h"
+#include "loop.h"
+#include "bus.h"
+#include "tail.h"
+#include "command.h"
+#include "conf.h"
 #include "sys.h"
 
 #define ExecDoc     0x1
+#define ExecCapture 0x2
+#define ExecLive    0x4     // Live progress message while running
+#define ExecPhp     0x8     // PHP script, may run in FastCGI pool
+#define ExecCache   0x10    // Result is kept for job_cache_ttl
 
-typedef struct execStructS {
+// Export split into shard jobs, last finished shard merges results
+typedef struct execBatchS {
+    uint32_t chat;
+    int shards;
+    int orders;
+    atomic_int left;
+    atomic_int failed;
+    atomic_uint_fast64_t cpuUs;
+    atomic_uint_fast64_t bytes;
+    uint64_t start;             // us, CLOCK_MONOTONIC
+    ReportLive *live;
+    job *job;
+} execBatch;
+
+// Chat attached to a job started by someone else
+typedef struct execWaiterS {
+    struct execWaiterS *next;
+    uint32_t chat;
+    uint32_t respTo;
+} execWaiter;
+
+// Job in flight, or its cached result for job_cache_ttl once finished
+typedef struct execFlightS {
+    struct execFlightS *next;
+    char *key;                  // Command line, args normalised by caller
+    uint64_t jobId;
+    int refs;                   // List and job
+    execWaiter *waiters;
+    bool done;
+    bool cache;                 // Result may be kept once done
+    bool stale;                 // Script changed while running, result is not kept
+    uint64_t expires;           // us, CLOCK_MONOTONIC
+    char *msg;                  // Final report
+    char doc[EXEC_PATH_SZ];     // and document sent with it
+    char title[64];
+} execFlight;
+
+typedef struct execStructS execStruct;
+typedef void (*execRunFunc)(execStruct *es);
+
+struct execStructS {
     uint32_t chat;
     uint32_t respTo;
     uint8_t flag;
     char title[64];
-    char path[EXEC_PATH_SZ];
+    char cwd[EXEC_PATH_SZ];
+    char out[EXEC_PATH_SZ];
     char doc[EXEC_PATH_SZ];
-} execStruct;
+    ReportLive *live;
+    execBatch *batch;
+    execFlight *flight;
+    job *job;                   // Shards share batch job
+    execRunFunc run;            // Runs instead of argv and reports itself,
+                                // argv stays single flight key
+    unsigned timeoutS;          // 0 = job_timeout
+    commandClass *cls;          // Concurrency class, NULL = unlimited
+    int argc;
+    char *argv[EXEC_ARGS_MAX + 1];
+};
 
-typedef struct tgDataS {
-    uint32_t chat;
-} tgData;
+// Called for every path changed by pull that matches pattern,
+// NULL path when change list was too long to tell
+typedef void (*pullHookFunc)(const char *path);
 
-static void* exec_thread(void *pData) {
-    static char msg[MSG_SZ];
-    execStruct *pStr = (execStruct*)pData;
+typedef struct pullHookS {
+    const char *pattern;        // fnmatch, repository relative
+    pullHookFunc func;
+} pullHook;
 
-    if(system(pStr->path) < 0) {
-        snprintf(msg, MSG_SZ, "🛑 Execute %s error(%d): %m", pStr->title, errno);
-        logErr(msg);
-        send_report(pStr->chat, msg, pStr->respTo);
+// Published on event loop thread
+typedef struct pullEventS {
+    uint64_t id;
+    char from[PULL_REV_SZ];
+    char to[PULL_REV_SZ];
+    char **paths;               // NULL terminated, point into data
+    char *data;
+} pullEvent;
+
+// Paths, overridden from command line
+const char *gScriptsPath = SCRIPTS_PATH;
+const char *gOutPath = OUT_PATH;
+const char *gPhpLog = PHP_LOG;
+
+// Local variables
+static pthread_mutex_t flightLock = PTHREAD_MUTEX_INITIALIZER;
+static execFlight *flights = NULL;
+
+static execStruct *exec_new(uint32_t chat, const char *title) {
+    execStruct *es = calloc(1, sizeof(execStruct));
+    es->chat = chat;
+    snprintf(es->title, sizeof(es->title), "%s", title);
+    return es;
+}
+
+static void exec_free(execStruct *es) {
+    int i;
+    for(i = 0; i < es->argc; i++) {
+        free(es->argv[i]);
     }
-    if (pStr->flag & ExecDoc) {
-        send_document(pStr->chat, pStr->doc, pStr->title, pStr->respTo);
+    free(es);
+}
+
+/**
+ * @brief Appends formatted argument to command line, no shell involved
+ */
+static int exec_arg(execStruct *es, const char *fmt, ...) {
+    int r;
+    va_list ap;
+    if(es->argc >= EXEC_ARGS_MAX) return -E2BIG;
+    va_start(ap, fmt);
+    r = vasprintf(&es->argv[es->argc], fmt, ap);
+    va_end(ap);
+    if(r < 0) return -ENOMEM;
+    es->argc++;
+    return 0;
+}
+
+/**
+ * @brief Runs on event loop thread, at most once per tg_progress ms
+ */
+static void exec_progress(procOutput *out, void *userdata) {
+    char msg[MSG_SZ], tail[PROGRESS_SZ];
+    execStruct *pStr = (execStruct*)userdata;
+
+    proc_output_tail(out, tail, sizeof(tail));
+    snprintf(msg, MSG_SZ, "⏳ %s 🔹%zu\n%s", pStr->title, out->bytes, tail);
+    report_live_update(pStr->live, msg);
+}
+
+static void exec_report(execStruct *pStr, const char *msg) {
+    if(pStr->live) {
+        report_live_close(pStr->live, msg);
+        pStr->live = NULL;
     } else {
-        snprintf(msg, MSG_SZ, "✅ Execute %s done", pStr->title);
-        send_report(pStr->chat, msg, pStr->respTo);
+        send_report(pStr->chat, (char*)msg, pStr->respTo);
+    }
+}
+
+static uint64_t exec_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Inserts id before extension: out/clear.log -> out/clear_17.log
+ */
+static void exec_id_path(char *path, size_t sz, uint64_t id) {
+    char ext[EXEC_PATH_SZ];
+    char *dot = strrchr(path, '.'), *slash = strrchr(path, '/');
+
+    if(!dot || (slash && dot < slash)) dot = path + strlen(path);
+    snprintf(ext, sizeof(ext), "%s", dot);
+    snprintf(dot, sz - (dot - path), "_%lu%s", id, ext);
+}
+
+/**
+ * @brief Job output goes to file of its own, so it is never rewritten by
+ *        next job while upload is pending. Leftover of run before restart
+ *        may still be linked by spooled upload, new file is created.
+ */
+static void exec_own_out(execStruct *es) {
+    exec_id_path(es->out, sizeof(es->out), job_id(es->job));
+    unlink(es->out);
+}
+
+/**
+ * @brief Copies document written by script, which may rewrite it any time
+ * @return 0 or negative errno
+ */
+static int exec_copy(const char *from, const char *to) {
+    int in, out, r = 0;
+    ssize_t n;
+
+    in = open(from, O_RDONLY | O_CLOEXEC);
+    if(in < 0) return -errno;
+    unlink(to);
+    out = open(to, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if(out < 0) {
+        r = -errno;
+        close(in);
+        return r;
+    }
+    while((n = sendfile(out, in, NULL, 1 << 20)) > 0);
+    if(n < 0) r = -errno;
+    close(in);
+    close(out);
+    if(r < 0) unlink(to);
+    return r;
+}
+
+/**
+ * @brief Sends job document as link of its own, removed by sender once
+ *        final. Job file stays for other recipients and cache.
+ */
+static void exec_send_doc(uint32_t chat, const char *doc, const char *title, uint32_t respTo) {
+    static atomic_uint seq;
+    char path[EXEC_PATH_SZ];
+    int i;
+
+    for(i = 0; i < DOC_LINK_TRIES; i++) {
+        snprintf(path, sizeof(path), "%s", doc);
+        exec_id_path(path, sizeof(path), atomic_fetch_add(&seq, 1) + 1);
+        // Taken name may be pending upload spooled before restart
+        if(link(doc, path) == 0) {
+            send_temp_document(chat, path, (char*)title, respTo);
+            return;
+        }
+        if(errno != EEXIST) break;
+    }
+    logErr("Document %s link error(%d): %s", doc, errno, strerror(errno));
+}
+
+/**
+ * @brief Shard output prefix given to script, it writes <prefix>.json and
+ *        <prefix>.pretty.json like the single order export. Named after
+ *        batch job, so concurrent exports never share files
+ */
+static void exec_shard_path(char *buf, size_t sz, uint64_t id, int shard, const char *ext) {
+    snprintf(buf, sz, "%s/export_%lu_%d%s", gOutPath, id, shard, ext);
+}
+
+/**
+ * @brief Merges shard results: arrays are concatenated in shard order,
+ *        objects are united
+ * @return merged document or NULL, failed shard count is added to bad
+ */
+static json_t *exec_batch_merge(uint64_t id, int shards, int *bad) {
+    int i;
+    char path[EXEC_PATH_SZ];
+    json_t *all = NULL, *part;
+    json_error_t err;
+
+    for(i = 0; i < shards; i++) {
+        exec_shard_path(path, sizeof(path), id, i, ".json");
+        part = json_load_file(path, 0, &err);
+        unlink(path);
+        exec_shard_path(path, sizeof(path), id, i, ".pretty.json");
+        unlink(path);
+        if(!part) {
+            logErr("Export shard %d load error: %s", i, err.text);
+            (*bad)++;
+        } else if(!all) {
+            all = part;
+        } else if(json_is_array(all) && json_is_array(part)) {
+            json_array_extend(all, part);
+            json_decref(part);
+        } else if(json_is_object(all) && json_is_object(part)) {
+            json_object_update(all, part);
+            json_decref(part);
+        } else {
+            logErr("Export shard %d type mismatch", i);
+            json_decref(part);
+            (*bad)++;
+        }
+    }
+    return all;
+}
+
+/**
+ * @brief Called once per shard, last one uploads merged export
+ */
+static void exec_batch_done(execBatch *eb, bool failed, const procResult *res) {
+    char msg[MSG_SZ], path[EXEC_PATH_SZ];
+    int left, bad;
+    json_t *all;
+
+    atomic_fetch_add(&eb->cpuUs, res->cpuUserUs + res->cpuSysUs);
+    atomic_fetch_add(&eb->bytes, res->bytes);
+    if(failed) atomic_fetch_add(&eb->failed, 1);
+    left = atomic_fetch_sub(&eb->left, 1) - 1;
+    if(left > 0) {
+        snprintf(msg, MSG_SZ, "⏳ Export %d orders: %d/%d shards done", eb->orders, eb->shards - left, eb->shards);
+        report_live_update(eb->live, msg);
+        return;
+    }
+
+    bad = atomic_load(&eb->failed);
+    all = exec_batch_merge(job_id(eb->job), eb->shards, &bad);
+    snprintf(path, sizeof(path), "%s/export_%lu.pretty.json", gOutPath, job_id(eb->job));
+    if(all && json_dump_file(all, path, JSON_INDENT(4)) < 0) {
+        logErr("Export %s write error", path);
+        unlink(path);
+        json_decref(all);
+        all = NULL;
+    }
+    if(bad > eb->shards) bad = eb->shards;
+
+    snprintf(msg, MSG_SZ, "%s Export %d orders: %d/%d shards%s ⏱ %.1fs, cpu %.1fs"
+        , all ? "✅" : "🛑", eb->orders, eb->shards - bad, eb->shards, bad ? " ⚠️" : ""
+        , (exec_now() - eb->start) / 1e6, atomic_load(&eb->cpuUs) / 1e6);
+    logInf("%s", msg);
+    if(eb->live) report_live_close(eb->live, msg);
+    else send_report(eb->chat, msg, 0);
+    if(all) {
+        send_temp_document(eb->chat, path, "export", 0);
+        json_decref(all);
     }
+    job_done(eb->job, all ? bad : eb->shards, atomic_load(&eb->bytes));
+    free(eb);
+}
+
+/**
+ * @brief References are held by list, submitter and job.
+ *        Called with flightLock held.
+ */
+static void exec_flight_unref(execFlight *f) {
+    execWaiter *w;
+
+    if(--f->refs > 0) return;
+    while((w = f->waiters)) {
+        f->waiters = w->next;
+        free(w);
+    }
+    if(f->doc[0]) unlink(f->doc);
+    free(f->key);
+    free(f->msg);
+    free(f);
+}
+
+/**
+ * @brief Removes finished job from list. Called with flightLock held.
+ */
+static void exec_flight_drop(execFlight *f) {
+    execFlight **it;
+
+    for(it = &flights; *it; it = &(*it)->next) {
+        if(*it == f) {
+            *it = f->next;
+            exec_flight_unref(f);
+            return;
+        }
+    }
+}
 
-    free(pData);
+/**
+ * @brief Looks job up by key, dropping expired results on the way.
+ *        Called with flightLock held.
+ */
+static execFlight *exec_flight_find(const char *key, uint64_t now) {
+    execFlight **it = &flights, *f;
+
+    while((f = *it)) {
+        if(f->done && f->expires <= now) {
+            *it = f->next;
+            exec_flight_unref(f);
+            continue;
+        }
+        if(strcmp(f->key, key) == 0) return f;
+        it = &f->next;
+    }
     return NULL;
 }
 
-static void do_pull(tgData *pTg) {
-    static char msg[MSG_SZ];
-    static char buf[CMD_OUTPUT_SZ];
-    int r = chdir(GIT_PATH);
-    if(r < 0) {
-        snprintf(msg, MSG_SZ, "🛑 Pull cd error(%d): %m", errno);
-        logErr(msg);
+/**
+ * @brief Delivers final report to attached chats, keeps successful
+ *        result of cacheable command for job_cache_ttl
+ */
+static void exec_flight_done(execFlight *f, const char *msg, const char *doc, bool ok) {
+    char title[sizeof(f->title)];
+    execWaiter *w, *waiters;
+    bool keep;
+    const confStruct *c = conf_get();
+    uint64_t ttl = c->jobCacheTtlS;
+
+    conf_put(c);
+    pthread_mutex_lock(&flightLock);
+    keep = ok && f->cache && ttl > 0 && !f->stale;
+    waiters = f->waiters;
+    f->waiters = NULL;
+    strcpy(title, f->title);
+    if(keep) {
+        f->done = true;
+        f->expires = exec_now() + ttl * 1000000ULL;
+        f->msg = strdup(msg);
+        snprintf(f->doc, sizeof(f->doc), "%s", doc ? doc : "");
     } else {
-        FILE *p = popen("git pull", "r");
-        if(p) {
-            memset(buf, 0, CMD_OUTPUT_SZ);
-            size_t sz = fread(buf, CMD_OUTPUT_SZ, 1, p);
-            if(sz == 0 && feof(p)) {
-                sz = strlen(buf);
-            }
-            logDbg("RET(%ld): %s", sz, buf);
-            if(sz) {
-                snprintf(msg, MSG_SZ, "✅ Pull 🔹%ld\n```\n%s```", sz, buf);
-            } else {
-                snprintf(msg, MSG_SZ, "🛑 Pull error(%d): %m", errno);
-            }
-            pclose(p);
-        } else {
-            int err = errno;
-            logErr("Pull error(%d): %s", err, strerror(err));
-            snprintf(msg, MSG_SZ, "🛑 ERR(%d): %s", err, strerror(err));
+        exec_flight_drop(f);
+    }
+    exec_flight_unref(f);
+    pthread_mutex_unlock(&flightLock);
+
+    while((w = waiters)) {
+        waiters = w->next;
+        send_report(w->chat, (char*)msg, w->respTo);
+        if(doc) exec_send_doc(w->chat, doc, title, w->respTo);
+        free(w);
+    }
+    // Kept one is removed with cache entry
+    if(doc && !keep) unlink(doc);
+}
+
+/**
+ * @brief Single flight: same command line already running gets one more
+ *        recipient, recently finished one answers from cache. Otherwise
+ *        job is registered for es.
+ * @return true when request was served this way (es is freed)
+ */
+static bool exec_flight_join(execStruct *es, uint64_t *id) {
+    int i;
+    size_t len = 0;
+    char *key, msg[MSG_SZ];
+    execFlight *f;
+    execWaiter *w;
+
+    len = strlen(es->cwd) + 1;
+    for(i = 0; i < es->argc; i++) len += strlen(es->argv[i]) + 1;
+    key = malloc(len + 1);
+    strcpy(key, es->cwd);
+    for(i = 0; i < es->argc; i++) {
+        strcat(key, "\n");
+        strcat(key, es->argv[i]);
+    }
+
+    pthread_mutex_lock(&flightLock);
+    f = exec_flight_find(key, exec_now());
+    if(f && f->done && es->chat == QUEUE_CHAT) {
+        // Shared queue records result of job it started, cached job may
+        // already be gone from history; fresh result replaces cached one
+        exec_flight_drop(f);
+        f = NULL;
+    }
+    if(!f) {
+        f = calloc(1, sizeof(execFlight));
+        es->job = job_new(es->title, es->chat);
+        f->key = key;
+        f->refs = 2;
+        f->jobId = *id = job_id(es->job);
+        f->cache = es->flag & ExecCache;
+        snprintf(f->title, sizeof(f->title), "%s", es->title);
+        f->next = flights;
+        flights = f;
+        es->flight = f;
+        pthread_mutex_unlock(&flightLock);
+        return false;
+    }
+    free(key);
+    *id = f->jobId;
+
+    if(f->done) {
+        snprintf(msg, MSG_SZ, "%s\n♻️ cached", f->msg);
+        if(f->doc[0]) exec_send_doc(es->chat, f->doc, f->title, es->respTo);
+    } else {
+        w = calloc(1, sizeof(execWaiter));
+        w->chat = es->chat;
+        w->respTo = es->respTo;
+        w->next = f->waiters;
+        f->waiters = w;
+        snprintf(msg, MSG_SZ, "🔗 %s is already running, result will follow", es->title);
+    }
+    pthread_mutex_unlock(&flightLock);
+
+    logInf("%s joined job %lu", es->title, *id);
+    send_report(es->chat, msg, es->respTo);
+    exec_free(es);
+    return true;
+}
+
+/**
+ * @brief Pull hook: cached results of commands running changed script are
+ *        dropped, running ones will not be cached
+ */
+static void exec_flight_forget(const char *path) {
+    char needle[EXEC_PATH_SZ];
+    execFlight **it = &flights, *f;
+
+    snprintf(needle, sizeof(needle), "/%s", path ? path : "");
+    pthread_mutex_lock(&flightLock);
+    while((f = *it)) {
+        if(path && !strstr(f->key, needle)) {
+            it = &f->next;
+            continue;
         }
+        if(!f->done) {
+            f->stale = true;
+            it = &f->next;
+            continue;
+        }
+        logDbg("Cached %s dropped, %s changed", f->title, path ? path : "everything");
+        *it = f->next;
+        exec_flight_unref(f);
     }
-    send_report(pTg->chat, msg, 0);
+    pthread_mutex_unlock(&flightLock);
+}
+
+static void exec_spawned(pid_t pid, bool running, void *userdata) {
+    job_pid((job*)userdata, pid, running);
 }
 
-int sys_run_command(char *cmd, uint32_t chat) {
+static bool exec_cancelled(void *userdata) {
+    return job_cancelled((job*)userdata);
+}
+
+static void exec_job(execStruct *pStr) {
+    char msg[MSG_SZ], st[64], use[80], path[EXEC_PATH_SZ];
+    char out[CMD_OUTPUT_SZ];
+    procOptions opt = {0};
+    procOutput output;
+    procResult res;
+    bool failed, spilled, quiet = false;
+    const char *doc = NULL;
+    const confStruct *c;
     int r;
-    pthread_t th;
-    execStruct *es = calloc(1, sizeof(execStruct));
 
-    es->chat = chat;
-    if(strcmp(cmd, "geos") == 0) {
-        sprintf(es->title, "geos");
-        snprintf(es->path, EXEC_PATH_SZ, "%s/load/gps_resources.php > %s/gps_resources.log", SCRIPTS_PATH, OUT_PATH);
-        r = pthread_create(&th, NULL, exec_thread, es);
-        if (r != 0) {
-            logErr("GeoFences thread creation failed(%d): %s", r, strerror(abs(r)));
-            return 0;
+    log_set_chat(pStr->chat);
+    log_set_job(job_id(pStr->job));
+    if(!job_start(pStr->job)) {
+        logInf("%s cancelled while queued", pStr->title);
+        res = (procResult){ .error = ECANCELED };
+        if(pStr->batch) {
+            exec_batch_done(pStr->batch, true, &res);
+        } else {
+            snprintf(msg, MSG_SZ, "⛔ Execute %s cancelled", pStr->title);
+            send_report(pStr->chat, msg, pStr->respTo);
+            if(pStr->flight) exec_flight_done(pStr->flight, msg, NULL, false);
+            job_done(pStr->job, -ECANCELED, 0);
         }
-    } else if(strcmp(cmd, "cars") == 0) {
-        sprintf(es->title, "cars");
-        snprintf(es->path, EXEC_PATH_SZ, "%s/load/gps_items.php > %s/gps_items.log", SCRIPTS_PATH, OUT_PATH);
-        r = pthread_create(&th, NULL, exec_thread, es);
-        if (r != 0) {
-            logErr("Cars thread creation failed(%d): %s", r, strerror(abs(r)));
-            return 0;
+        exec_free(pStr);
+        return;
+    }
+    if(pStr->run) {
+        pStr->run(pStr);
+        exec_free(pStr);
+        return;
+    }
+    if(pStr->out[0]) exec_own_out(pStr);
+    opt.spawned = exec_spawned;
+    opt.cancelled = exec_cancelled;
+    opt.userdata = pStr->job;
+    opt.timeoutS = pStr->timeoutS;
+    if(pStr->cwd[0]) opt.cwd = pStr->cwd;
+    if(proc_output_init(&output, CMD_OUTPUT_SZ, pStr->out[0] ? pStr->out : NULL) == 0) {
+        opt.output = &output;
+    } else if(pStr->out[0]) {
+        opt.outFile = pStr->out;
+    }
+
+    if(opt.output && (pStr->flag & ExecLive)) {
+        snprintf(msg, MSG_SZ, "⏳ %s", pStr->title);
+        pStr->live = report_live_open(pStr->chat, msg, pStr->respTo);
+        if(pStr->live) {
+            output.progress = exec_progress;
+            output.userdata = pStr;
+            c = conf_get();
+            output.progressUs = c->tgProgressMs * 1000ULL;
+            conf_put(c);
+        }
+    }
+
+    if(PHP_FCGI && (pStr->flag & ExecPhp)) {
+        r = fcgi_run(pStr->argv, &opt, &res);
+        if(r == -ENOENT || r == -ECONNREFUSED) {
+            logWrn("PHP pool unavailable, %s runs standalone", pStr->title);
+            r = proc_run(pStr->argv, &opt, &res);
         }
     } else {
-        logErr("Unknown command [%s]", cmd);
+        r = proc_run(pStr->argv, &opt, &res);
+    }
+    failed = r < 0 || res.code != 0;
+    use[0] = out[0] = 0;
+    if(!res.error) {
+        strcpy(use, " ⏱ ");
+        proc_usage(&res, use + strlen(use), sizeof(use) - strlen(use));
+    }
+    if(opt.output) {
+        proc_output_tail(&output, out, sizeof(out));
+        spilled = output.spillFd >= 0;
+        proc_output_free(&output);
+    } else {
+        spilled = false;
     }
-    return (int)th;
-}
 
-int sys_tail(int count, uint32_t chat) {
-    static char cmd[TAIL_CMD_SZ];
-    static char buf[CMD_OUTPUT_SZ];
-    static char msg[MSG_SZ];
-    if(count < 1) count = 1;
-    snprintf(cmd, TAIL_CMD_SZ, "tail -n %d %s", count, PHP_LOG);
-    logDbg("CMD: %s", cmd);
-    FILE *p = popen(cmd, "r");
-    if(p) {
-        memset(buf, 0, CMD_OUTPUT_SZ);
-        size_t sz = fread(buf, CMD_OUTPUT_SZ, 1, p);
-        if(sz == 0 && feof(p)) {
-            sz = strlen(buf);
-        }
-        logDbg("RET(%ld): %s", sz, buf);
-        if(sz) {
-            snprintf(msg, MSG_SZ, "✅ Tail 🔸%d\n```\n%s```", count, buf);
+    if(pStr->batch) {
+        if(failed) {
+            logErr("Execute %s failed: %s\n%s", pStr->title, proc_status(&res, st, sizeof(st)), out);
+        }
+        exec_batch_done(pStr->batch, failed, &res);
+        exec_free(pStr);
+        return;
+    }
+
+    if(failed) {
+        if(out[0]) {
+            snprintf(msg, MSG_SZ, "🛑 Execute %s failed: %s%s\n```\n%s```", pStr->title, proc_status(&res, st, sizeof(st)), use, out);
         } else {
-            snprintf(msg, MSG_SZ, "🛑 ERR(%d): %m", errno);
+            snprintf(msg, MSG_SZ, "🛑 Execute %s failed: %s%s", pStr->title, proc_status(&res, st, sizeof(st)), use);
         }
-        pclose(p);
+        logErr("Execute %s failed: %s", pStr->title, st);
+    } else if (pStr->flag & ExecDoc) {
+        snprintf(msg, MSG_SZ, "✅ Execute %s done%s", pStr->title, use);
+        snprintf(path, sizeof(path), "%s", pStr->doc);
+        exec_id_path(path, sizeof(path), job_id(pStr->job));
+        r = exec_copy(pStr->doc, path);
+        if(r == 0) doc = path;
+        else logErr("Execute %s document %s error(%d): %s", pStr->title, pStr->doc, r, strerror(-r));
+        quiet = !pStr->live;
+    } else if (res.bytes >= CMD_OUTPUT_SZ && spilled) {
+        logDbg("RET(%lu): %s", res.bytes, pStr->out);
+        snprintf(msg, MSG_SZ, "✅ %s 🔹%lu, output attached%s", pStr->title, res.bytes, use);
+        doc = pStr->out;
+    } else if (res.bytes || (pStr->flag & ExecCapture)) {
+        logDbg("RET(%lu): %s", res.bytes, out);
+        snprintf(msg, MSG_SZ, "✅ %s 🔹%lu%s\n```\n%s```", pStr->title, res.bytes, use, out);
     } else {
-        int err = errno;
-        logErr("Tail error(%d): %s", err, strerror(err));
-        snprintf(msg, MSG_SZ, "🛑 ERR(%d): %s", err, strerror(err));
+        snprintf(msg, MSG_SZ, "✅ Execute %s done%s", pStr->title, use);
+    }
+
+    if(!quiet) exec_report(pStr, msg);
+    if(doc) exec_send_doc(pStr->chat, doc, pStr->title, pStr->respTo);
+    if(pStr->out[0] && doc != pStr->out) unlink(pStr->out);
+    if(pStr->flight) exec_flight_done(pStr->flight, msg, doc, !failed);
+    else if(doc) unlink(doc);
+    job_done(pStr->job, !failed ? 0 : res.error ? -res.error : res.code, res.bytes);
+
+    exec_free(pStr);
+}
+
+/**
+ * @brief Pool job, holds slot of its command class (see exec_submit)
+ */
+static void* exec_thread(void *pData) {
+    commandClass *cls = ((execStruct*)pData)->cls;
+
+    exec_job(pData);
+    command_class_leave(cls);
+    return NULL;
+}
+
+/**
+ * @brief Fails job that never reached pool
+ */
+static void exec_reject(execStruct *es, int r) {
+    char msg[MSG_SZ];
+
+    logErr("%s job submit failed(%d): %s", es->title, r, strerror(abs(r)));
+    if(es->flight) {
+        snprintf(msg, MSG_SZ, "🛑 Execute %s failed: %s", es->title, strerror(abs(r)));
+        exec_flight_done(es->flight, msg, NULL, false);
+    }
+    if(!es->batch) job_done(es->job, r, 0);
+    exec_free(es);
+}
+
+/**
+ * @brief Submits job parked by full class, slot is already taken
+ */
+static bool exec_class_run(void *userdata) {
+    int r = pool_submit(exec_thread, userdata);
+
+    if(r < 0) exec_reject(userdata, r);
+    return r >= 0;
+}
+
+/**
+ * @brief Queues job, or joins identical one (see exec_flight_join)
+ * @return job id, 0 when job was rejected
+ */
+static uint64_t exec_submit(execStruct *es) {
+    int r;
+    uint64_t id = 0;
+    commandClass *cls = es->cls;
+    job *j;
+
+    if(!es->batch && exec_flight_join(es, &id)) {
+        return id;
+    }
+    j = es->job;
+    // Full class keeps job until slot is left, worker never waits for it
+    if(!command_class_enter(cls, exec_class_run, es)) {
+        return id ? id : job_id(j);
+    }
+    r = pool_submit(exec_thread, es);
+    if (r < 0) {
+        exec_reject(es, r);
+        command_class_leave(cls);
+        return 0;
+    }
+    return id ? id : job_id(j);
+}
+
+/**
+ * @brief Expands {script} {scripts} {out} {chat} in command template
+ */
+static int exec_template(char *buf, size_t sz, const char *tmpl, const commandDef *def, uint32_t chat) {
+    size_t n = 0;
+    int r;
+    const char *end;
+
+    buf[0] = 0;
+    for(; *tmpl && n < sz; tmpl++) {
+        end = *tmpl == '{' ? strchr(tmpl, '}') : NULL;
+        if(!end) {
+            buf[n++] = *tmpl;
+            continue;
+        }
+        if(!strncmp(tmpl, "{script}", end - tmpl + 1)) r = snprintf(buf + n, sz - n, "%s", def->script);
+        else if(!strncmp(tmpl, "{scripts}", end - tmpl + 1)) r = snprintf(buf + n, sz - n, "%s", gScriptsPath);
+        else if(!strncmp(tmpl, "{out}", end - tmpl + 1)) r = snprintf(buf + n, sz - n, "%s", gOutPath);
+        else if(!strncmp(tmpl, "{chat}", end - tmpl + 1)) r = snprintf(buf + n, sz - n, "%u", chat);
+        else {
+            buf[n++] = *tmpl;
+            continue;
+        }
+        n += r;
+        tmpl = end;
     }
-    send_report(chat, msg, 0);
+    if(n >= sz) return -E2BIG;
+    buf[n] = 0;
     return 0;
 }
 
-int sys_pull(uint32_t chat) {
-    static tgData tg;
-    pid_t child;
+/**
+ * @brief Runs command from commands file (see command_load)
+ */
+uint64_t sys_run_command(char *cmd, uint32_t chat) {
+    int r = 0;
+    char arg[EXEC_PATH_SZ];
+    char **a;
+    const commandDef *def;
+    commandTable *t = command_table_get();
+    execStruct *es;
 
-    tg.chat = chat;
-    if((child = fork()) < 0) {
-        logErr("Pull thread failed(%d): %m", errno);
+    def = command_find(t, cmd);
+    if(!def) {
+        command_table_put(t);
+        logErr("Unknown command [%s]", cmd);
         return 0;
-    } else if (child == 0) {
-        do_pull(&tg);
-        exit(0);
     }
-    return child;
+    es = exec_new(chat, def->name);
+    for(a = def->args; *a && r == 0; a++) {
+        r = exec_template(arg, sizeof(arg), *a, def, chat);
+        if(r == 0) r = exec_arg(es, "%s", arg);
+    }
+    if(r == 0 && def->output) snprintf(es->out, EXEC_PATH_SZ, "%s/%s", gOutPath, def->output);
+    if(r == 0 && def->document) {
+        snprintf(es->doc, EXEC_PATH_SZ, "%s/%s", gOutPath, def->document);
+        es->flag |= ExecDoc;
+    }
+    if(def->capture) es->flag |= ExecCapture;
+    if(def->live) es->flag |= ExecLive;
+    if(def->php) es->flag |= ExecPhp;
+    if(def->cache) es->flag |= ExecCache;
+    es->timeoutS = def->timeoutS;
+    es->cls = def->cls;
+    command_table_put(t);
+    if(r < 0) {
+        logErr("Command %s args error(%d): %s", cmd, r, strerror(-r));
+        exec_free(es);
+        return 0;
+    }
+    return exec_submit(es);
+}
+
+/**
+ * @brief Copies tail of PHP log to es->out, runs as pool job. Log is read
+ *        in place (see tail_read), no process is spawned.
+ */
+static void tail_run(execStruct *es) {
+    char msg[MSG_SZ], buf[CMD_OUTPUT_SZ];
+    const char *doc = NULL;
+    int fd, count = atoi(es->argv[1]);
+    ssize_t n;
+    uint64_t start = exec_now();
+
+    exec_own_out(es);
+    fd = open(es->out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) logWrn("Tail output %s open error(%d): %s", es->out, errno, strerror(errno));
+    n = tail_read(gPhpLog, count, fd, buf, sizeof(buf));
+    if(fd >= 0) close(fd);
+    logDbg("Tail %d of %s: %zd bytes in %luus", count, gPhpLog, n, exec_now() - start);
+
+    if(n < 0) {
+        logErr("Tail %s error(%zd): %s", gPhpLog, n, strerror(-n));
+        snprintf(msg, MSG_SZ, "🛑 Execute %s failed: %s", es->title, strerror(-n));
+    } else if(n >= CMD_OUTPUT_SZ && fd >= 0) {
+        snprintf(msg, MSG_SZ, "✅ %s 🔹%zd, output attached", es->title, n);
+        doc = es->out;
+    } else {
+        snprintf(msg, MSG_SZ, "✅ %s 🔹%zd\n```\n%s```", es->title, n, buf);
+    }
+    exec_report(es, msg);
+    if(doc) exec_send_doc(es->chat, doc, es->title, es->respTo);
+    else unlink(es->out);
+    // Log keeps growing, never answered from cache
+    exec_flight_done(es->flight, msg, doc, false);
+    job_done(es->job, n < 0 ? n : 0, n < 0 ? 0 : n);
+}
+
+uint64_t sys_tail(int count, uint32_t chat) {
+    char title[32];
+    execStruct *es;
+
+    if(count < 1) count = 1;
+    snprintf(title, sizeof(title), "Tail 🔸%d", count);
+    es = exec_new(chat, title);
+    snprintf(es->out, EXEC_PATH_SZ, "%s/tail_%u.log", gOutPath, chat);
+    es->run = tail_run;
+    exec_arg(es, "tail");
+    exec_arg(es, "%d", count);
+    return exec_submit(es);
+}
+
+// Run for paths changed by pull, in order
+static const pullHook pullHooks[] = {
+    { "*.php",  exec_flight_forget },
+};
+
+/**
+ * @brief Runs git in GIT_PATH as part of pull job
+ * @return 0 on success, exit code or negative errno
+ */
+static int pull_git(execStruct *es, procOutput *out, procResult *res, ...) {
+    int r, argc = 0;
+    char *argv[16];
+    va_list ap;
+    procOptions opt = {
+        .cwd = GIT_PATH,
+        .output = out,
+        .spawned = exec_spawned,
+        .userdata = es->job
+    };
+
+    argv[argc++] = GIT_BIN;
+    va_start(ap, res);
+    while(argc < 15 && (argv[argc] = va_arg(ap, char*))) argc++;
+    va_end(ap);
+    argv[argc] = NULL;
+
+    r = proc_run(argv, &opt, res);
+    return r < 0 ? r : res->error ? -res->error : res->signal ? -EINTR : res->code;
+}
+
+/**
+ * @brief Resolves revision to commit hash
+ */
+static int pull_rev(execStruct *es, const char *rev, char *buf, size_t sz) {
+    int r;
+    size_t n;
+    procOutput out;
+    procResult res;
+    char arg[64];
+
+    snprintf(arg, sizeof(arg), "%s^{commit}", rev);
+    r = proc_output_init(&out, PULL_REV_SZ, NULL);
+    if(r < 0) return r;
+    r = pull_git(es, &out, &res, "rev-parse", "--verify", "--quiet", arg, NULL);
+    n = proc_output_tail(&out, buf, sz);
+    proc_output_free(&out);
+    while(n && (buf[n - 1] == '\n' || buf[n - 1] == '\r')) buf[--n] = 0;
+    if(r == 0 && n == 0) r = -ENOENT;
+    if(r != 0) logErr("Pull: %s unresolved (%d)", rev, r);
+    return r;
+}
+
+static void pull_event_free(void *userdata) {
+    pullEvent *ev = userdata;
+
+    free(ev->paths);
+    free(ev->data);
+    free(ev);
+}
+
+static void pull_publish(void *userdata) {
+    pullEvent *ev = userdata;
+
+    bus_pulled(ev->id, ev->from, ev->to, ev->paths);
+    pull_event_free(ev);
+}
+
+/**
+ * @brief Splits NUL separated list from git diff -z, runs hooks on every
+ *        path and hands list over for pulled signal. Paths that fit go to
+ *        list for report.
+ * @return path count, -1 when list was too long
+ */
+static int pull_changes(execStruct *es, procOutput *names, const char *from, const char *to
+                        , char *list, size_t sz) {
+    int n = 0, i;
+    size_t len, h, used = 0;
+    bool cut = false;
+    char *p, *e;
+    pullEvent *ev = calloc(1, sizeof(pullEvent));
+
+    ev->id = job_id(es->job);
+    snprintf(ev->from, sizeof(ev->from), "%s", from);
+    snprintf(ev->to, sizeof(ev->to), "%s", to);
+    ev->data = malloc(names->ringSz + 1);
+    len = names->bytes <= names->ringSz ? proc_output_tail(names, ev->data, names->ringSz + 1) : 0;
+    for(p = ev->data, e = ev->data + len; p < e; p += strlen(p) + 1) n++;
+    ev->paths = calloc(n + 1, sizeof(char*));
+    for(i = 0, p = ev->data; i < n; p += strlen(p) + 1) ev->paths[i++] = p;
+
+    if(names->bytes > names->ringSz) {
+        logWrn("Pull: change list over %zu bytes, hooks run for everything", names->ringSz);
+        for(h = 0; h < sizeof(pullHooks) / sizeof(pullHooks[0]); h++) pullHooks[h].func(NULL);
+        n = -1;
+    }
+    list[0] = 0;
+    for(i = 0; ev->paths[i]; i++) {
+        logDbg("Pull: %s changed", ev->paths[i]);
+        len = strlen(ev->paths[i]);
+        if(!cut && used + len + 5 < sz) {
+            used += snprintf(list + used, sz - used, "%s\n", ev->paths[i]);
+        } else if(!cut) {
+            snprintf(list + used, sz - used, "…\n");
+            cut = true;
+        }
+        for(h = 0; h < sizeof(pullHooks) / sizeof(pullHooks[0]); h++) {
+            if(fnmatch(pullHooks[h].pattern, ev->paths[i], 0) == 0) pullHooks[h].func(ev->paths[i]);
+        }
+    }
+
+    // Signal goes out from event loop thread, bus is not shared
+    if(loop_call(pull_publish, pull_event_free, ev) < 0) pull_event_free(ev);
+    return n;
+}
+
+/**
+ * @brief Fetch, fast-forward to upstream and hooks for paths that moved.
+ *        Nothing past fetch runs when upstream has no new commits.
+ */
+static void pull_run(execStruct *es) {
+    int r, changed = 0;
+    const char *step;
+    char from[PULL_REV_SZ], to[PULL_REV_SZ], msg[MSG_SZ], out[CMD_OUTPUT_SZ];
+    procOutput output, names;
+    procResult res = {0};
+
+    out[0] = 0;
+    if((r = pull_rev(es, "HEAD", from, sizeof(from))) != 0) {
+        step = "rev-parse";
+        goto fail;
+    }
+    r = proc_output_init(&output, CMD_OUTPUT_SZ, es->out);
+    if(r < 0) {
+        step = "init";
+        goto fail;
+    }
+    step = "fetch";
+    r = pull_git(es, &output, &res, "fetch", "--quiet", NULL);
+    if(r == 0) {
+        step = "rev-parse";
+        r = pull_rev(es, "@{upstream}", to, sizeof(to));
+    }
+    if(r == 0 && strcmp(from, to)) {
+        step = "merge";
+        r = pull_git(es, &output, &res, "merge", "--ff-only", "--quiet", "@{upstream}", NULL);
+        // Local commits ahead of upstream leave HEAD where it was
+        if(r == 0) r = pull_rev(es, "HEAD", to, sizeof(to));
+    }
+    proc_output_tail(&output, out, sizeof(out));
+    proc_output_free(&output);
+    if(r != 0) goto fail;
+
+    if(!strcmp(from, to)) {
+        snprintf(msg, MSG_SZ, "✅ Pull: up to date 🔸%.8s", from);
+        logInf("Pull: up to date at %.8s", from);
+    } else {
+        step = "diff";
+        r = proc_output_init(&names, PULL_PATHS_SZ, NULL);
+        if(r == 0) {
+            r = pull_git(es, &names, &res, "diff", "--name-only", "--no-renames", "-z", from, to, NULL);
+            if(r == 0) changed = pull_changes(es, &names, from, to, out, PROGRESS_SZ * 3);
+            proc_output_free(&names);
+        }
+        if(r != 0) goto fail;
+
+        logInf("Pull %.8s..%.8s: %d files changed", from, to, changed);
+        if(changed < 0) {
+            snprintf(msg, MSG_SZ, "✅ Pull %.8s..%.8s: too many files changed", from, to);
+        } else {
+            snprintf(msg, MSG_SZ, "✅ Pull %.8s..%.8s 🔹%d files\n```\n%s```", from, to, changed, out);
+        }
+    }
+    exec_report(es, msg);
+    // Joined while running, never answered from cache: upstream moves
+    exec_flight_done(es->flight, msg, NULL, false);
+    job_done(es->job, 0, changed > 0 ? changed : 0);
+    return;
+
+fail:
+    if(out[0]) {
+        snprintf(msg, MSG_SZ, "🛑 Pull failed at %s (%d)\n```\n%s```", step, r, out);
+    } else {
+        snprintf(msg, MSG_SZ, "🛑 Pull failed at %s (%d)", step, r);
+    }
+    logErr("Pull failed at %s (%d)", step, r);
+    exec_report(es, msg);
+    exec_flight_done(es->flight, msg, NULL, false);
+    job_done(es->job, r, 0);
+}
+
+uint64_t sys_pull(uint32_t chat) {
+    execStruct *es = exec_new(chat, "Pull");
+
+    snprintf(es->cwd, EXEC_PATH_SZ, "%s", GIT_PATH);
+    snprintf(es->out, EXEC_PATH_SZ, "%s/pull.log", gOutPath);
+    es->run = pull_run;
+    exec_arg(es, GIT_BIN);
+    exec_arg(es, "pull");
+    return exec_submit(es);
 }
 
-int sys_export(uint32_t chat, uint32_t *orders, int count) {
-    int r, i, cnt = 0;
-    pthread_t th;
+/**
+ * @brief Legacy export: one process per order, each uploads export file
+ * @return id of first job
+ */
+static uint64_t sys_export_each(uint32_t chat, uint32_t *orders, int count) {
+    int i;
+    uint64_t id, first = 0;
     char arg[EXEC_PATH_SZ] = {0};
     execStruct *es;
 
-    snprintf(arg, EXEC_PATH_SZ, "%s/export.json", OUT_PATH);
+    snprintf(arg, EXEC_PATH_SZ, "%s/export.json", gOutPath);
     unlink(arg);
-    snprintf(arg, EXEC_PATH_SZ, "%s/export.pretty.json", OUT_PATH);
+    snprintf(arg, EXEC_PATH_SZ, "%s/export.pretty.json", gOutPath);
     unlink(arg);
 
     for(i = 0; i < count; i++) {
-        es = calloc(1, sizeof(execStruct));
-        es->chat = chat;
-        es->flag = ExecDoc;
-        sprintf(es->title, "export_%u", orders[i]);
-        snprintf(es->path, EXEC_PATH_SZ, "%s/export/export_orders.php %s/export -o %u", SCRIPTS_PATH, OUT_PATH, orders[i]);
+        char title[64];
+        snprintf(title, sizeof(title), "export_%u", orders[i]);
+        es = exec_new(chat, title);
+        es->flag = ExecDoc | ExecPhp;
+        exec_arg(es, "%s/export/export_orders.php", gScriptsPath);
+        exec_arg(es, "%s/export", gOutPath);
+        exec_arg(es, "-o");
+        exec_arg(es, "%u", orders[i]);
         strcpy(es->doc, arg);
-        r = pthread_create(&th, NULL, exec_thread, es);
-        if (r != 0) {
-            logErr("Export[%u] thread creation failed(%d): %s", orders[i], r, strerror(abs(r)));
-        } else {
-            cnt++;
-        }
+        id = exec_submit(es);
+        if (!first) first = id;
     }
-    return cnt;
+    return first;
 }
 
-int sys_clear(uint32_t chat, uint32_t *orders, int count) {
-    int r, cnt;
-    pthread_t th;
-    char arg[TAIL_CMD_SZ] = {0};
-    execStruct *es = calloc(1, sizeof(execStruct));
+static int exec_cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
 
-    es->chat = chat;
-    sprintf(es->title, "clear");
-    cnt = snprintf(es->path, EXEC_PATH_SZ, "%s/check/m_clean_orders.php -o", SCRIPTS_PATH);
+uint64_t sys_clear(uint32_t chat, uint32_t *orders, int count) {
+    int r;
+    execStruct *es = exec_new(chat, "clear");
+
+    exec_arg(es, "%s/check/m_clean_orders.php", gScriptsPath);
+    exec_arg(es, "-o");
+    // Sorted and unique, so same set in any order is one job
+    qsort(orders, count, sizeof(uint32_t), exec_cmp_u32);
     for(r = 0; r < count; r++) {
-        cnt += snprintf(arg, TAIL_CMD_SZ, " %u", orders[r]);
-        strcat(es->path, arg);
+        if(r > 0 && orders[r] == orders[r - 1]) continue;
+        if(exec_arg(es, "%u", orders[r]) < 0) {
+            logErr("Clear: too many orders (%d)", count);
+            exec_free(es);
+            return 0;
+        }
     }
-    cnt += snprintf(arg, TAIL_CMD_SZ, " > %s/clear.log", OUT_PATH);
-    strcat(es->path, arg);
+    snprintf(es->out, EXEC_PATH_SZ, "%s/clear.log", gOutPath);
+    es->flag = ExecLive | ExecPhp;
+    return exec_submit(es);
+}
 
-    r = pthread_create(&th, NULL, exec_thread, es);
-    if (r != 0) {
-        logErr("GeoFences thread creation failed(%d): %s", r, strerror(abs(r)));
-        return 0;
+/**
+ * @brief Batched export: orders are split into EXPORT_SHARDS contiguous
+ *        chunks, one process each, merged result is uploaded once
+ */
+uint64_t sys_export(uint32_t chat, uint32_t *orders, int count) {
+    int i, s, shards, from, to;
+    uint64_t id;
+    char msg[MSG_SZ], path[EXEC_PATH_SZ];
+    execBatch *eb;
+    execStruct *es;
+    procResult none = {0};
+
+    if(EXPORT_SHARDS == 0) return sys_export_each(chat, orders, count);
+    if(count < 1) return 0;
+
+    shards = count < EXPORT_SHARDS ? count : EXPORT_SHARDS;
+    if(shards > EXPORT_SHARDS_MAX) shards = EXPORT_SHARDS_MAX;
+    eb = calloc(1, sizeof(execBatch));
+    eb->chat = chat;
+    eb->shards = shards;
+    eb->orders = count;
+    eb->start = exec_now();
+    atomic_init(&eb->left, shards);
+    eb->job = job_new("export", chat);
+    id = job_id(eb->job);
+
+    snprintf(msg, MSG_SZ, "⏳ Export %d orders: 0/%d shards done", count, shards);
+    eb->live = report_live_open(chat, msg, 0);
+
+    for(s = 0; s < shards; s++) {
+        from = (int)((int64_t)count * s / shards);
+        to = (int)((int64_t)count * (s + 1) / shards);
+        snprintf(msg, sizeof(msg), "export %d/%d", s + 1, shards);
+        es = exec_new(chat, msg);
+        es->batch = eb;
+        es->job = eb->job;
+        es->flag = ExecPhp;
+        exec_arg(es, "%s/export/export_orders.php", gScriptsPath);
+        exec_shard_path(path, sizeof(path), id, s, "");
+        exec_arg(es, "%s", path);
+        exec_arg(es, "-o");
+        for(i = from; i < to; i++) {
+            if(exec_arg(es, "%u", orders[i]) < 0) break;
+        }
+        // Left over by run before restart, job ids start over
+        exec_shard_path(path, sizeof(path), id, s, ".json");
+        unlink(path);
+
+        if(i < to) {
+            logErr("Export shard %d: too many orders (%d)", s, to - from);
+            exec_free(es);
+        } else if(exec_submit(es) > 0) {
+            continue;
+        }
+        // Shard never runs, account it here (may finish batch)
+        exec_batch_done(eb, true, &none);
     }
-    return (int)th;
-}
\ No newline at end of file
+    return id;
+}
+
+/**
+ * @brief Drops cached results, jobs must be finished (pool stopped)
+ */
+void sys_deinit() {
+    execFlight *f;
+
+    pthread_mutex_lock(&flightLock);
+    while((f = flights)) {
+        flights = f->next;
+        exec_flight_unref(f);
+    }
+    pthread_mutex_unlock(&flightLock);
+    tail_deinit();
+}
@@ -0,0 +1,262 @@
+#define LOG_MODULE  LOG_MOD_SYS
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tail.h"
+#include "debug.h"
+
+#define TAIL_LINES_MAX  100000          // Larger requests are clamped
+#define TAIL_INDEX_MAX  (2 * TAIL_LINES_MAX)
+#define TAIL_BLOCK      (64 * 1024)     // Scanned per read
+
+// Log kept open, with newline offsets of its end. Index covers
+// [base, end): entries are every '\n' in that range, ascending. It grows
+// forward as file is appended to and backward on demand. File is read
+// with pread, so truncation under read shows as short read, not fault.
+typedef struct tailS {
+    pthread_mutex_t lock;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    char *blk;                  // TAIL_BLOCK
+    size_t size;                // File size at last check
+    size_t base;
+    size_t end;
+    off_t *nl;
+    size_t cnt;
+    size_t cap;
+} tailStruct;
+
+// Local variables
+static tailStruct tail = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+static void tail_reset() {
+    if(tail.fd >= 0) close(tail.fd);
+    tail.size = 0;
+    tail.fd = -1;
+    tail.base = tail.end = 0;
+    tail.cnt = 0;
+}
+
+static int tail_reserve(size_t n) {
+    size_t cap = tail.cap ? tail.cap : 1024;
+    off_t *nl;
+
+    while(cap < n) cap *= 2;
+    if(cap == tail.cap) return 0;
+    nl = realloc(tail.nl, cap * sizeof(off_t));
+    if(!nl) return -ENOMEM;
+    tail.nl = nl;
+    tail.cap = cap;
+    return 0;
+}
+
+/**
+ * @brief Opens log again when it was rotated or truncated, notes new size
+ */
+static int tail_open(const char *path) {
+    struct stat st;
+
+    if(!tail.blk && !(tail.blk = malloc(TAIL_BLOCK))) return -ENOMEM;
+    if(stat(path, &st) < 0) return -errno;
+    if(tail.fd >= 0 && (st.st_dev != tail.dev || st.st_ino != tail.ino || (size_t)st.st_size < tail.end)) {
+        logDbg("Tail %s rotated, index dropped", path);
+        tail_reset();
+    }
+    if(tail.fd < 0) {
+        tail.fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(tail.fd < 0 || fstat(tail.fd, &st) < 0) {
+            int r = -errno;
+            tail_reset();
+            return r;
+        }
+        tail.dev = st.st_dev;
+        tail.ino = st.st_ino;
+    }
+    tail.size = st.st_size;
+    return 0;
+}
+
+/**
+ * @brief Collects newlines of [from, to) backward, at most max of them
+ * @return found count, tmp is descending; -ESTALE when file got shorter
+ */
+static ssize_t tail_scan(size_t from, size_t to, size_t max, off_t *tmp) {
+    size_t found = 0, n;
+    ssize_t got;
+    char *p;
+
+    while(found < max && to > from) {
+        n = to - from < TAIL_BLOCK ? to - from : TAIL_BLOCK;
+        got = pread(tail.fd, tail.blk, n, to - n);
+        if(got < 0 && errno == EINTR) continue;
+        if(got < 0) return -errno;
+        if((size_t)got < n) return -ESTALE;
+        for(p = tail.blk + n; found < max && (p = memrchr(tail.blk, '\n', p - tail.blk)); ) {
+            tmp[found++] = to - n + (p - tail.blk);
+        }
+        to -= n;
+    }
+    return found;
+}
+
+/**
+ * @brief Indexes data appended since last call. When appended part alone
+ *        holds need lines older index is dropped.
+ */
+static int tail_grow(size_t need) {
+    size_t i, drop;
+    ssize_t found;
+    off_t *tmp;
+
+    if(tail.end == tail.size) return 0;
+    tmp = malloc(need * sizeof(off_t));
+    if(!tmp) return -ENOMEM;
+    found = tail_scan(tail.end, tail.size, need, tmp);
+    if(found < 0) {
+        free(tmp);
+        return found;
+    }
+    if((size_t)found == need) {
+        tail.cnt = 0;
+        tail.base = tmp[found - 1];
+    }
+    if(tail_reserve(tail.cnt + found) < 0) {
+        free(tmp);
+        return -ENOMEM;
+    }
+    for(i = 0; i < found; i++) {
+        tail.nl[tail.cnt++] = tmp[found - 1 - i];
+    }
+    tail.end = tail.size;
+    free(tmp);
+
+    if(tail.cnt > TAIL_INDEX_MAX) {
+        drop = tail.cnt - TAIL_LINES_MAX - 1;
+        memmove(tail.nl, tail.nl + drop, (tail.cnt - drop) * sizeof(off_t));
+        tail.cnt -= drop;
+        tail.base = tail.nl[0];
+    }
+    return 0;
+}
+
+/**
+ * @brief Scans backward from base until index has need newlines
+ */
+static int tail_extend(size_t need) {
+    size_t i;
+    ssize_t found;
+    off_t *tmp;
+
+    if(tail.cnt >= need || tail.base == 0) return 0;
+    need -= tail.cnt;
+    tmp = malloc(need * sizeof(off_t));
+    if(!tmp) return -ENOMEM;
+    found = tail_scan(0, tail.base, need, tmp);
+    if(found < 0) {
+        free(tmp);
+        return found;
+    }
+    if(tail_reserve(tail.cnt + found) < 0) {
+        free(tmp);
+        return -ENOMEM;
+    }
+    memmove(tail.nl + found, tail.nl, tail.cnt * sizeof(off_t));
+    for(i = 0; i < found; i++) {
+        tail.nl[i] = tmp[found - 1 - i];
+    }
+    tail.cnt += found;
+    tail.base = (size_t)found < need ? 0 : (size_t)tail.nl[0];
+    free(tmp);
+    return 0;
+}
+
+/**
+ * @brief Finds start of last count lines, final line may lack newline
+ */
+static size_t tail_start(int count) {
+    size_t lines = tail.cnt;
+
+    // Newline ending the file terminates last line, it does not start one
+    if(lines && (size_t)tail.nl[lines - 1] == tail.size - 1) lines--;
+    if(lines >= (size_t)count) return tail.nl[lines - count] + 1;
+    return 0;
+}
+
+/**
+ * @brief Last count lines of path, read in place without spawning
+ *        anything. All lines go to fd when it is valid, buf gets their end
+ *        cut to whole lines like proc_output_tail. Log truncated under
+ *        read is indexed again once, then read error is returned.
+ * @return bytes of requested lines or negative errno
+ */
+ssize_t tail_read(const char *path, int count, int fd, char *buf, size_t sz) {
+    int r, retry = 1;
+    size_t start, n, i, len = 0;
+    off_t off;
+    ssize_t w;
+
+    if(count < 1) count = 1;
+    if(count > TAIL_LINES_MAX) count = TAIL_LINES_MAX;
+    if(sz) buf[0] = 0;
+
+    pthread_mutex_lock(&tail.lock);
+    do {
+        r = tail_open(path);
+        if(r == 0) r = tail_grow(count + 1);
+        if(r == 0) r = tail_extend(count + 1);
+        if(r == -ESTALE && retry) {
+            logDbg("Tail %s truncated while read, indexed again", path);
+            tail_reset();
+        }
+    } while(r == -ESTALE && retry--);
+    if(r < 0) {
+        pthread_mutex_unlock(&tail.lock);
+        return r;
+    }
+    start = tail.size ? tail_start(count) : 0;
+    len = tail.size - start;
+
+    for(off = start, i = 0; fd >= 0 && i < len; i += w) {
+        w = sendfile(fd, tail.fd, &off, len - i);
+        if(w < 0 && errno == EINTR) {
+            w = 0;
+        } else if(w < 0) {
+            r = -errno;
+            break;
+        } else if(w == 0) {
+            len = i;            // Truncated meanwhile
+            break;
+        }
+    }
+    if(sz) {
+        n = len < sz - 1 ? len : sz - 1;
+        w = n ? pread(tail.fd, buf, n, start + len - n) : 0;
+        n = w > 0 ? (size_t)w : 0;
+        buf[n] = 0;
+        if(n < len) {
+            for(i = 0; i < n && buf[i] != '\n'; i++);
+            if(i < n) memmove(buf, buf + i + 1, n - i);
+        }
+    }
+    pthread_mutex_unlock(&tail.lock);
+    return r < 0 ? r : (ssize_t)len;
+}
+
+void tail_deinit() {
+    pthread_mutex_lock(&tail.lock);
+    tail_reset();
+    free(tail.nl);
+    free(tail.blk);
+    tail.nl = NULL;
+    tail.blk = NULL;
+    tail.cap = 0;
+    pthread_mutex_unlock(&tail.lock);
+}
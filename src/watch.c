@@ -0,0 +1,341 @@
+#define LOG_MODULE  LOG_MOD_SYS
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <systemd/sd-event.h>
+
+#include "config.h"
+#include "watch.h"
+#include "loop.h"
+#include "metrics.h"
+#include "report.h"
+#include "sys.h"
+#include "debug.h"
+
+#define WATCH_BUCKETS   256
+#define WATCH_KEYS_MAX  512     // Fingerprints per interval, rest is counted only
+#define WATCH_REPORT_MAX 20     // Summaries sent per interval
+#define WATCH_CHUNK     65536
+#define WATCH_MSG_SZ    160     // Normalised message kept in fingerprint
+
+typedef struct watchEntryS {
+    struct watchEntryS *next;
+    uint64_t hash;
+    unsigned count;
+    char kind[48];              // Exception class or error level
+    char where[96];             // file.php:line
+    char msg[WATCH_MSG_SZ];
+} watchEntry;
+
+typedef struct watchS {
+    int fd;                     // inotify
+    int wd;
+    int logFd;
+    off_t offset;               // Read up to, always at line start
+    char dir[512];
+    char name[256];
+    sd_event_source *ioSrc;
+    sd_event_source *timeSrc;
+    watchEntry *bucket[WATCH_BUCKETS];
+    int keys;
+    unsigned dropped;           // Entries over WATCH_KEYS_MAX
+    metric *seen;
+} watchStruct;
+
+// Local variables
+static watchStruct watch = { .fd = -1, .wd = -1, .logFd = -1 };
+
+static uint64_t watch_hash(const char *s, uint64_t h) {
+    for(; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * @brief Numbers become '#', quoted text becomes '?', so values that
+ *        differ between occurrences do not split fingerprint
+ */
+static void watch_normalise(const char *s, size_t len, char *out, size_t sz) {
+    size_t i, o = 0;
+    char q;
+
+    for(i = 0; i < len && o + 1 < sz; i++) {
+        if(isdigit((unsigned char)s[i])) {
+            while(i + 1 < len && (isdigit((unsigned char)s[i + 1]) || s[i + 1] == '.')) i++;
+            out[o++] = '#';
+        } else if(s[i] == '"' || s[i] == '\'') {
+            q = s[i];
+            while(i + 1 < len && s[i + 1] != q) i++;
+            i++;
+            out[o++] = '?';
+        } else {
+            out[o++] = s[i];
+        }
+    }
+    out[o] = 0;
+}
+
+/**
+ * @brief Splits "... in /path/file.php:120" or "... in /path/file.php on
+ *        line 120" off message end
+ * @return message length without location
+ */
+static size_t watch_location(const char *s, size_t len, char *where, size_t sz) {
+    const char *p, *in = NULL, *file, *line;
+    size_t n;
+
+    for(p = s; (p = memmem(p, len - (p - s), " in /", 5)); p++) in = p;
+    where[0] = 0;
+    if(!in) return len;
+    file = in + 4;
+    line = memmem(file, len - (file - s), " on line ", 9);
+    if(line) {
+        n = line - file;
+        line += 9;
+    } else {
+        for(line = s + len; line > file && isdigit((unsigned char)line[-1]); line--);
+        if(line == s + len || line[-1] != ':') return len;
+        n = line - 1 - file;
+    }
+    for(p = file + n; p > file && p[-1] != '/'; p--);
+    snprintf(where, sz, "%.*s:%.*s", (int)(file + n - p), p, (int)(s + len - line), line);
+    return in - s;
+}
+
+/**
+ * @brief Fingerprints one log entry:
+ *        "[date] PHP Fatal error:  Uncaught TypeError: msg in /x/a.php:120"
+ */
+static void watch_entry(const char *s, size_t len) {
+    const char *e = s + len, *p, *colon;
+    char kind[48], where[96], msg[WATCH_MSG_SZ];
+    size_t n;
+    uint64_t h;
+    watchEntry *we;
+
+    if(len < 2 || s[0] != '[' || !(p = memchr(s, ']', len))) return;  // Stack trace and such
+    for(p++; p < e && *p == ' '; p++);
+    if(e - p > 4 && memcmp(p, "PHP ", 4) == 0) p += 4;
+    colon = memchr(p, ':', e - p);
+    if(!colon) return;
+    snprintf(kind, sizeof(kind), "%.*s", (int)(colon - p), p);
+    for(p = colon + 1; p < e && *p == ' '; p++);
+    if(e - p > 9 && memcmp(p, "Uncaught ", 9) == 0) {
+        p += 9;
+        for(colon = p; colon < e && !isspace((unsigned char)*colon) && *colon != ':'; colon++);
+        if(colon < e && *colon == ':') {
+            snprintf(kind, sizeof(kind), "%.*s", (int)(colon - p), p);
+            for(p = colon + 1; p < e && *p == ' '; p++);
+        }
+    }
+    n = watch_location(p, e - p, where, sizeof(where));
+    watch_normalise(p, n, msg, sizeof(msg));
+    metrics_add(watch.seen, 1);
+
+    h = watch_hash(msg, watch_hash(where, watch_hash(kind, 0xcbf29ce484222325ULL)));
+    for(we = watch.bucket[h % WATCH_BUCKETS]; we; we = we->next) {
+        if(we->hash == h && !strcmp(we->kind, kind) && !strcmp(we->where, where) && !strcmp(we->msg, msg)) {
+            we->count++;
+            return;
+        }
+    }
+    if(watch.keys >= WATCH_KEYS_MAX) {
+        watch.dropped++;
+        return;
+    }
+    we = calloc(1, sizeof(watchEntry));
+    we->hash = h;
+    we->count = 1;
+    strcpy(we->kind, kind);
+    strcpy(we->where, where);
+    strcpy(we->msg, msg);
+    we->next = watch.bucket[h % WATCH_BUCKETS];
+    watch.bucket[h % WATCH_BUCKETS] = we;
+    watch.keys++;
+}
+
+/**
+ * @brief Opens log anew after rotation, first open starts at its end
+ */
+static int watch_open(bool fromEnd) {
+    char path[sizeof(watch.dir) + sizeof(watch.name)];
+    struct stat st;
+
+    if(watch.logFd >= 0) close(watch.logFd);
+    snprintf(path, sizeof(path), "%s/%s", watch.dir, watch.name);
+    watch.logFd = open(path, O_RDONLY | O_CLOEXEC);
+    if(watch.logFd < 0 || fstat(watch.logFd, &st) < 0) {
+        if(watch.logFd >= 0) close(watch.logFd);
+        watch.logFd = -1;
+        return -errno;
+    }
+    watch.offset = fromEnd ? st.st_size : 0;
+    return 0;
+}
+
+/**
+ * @brief Parses whole lines appended since saved offset
+ */
+static void watch_read() {
+    char buf[WATCH_CHUNK], *p, *nl, *e;
+    ssize_t n;
+    struct stat st;
+
+    if(watch.logFd < 0 && watch_open(false) < 0) return;
+    if(fstat(watch.logFd, &st) == 0 && st.st_size < watch.offset) {
+        logDbg("PHP log truncated, reading from start");
+        watch.offset = 0;
+    }
+    while((n = pread(watch.logFd, buf, sizeof(buf), watch.offset)) > 0) {
+        e = buf + n;
+        for(p = buf; p < e && (nl = memchr(p, '\n', e - p)); p = nl + 1) {
+            watch_entry(p, nl - p);
+        }
+        if(p == buf && n == sizeof(buf)) {
+            p = e;      // Line longer than chunk, skipped
+        }
+        watch.offset += p - buf;
+        if(n < (ssize_t)sizeof(buf)) break;     // Partial line comes with next write
+    }
+}
+
+static int watch_inotify_cb(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t n;
+    char *p;
+    bool changed = false, rotated = false;
+
+    while((n = read(fd, buf, sizeof(buf))) > 0) {
+        for(p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *)p;
+            if(!ev->len || strcmp(ev->name, watch.name)) continue;
+            if(ev->mask & (IN_CREATE | IN_MOVED_TO)) rotated = true;
+            changed = true;
+        }
+    }
+    if(rotated) {
+        // Finish old file first, it may have got entries before the move
+        if(watch.logFd >= 0) watch_read();
+        watch_open(false);
+    }
+    if(changed) watch_read();
+    return 0;
+}
+
+static int watch_cmp(const void *a, const void *b) {
+    unsigned ca = (*(watchEntry * const *)a)->count, cb = (*(watchEntry * const *)b)->count;
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+/**
+ * @brief Sends one summary per fingerprint seen during interval, most
+ *        frequent first, and starts counting over
+ */
+static int watch_timer_cb(sd_event_source *s, uint64_t usec, void *userdata) {
+    char msg[512], period[16];
+    watchEntry *list[WATCH_KEYS_MAX], *we;
+    int i, n = 0;
+
+    sd_event_source_set_time(s, usec + PHP_WATCH_INTERVAL_S * 1000000ULL);
+    sd_event_source_set_enabled(s, SD_EVENT_ON);
+    watch_read();
+
+    for(i = 0; i < WATCH_BUCKETS; i++) {
+        for(we = watch.bucket[i]; we; we = we->next) list[n++] = we;
+        watch.bucket[i] = NULL;
+    }
+    qsort(list, n, sizeof(list[0]), watch_cmp);
+    if(PHP_WATCH_INTERVAL_S % 60) snprintf(period, sizeof(period), "%d s", PHP_WATCH_INTERVAL_S);
+    else snprintf(period, sizeof(period), "%d min", PHP_WATCH_INTERVAL_S / 60);
+
+    for(i = 0; i < n && i < WATCH_REPORT_MAX; i++) {
+        we = list[i];
+        snprintf(msg, sizeof(msg), "⚠️ %s in %s ×%u in %s\n%s", we->kind
+            , we->where[0] ? we->where : "?", we->count, period, we->msg);
+        send_report(PHP_WATCH_CHAT, msg, 0);
+    }
+    if(n > WATCH_REPORT_MAX || watch.dropped) {
+        snprintf(msg, sizeof(msg), "⚠️ %d more PHP error kinds, %u entries not fingerprinted in %s"
+            , n > WATCH_REPORT_MAX ? n - WATCH_REPORT_MAX : 0, watch.dropped, period);
+        send_report(PHP_WATCH_CHAT, msg, 0);
+    }
+    if(n) logInf("PHP log: %d error kinds in %s", n, period);
+    for(i = 0; i < n; i++) free(list[i]);
+    watch.keys = 0;
+    watch.dropped = 0;
+    return 0;
+}
+
+/**
+ * @brief Watches PHP log directory, so log created or rotated later is
+ *        still followed
+ */
+int watch_init() {
+    int r;
+    char tmp[sizeof(watch.dir)];
+
+    if(!PHP_WATCH_CHAT || !PHP_WATCH_INTERVAL_S) return 0;
+    snprintf(tmp, sizeof(tmp), "%s", gPhpLog);
+    snprintf(watch.dir, sizeof(watch.dir), "%s", dirname(tmp));
+    snprintf(tmp, sizeof(tmp), "%s", gPhpLog);
+    snprintf(watch.name, sizeof(watch.name), "%s", basename(tmp));
+
+    watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(watch.fd < 0) {
+        logErr("PHP watch inotify error(%d): %m", errno);
+        return -errno;
+    }
+    watch.wd = inotify_add_watch(watch.fd, watch.dir, IN_MODIFY | IN_CREATE | IN_MOVED_TO);
+    if(watch.wd < 0) {
+        r = -errno;
+        logErr("PHP watch %s error(%d): %s", watch.dir, r, strerror(-r));
+        watch_deinit();
+        return r;
+    }
+    r = sd_event_add_io(loop_event(), &watch.ioSrc, watch.fd, EPOLLIN, watch_inotify_cb, NULL);
+    if(r >= 0) {
+        r = sd_event_add_time_relative(loop_event(), &watch.timeSrc, CLOCK_MONOTONIC
+            , PHP_WATCH_INTERVAL_S * 1000000ULL, 0, watch_timer_cb, NULL);
+    }
+    if(r >= 0) r = sd_event_source_set_enabled(watch.timeSrc, SD_EVENT_ON);
+    if(r < 0) {
+        logErr("PHP watch source error(%d): %s", r, strerror(-r));
+        watch_deinit();
+        return r;
+    }
+    watch.seen = metrics_get(MetricCounter, "executor_php_errors_total", "PHP log entries seen by watcher", NULL);
+    if(watch_open(true) < 0) logWrn("PHP log %s missing, waiting for it", gPhpLog);
+    logInf("Watching %s, summary every %ds", gPhpLog, PHP_WATCH_INTERVAL_S);
+    return 0;
+}
+
+void watch_deinit() {
+    int i;
+    watchEntry *we;
+
+    watch.ioSrc = sd_event_source_disable_unref(watch.ioSrc);
+    watch.timeSrc = sd_event_source_disable_unref(watch.timeSrc);
+    if(watch.fd >= 0) close(watch.fd);
+    if(watch.logFd >= 0) close(watch.logFd);
+    watch.fd = watch.wd = watch.logFd = -1;
+    for(i = 0; i < WATCH_BUCKETS; i++) {
+        while((we = watch.bucket[i])) {
+            watch.bucket[i] = we->next;
+            free(we);
+        }
+    }
+    watch.keys = 0;
+}
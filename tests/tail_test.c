@@ -0,0 +1,113 @@
+// Index of src/tail.c: forward growth, backward extension, trimming
+// and truncation under read. Includes source to reach static state.
+#include "../src/tail.c"
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#define TEST_LOG    "tail_test.log"
+
+_Atomic int gLogLevels[LOG_MOD_MAX + 1];
+
+void selfLogFunction(const char *file, int line, const char *func, int lvl, const char *fmt, ...) {
+}
+
+static void append(int from, int count) {
+    FILE *f = fopen(TEST_LOG, "a");
+    int i;
+
+    for(i = from; i < from + count; i++) fprintf(f, "line %d\n", i);
+    fclose(f);
+}
+
+/**
+ * @brief Index holds exactly the newlines of [base, end), ascending
+ */
+static void check_index() {
+    size_t i, n = 0, off;
+    char c;
+    int fd = open(TEST_LOG, O_RDONLY);
+
+    assert(tail.end == tail.size);
+    for(i = 0; i < tail.cnt; i++) {
+        assert(i == 0 || tail.nl[i] > tail.nl[i - 1]);
+        assert(pread(fd, &c, 1, tail.nl[i]) == 1 && c == '\n');
+    }
+    assert(tail.cnt == 0 || tail.base == (size_t)tail.nl[0] || tail.base == 0);
+    for(off = tail.base; off < tail.end; off++) {
+        assert(pread(fd, &c, 1, off) == 1);
+        n += c == '\n';
+    }
+    assert(n == tail.cnt);
+    close(fd);
+}
+
+/**
+ * @brief Reads last count lines and checks they are lines last-count..last
+ */
+static void check_tail(int count, int last) {
+    char buf[64], want[64];
+    ssize_t r = tail_read(TEST_LOG, count, -1, buf, sizeof(buf));
+
+    assert(r > 0);
+    snprintf(want, sizeof(want), "line %d\n", last);
+    assert(strstr(buf, want));
+    check_index();
+}
+
+int main() {
+    int fd;
+
+    unlink(TEST_LOG);
+    append(0, 1000);
+
+    // First read indexes only what is asked for
+    check_tail(5, 999);
+    assert(tail.cnt == 6);
+
+    // Larger request extends index backward
+    check_tail(50, 999);
+    assert(tail.cnt == 51);
+
+    // Few appended lines join existing index
+    append(1000, 3);
+    check_tail(50, 1002);
+    assert(tail.cnt == 54);
+
+    // Appended part holding whole request replaces index
+    append(1003, 100);
+    check_tail(10, 1102);
+    assert(tail.cnt == 11);
+
+    // Request over start of file indexes all of it
+    check_tail(5000, 1102);
+    assert(tail.base == 0 && tail.cnt == 1103);
+
+    // Index over TAIL_INDEX_MAX is cut to TAIL_LINES_MAX + 1 newlines
+    unlink(TEST_LOG);
+    append(0, TAIL_LINES_MAX);
+    check_tail(TAIL_LINES_MAX, TAIL_LINES_MAX - 1);
+    append(TAIL_LINES_MAX, TAIL_LINES_MAX - 1);
+    check_tail(TAIL_LINES_MAX, 2 * TAIL_LINES_MAX - 2);
+    assert(tail.cnt <= TAIL_INDEX_MAX);
+    append(2 * TAIL_LINES_MAX - 1, 2);
+    check_tail(TAIL_LINES_MAX, 2 * TAIL_LINES_MAX);
+    assert(tail.cnt == TAIL_LINES_MAX + 1);
+
+    // Truncation between size check and scan is a short read, not a fault
+    append(2 * TAIL_LINES_MAX + 1, 10);
+    assert(tail_open(TEST_LOG) == 0);
+    fd = open(TEST_LOG, O_WRONLY);
+    assert(ftruncate(fd, 0) == 0);
+    close(fd);
+    assert(tail_grow(2) == -ESTALE);
+    append(0, 20);
+    check_tail(3, 19);
+    assert(tail.cnt == 4);
+
+    tail_deinit();
+    unlink(TEST_LOG);
+    printf("tail: ok\n");
+    return 0;
+}